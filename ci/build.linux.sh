@@ -19,3 +19,4 @@
 set -e
 
 ./build
+./build test
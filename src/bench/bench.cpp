@@ -0,0 +1,75 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+bool bench_block_map(int argc, char** argv);
+bool bench_fast_bit(int argc, char** argv);
+bool bench_slice(int argc, char** argv);
+
+struct suite
+{
+	const char* name;
+	bool (*run)(int argc, char** argv);
+	const char* help;
+};
+
+static const suite s_suites[] = {
+	{ "block_map", bench_block_map, "[--op=read|write|mixed] [--pattern=seq|rand] [--qd=N] [--reopen] [--json] ...  throughput and latency" },
+	{ "fast_bit", bench_fast_bit, "[<elements>...]  set/find_set cost, default 1M 100M 2G" },
+	{ "slice", bench_slice, "[<dir>]  buffer and block I/O cost with heap allocations, default /tmp/bench_slice" },
+};
+
+uint64_t bench_nsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t parse_count(const char* str)
+{
+	char* end;
+	uint64_t r = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'K': r *= 1000ull; end++; break;
+	case 'M': r *= 1000000ull; end++; break;
+	case 'G': r *= 1000000000ull; end++; break;
+	}
+	return *end ? 0 : r;
+}
+
+int main(int argc, char** argv)
+{	
+	openlog("safedisk", LOG_PERROR, LOG_DAEMON);
+	if (argc >= 2) {
+		for (const suite& s : s_suites) {
+			if (strcmp(argv[1], s.name) == 0) {
+				return s.run(argc - 2, argv + 2) ? 0 : 1;
+			}
+		}
+	}
+	fprintf(stderr, "usage: %s <suite> [options]\n", argv[0]);
+	for (const suite& s : s_suites) {
+		fprintf(stderr, "  %s %s\n", s.name, s.help);
+	}
+	return 1;
+}
@@ -0,0 +1,43 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+
+// Monotonic time in nanoseconds, for timing runs
+uint64_t bench_nsecs();
+
+// Parses a count with an optional K, M or G suffix (powers of 1000), 0 on error
+uint64_t parse_count(const char* str);
+
+// Small, fast PRNG so random numbers don't dominate the timings
+class bench_rand
+{
+public:
+	bench_rand(uint64_t seed = 88172645463325252ull) : m_state(seed) {}
+	uint64_t next() 
+	{
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 7;
+		m_state ^= m_state << 17;
+		return m_state;
+	}
+
+private:
+	uint64_t m_state;
+};
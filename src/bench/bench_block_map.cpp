@@ -0,0 +1,222 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "block_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+
+struct workload
+{
+	uint64_t blocks = 65536;
+	uint64_t ops = 100000;
+	string   pattern = "rand";  // seq or rand
+	string   op = "write";      // read, write or mixed
+	uint32_t read_pct = 70;     // Reads out of 100 ops when mixed
+	uint32_t qd = 1;            // Threads with one op outstanding each
+	bool     reopen = false;    // Close and reopen between fill and the run
+	bool     json = false;
+	size_t   map_budget = 0;
+	size_t   readahead = s_default_readahead;
+	string   dir = "/tmp/bench_block_map";
+
+	bool parse(int argc, char** argv);
+};
+
+struct phase_result
+{
+	string           name;
+	uint64_t         ops;
+	uint64_t         nsecs;
+	vector<uint32_t> latency;  // Per op, in ns
+};
+
+static const char* s_usage = 
+	"[--blocks=N] [--ops=N] [--pattern=seq|rand] [--op=read|write|mixed] [--read_pct=N] "
+	"[--qd=N] [--reopen] [--json] [--map_budget=bytes] [--readahead=bytes] [--dir=path]";
+
+bool workload::parse(int argc, char** argv)
+{
+	for (int i = 0; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		string value = eq == string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--reopen") {
+			reopen = true;
+		} else if (key == "--json") {
+			json = true;
+		} else if (key == "--pattern" && (value == "seq" || value == "rand")) {
+			pattern = value;
+		} else if (key == "--op" && (value == "read" || value == "write" || value == "mixed")) {
+			op = value;
+		} else if (key == "--dir" && !value.empty()) {
+			dir = value;
+		} else if (key == "--blocks" && (blocks = parse_count(value.c_str())) != 0 && blocks < 0x80000000) {
+		} else if (key == "--ops" && (ops = parse_count(value.c_str())) != 0) {
+		} else if (key == "--qd" && (qd = parse_count(value.c_str())) != 0 && qd <= 1024) {
+		} else if (key == "--read_pct" && (read_pct = atoi(value.c_str())) <= 100) {
+		} else if (key == "--map_budget" && (map_budget = parse_count(value.c_str())) != 0) {
+		} else if (key == "--readahead" && !value.empty()) {
+			readahead = parse_count(value.c_str());
+		} else {
+			fprintf(stderr, "Invalid option: %s\nusage: bench block_map %s\n", argv[i], s_usage);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs ops spread over qd threads, all calling into the map at once
+static bool run_phase(block_map& bm, const workload& w, const string& op, uint64_t ops, phase_result& out)
+{
+	std::atomic<bool> ok(true);
+	vector<vector<uint32_t>> latency(w.qd);
+	uint64_t start = bench_nsecs();
+	vector<std::thread> threads;
+	for (uint32_t t = 0; t < w.qd; t++) {
+		threads.emplace_back([&, t]() {
+			bench_rand rnd(88172645463325252ull + t);
+			slice_t data(s_bytes_per_block);
+			for (size_t i = 0; i < s_bytes_per_block; i++) {
+				data[i] = char(rnd.next());
+			}
+			char buf[s_bytes_per_block];
+			uint64_t count = ops / w.qd + (t < ops % w.qd ? 1 : 0);
+			uint64_t next = w.blocks * t / w.qd;
+			latency[t].reserve(count);
+			for (uint64_t i = 0; i < count; i++) {
+				uint32_t logical = w.pattern == "seq" ? next++ % w.blocks : rnd.next() % w.blocks;
+				bool write = op == "write" || (op == "mixed" && rnd.next() % 100 >= w.read_pct);
+				uint64_t op_start = bench_nsecs();
+				bool r = write ? 
+					bm.write(logical, data) : 
+					bm.read_into(logical, slice_t::wrap(buf, sizeof(buf)));
+				latency[t].push_back(uint32_t(std::min(bench_nsecs() - op_start, uint64_t(0xffffffff))));
+				if (!r) {
+					ok = false;
+					return;
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	out.name = op;
+	out.ops = ops;
+	out.nsecs = bench_nsecs() - start;
+	out.latency.clear();
+	for (const auto& l : latency) {
+		out.latency.insert(out.latency.end(), l.begin(), l.end());
+	}
+	std::sort(out.latency.begin(), out.latency.end());
+	if (!ok) {
+		fprintf(stderr, "block_map %s failed\n", op.c_str());
+	}
+	return ok;
+}
+
+static double percentile_us(const vector<uint32_t>& sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t i = std::min(size_t(p * sorted.size()), sorted.size() - 1);
+	return sorted[i] / 1000.0;
+}
+
+static void report(const workload& w, const vector<phase_result>& phases, double open_secs)
+{
+	if (!w.json) {
+		printf("block_map blocks=%ju pattern=%s qd=%u%s\n", 
+			uintmax_t(w.blocks), w.pattern.c_str(), w.qd, w.reopen ? " reopen" : "");
+		if (w.reopen) {
+			printf("block_map %-6s %10.3f s\n", "open", open_secs);
+		}
+		for (const auto& p : phases) {
+			double secs = p.nsecs / 1e9;
+			printf("block_map %-6s ops=%-9ju %9.2f MB/s %10.0f IOPS  p50=%.1fus p99=%.1fus p999=%.1fus\n",
+				p.name.c_str(), uintmax_t(p.ops), 
+				p.ops * s_bytes_per_block / secs / 1e6, p.ops / secs,
+				percentile_us(p.latency, 0.5), percentile_us(p.latency, 0.99), percentile_us(p.latency, 0.999));
+		}
+		return;
+	}
+	printf("{\"blocks\": %ju, \"pattern\": \"%s\", \"op\": \"%s\", \"qd\": %u, \"reopen\": %s, ",
+		uintmax_t(w.blocks), w.pattern.c_str(), w.op.c_str(), w.qd, w.reopen ? "true" : "false");
+	if (w.reopen) {
+		printf("\"open_secs\": %.6f, ", open_secs);
+	}
+	printf("\"phases\": [");
+	for (size_t i = 0; i < phases.size(); i++) {
+		const auto& p = phases[i];
+		double secs = p.nsecs / 1e9;
+		printf("%s{\"phase\": \"%s\", \"ops\": %ju, \"secs\": %.6f, \"mb_per_sec\": %.3f, \"iops\": %.1f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+			i ? ", " : "", p.name.c_str(), uintmax_t(p.ops), secs, 
+			p.ops * s_bytes_per_block / secs / 1e6, p.ops / secs,
+			percentile_us(p.latency, 0.5), percentile_us(p.latency, 0.99), percentile_us(p.latency, 0.999));
+	}
+	printf("]}\n");
+}
+
+bool bench_block_map(int argc, char** argv)
+{
+	workload w;
+	if (!w.parse(argc, argv)) {
+		return false;
+	}
+	if (system(("rm -rf " + w.dir + " && mkdir " + w.dir).c_str()) != 0) {
+		fprintf(stderr, "Unable to make directory: %s\n", w.dir.c_str());
+		return false;
+	}
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	unique_ptr<block_map> bm = make_unique<block_map>(key, w.blocks, w.map_budget);
+	bm->set_readahead(w.readahead);
+	if (!bm->open(w.dir)) {
+		fprintf(stderr, "Unable to open block_map in %s\n", w.dir.c_str());
+		return false;
+	}
+	// Write every block once, so reads hit real data and writes clean
+	vector<phase_result> phases(2);
+	workload fill = w;
+	fill.pattern = "seq";
+	if (!run_phase(*bm, fill, "write", w.blocks, phases[0])) {
+		return false;
+	}
+	phases[0].name = "fill";
+	double open_secs = 0;
+	if (w.reopen) {
+		bm.reset();
+		uint64_t start = bench_nsecs();
+		bm = make_unique<block_map>(key, w.blocks, w.map_budget);
+		bm->set_readahead(w.readahead);
+		if (!bm->open(w.dir)) {
+			fprintf(stderr, "Unable to reopen block_map in %s\n", w.dir.c_str());
+			return false;
+		}
+		open_secs = (bench_nsecs() - start) / 1e9;
+	}
+	if (!run_phase(*bm, w, w.op, w.ops, phases[1])) {
+		return false;
+	}
+	report(w, phases, open_secs);
+	return true;
+}
@@ -0,0 +1,113 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "fast_bit.h"
+#include <stdio.h>
+
+static const size_t s_ops = 10000000;
+
+static void report(const char* what, size_t size, uint64_t start, size_t ops)
+{
+	double ns = double(bench_nsecs() - start) / ops;
+	printf("fast_bit %-12s size=%-12zu %8.2f ns/op\n", what, size, ns);
+}
+
+static void bench_size(size_t size)
+{
+	bench_rand rnd;
+	uint64_t start = bench_nsecs();
+	fast_bit fb(size);
+	report("construct", size, start, 1);
+
+	// Half full, like the in-use map of a full disk
+	start = bench_nsecs();
+	for (size_t i = 0; i < size; i++) {
+		if (rnd.next() & 1) {
+			fb.set(i, true);
+		}
+	}
+	report("fill", size, start, size);
+
+	// Same thing from a dense bitmap, as open does
+	vector<uint64_t> dense((size + 63) / 64);
+	for (size_t i = 0; i < size; i++) {
+		if (fb.get(i)) {
+			dense[i / 64] |= uint64_t(1) << (i % 64);
+		}
+	}
+	start = bench_nsecs();
+	fb.assign(dense);
+	report("assign", size, start, size);
+
+	start = bench_nsecs();
+	for (size_t i = 0; i < s_ops; i++) {
+		fb.set(rnd.next() % size, rnd.next() & 1);
+	}
+	report("set", size, start, s_ops);
+
+	size_t sum = 0;
+	start = bench_nsecs();
+	for (size_t i = 0; i < s_ops; i++) {
+		sum += fb.find_set(rnd.next() % size);
+	}
+	report("find_set", size, start, s_ops);
+
+	// Sparse map, long searches
+	fast_bit sparse(size);
+	for (size_t i = 0; i < 100; i++) {
+		sparse.set(rnd.next() % size, true);
+	}
+	start = bench_nsecs();
+	for (size_t i = 0; i < s_ops; i++) {
+		sum += sparse.find_set(rnd.next() % size);
+	}
+	report("find_sparse", size, start, s_ops);
+
+	// What the cleaner does: take the oldest block, write a new one elsewhere
+	size_t cursor = 0;
+	start = bench_nsecs();
+	for (size_t i = 0; i < s_ops; i++) {
+		cursor = fb.find_set(cursor);
+		fb.set(cursor, false);
+		fb.set(rnd.next() % size, true);
+	}
+	report("clean", size, start, s_ops);
+	if (sum == 1) {
+		printf("\n");  // Keep the searches from being optimized away
+	}
+}
+
+bool bench_fast_bit(int argc, char** argv)
+{
+	vector<size_t> sizes;
+	for (int i = 0; i < argc; i++) {
+		size_t size = parse_count(argv[i]);
+		if (size == 0) {
+			fprintf(stderr, "Invalid element count: %s\n", argv[i]);
+			return false;
+		}
+		sizes.push_back(size);
+	}
+	if (sizes.empty()) {
+		sizes = { 1000000, 100000000, 2000000000 };
+	}
+	for (size_t size : sizes) {
+		bench_size(size);
+	}
+	return true;
+}
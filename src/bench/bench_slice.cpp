@@ -0,0 +1,160 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "block_map.h"
+#include "buffer_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const size_t s_ops = 1000000;
+static const size_t s_io_ops = 200000;
+static const uint32_t s_blocks = 16384;
+
+static void report(const char* what, uint64_t start, uint64_t allocs, size_t ops)
+{
+	double ns = double(bench_nsecs() - start) / ops;
+	double heap = double(pool_heap_allocs() - allocs) / ops;
+	printf("slice %-14s %10.2f ns/op %8.4f heap allocs/op\n", what, ns, heap);
+}
+
+// Construct a batch of block sized slices, then destroy them, timing each half
+static void bench_slices(bool local)
+{
+	static const size_t s_batch = 10000;
+	vector<slice_t> slices;
+	slices.reserve(s_batch);
+	uint64_t construct = 0;
+	uint64_t destroy = 0;
+	uint64_t allocs = pool_heap_allocs();
+	for (size_t round = 0; round < s_ops / s_batch; round++) {
+		uint64_t start = bench_nsecs();
+		for (size_t i = 0; i < s_batch; i++) {
+			slices.push_back(local ? slice_t::local(s_bytes_per_block) : slice_t(s_bytes_per_block));
+		}
+		uint64_t mid = bench_nsecs();
+		slices.clear();
+		destroy += bench_nsecs() - mid;
+		construct += mid - start;
+	}
+	printf("slice %-14s %10.2f ns/op %8.4f heap allocs/op\n", local ? "construct_local" : "construct", 
+		double(construct) / s_ops, double(pool_heap_allocs() - allocs) / s_ops);
+	printf("slice %-14s %10.2f ns/op\n", local ? "destroy_local" : "destroy", double(destroy) / s_ops);
+}
+
+bool bench_slice(int argc, char** argv)
+{
+	string dir = argc >= 1 ? argv[0] : "/tmp/bench_slice";
+	if (system(("rm -rf " + dir + " && mkdir " + dir).c_str()) != 0) {
+		fprintf(stderr, "Unable to make directory: %s\n", dir.c_str());
+		return false;
+	}
+
+	bench_slices(false);
+	bench_slices(true);
+
+	// Buffers on their own, no I/O
+	uint64_t start = bench_nsecs();
+	uint64_t allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_ops; i++) {
+		slice_t block(s_bytes_per_block);
+	}
+	report("alloc_block", start, allocs, s_ops);
+
+	slice_t shared(s_bytes_per_block);
+	slice_t local = slice_t::local(s_bytes_per_block);
+	size_t sum = 0;
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_ops; i++) {
+		slice_t copy = shared;
+		sum += copy.size();
+	}
+	report("copy", start, allocs, s_ops);
+
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_ops; i++) {
+		slice_t copy = local;
+		sum += copy.size();
+	}
+	report("copy_local", start, allocs, s_ops);
+
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_ops; i++) {
+		slice_t part = shared.slice(i % 512, 512);
+		sum += part.size();
+	}
+	report("slice", start, allocs, s_ops);
+	if (sum == 1) {
+		printf("\n");  // Keep the copies from being optimized away
+	}
+
+	// Only the first half is ever written, the rest reads as zeros
+	bench_rand rnd;
+	block_map bm(cipher_key_t(slice_t("HelloWorldHelloWorldHelloWorld12")), s_blocks);
+	if (!bm.open(dir)) {
+		fprintf(stderr, "Unable to open block_map in %s\n", dir.c_str());
+		return false;
+	}
+	slice_t data(s_bytes_per_block);
+	for (uint32_t i = 0; i < s_blocks; i++) {
+		if (!bm.write(i % (s_blocks / 2), data)) {
+			return false;
+		}
+	}
+
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_io_ops; i++) {
+		if (!bm.write(rnd.next() % (s_blocks / 2), data)) {
+			return false;
+		}
+	}
+	report("write", start, allocs, s_io_ops);
+
+	rslice_t out;
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_io_ops; i++) {
+		if (!bm.read(rnd.next() % (s_blocks / 2), out)) {
+			return false;
+		}
+	}
+	report("read", start, allocs, s_io_ops);
+
+	char buf[s_bytes_per_block];
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_io_ops; i++) {
+		if (!bm.read_into(rnd.next() % (s_blocks / 2), slice_t::wrap(buf, sizeof(buf)))) {
+			return false;
+		}
+	}
+	report("read_into", start, allocs, s_io_ops);
+
+	start = bench_nsecs();
+	allocs = pool_heap_allocs();
+	for (size_t i = 0; i < s_io_ops; i++) {
+		if (!bm.read(s_blocks / 2 + rnd.next() % (s_blocks / 2), out)) {
+			return false;
+		}
+	}
+	report("read_unmapped", start, allocs, s_io_ops);
+	return true;
+}
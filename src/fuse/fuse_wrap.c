@@ -28,7 +28,6 @@
 
 const static uint64_t block_size = 1024;
 static void* bm = NULL;
-static uint64_t file_size = 0;
 static uid_t uid = 0;
 static int shutdown = 0;
 static int open_count = 0;
@@ -58,19 +57,68 @@ static int safedisk_getxattr(const char *path, const char *name, char *out, size
 #endif
 
 
-extern void* create_block_map(const char* dir, uint32_t blocks, const char* key);
-extern void* open_block_map(const char* dir, const char* key);
+extern void* create_volumes_block_map(
+	const char* dir, uint32_t count, const char* const* names, const uint32_t* blocks, const char* key,
+	const char* options);
+extern void* open_options_block_map(const char* dir, const char* key, const char* options);
 extern void close_block_map(void* bm);
-extern int64_t size_block_map(void* bm);
 extern int read_block_map(void* bm, uint32_t block, char* buf);
 extern int write_block_map(void* bm, uint32_t block, const char* buf);
+extern int write_done_block_map(void* bm, int fua);
+extern int flush_block_map(void* bm);
+extern int snapshot_block_map(void* bm, const char* name);
+extern int release_snapshot_block_map(void* bm, const char* name);
+extern int has_snapshot_block_map(void* bm, const char* name);
+extern int list_snapshot_block_map(void* bm, uint32_t which, char* name_out, size_t size);
+extern int read_snapshot_block_map(void* bm, const char* name, uint32_t block, char* buf);
+extern int list_volume_block_map(void* bm, uint32_t which, char* name_out, size_t size);
+extern int find_volume_block_map(void* bm, const char* name, uint32_t* base, uint32_t* blocks);
+extern void trace_block_map(void* bm, int op, uint64_t offset, uint32_t length);
+extern size_t stats_block_map(void* bm, char* buf, size_t size);
+
+// '/stats' is a read only text file of runtime counters, it shadows any volume
+// called 'stats'.  Its contents change on every read, so it has no real size and
+// is opened with direct_io to make the kernel ask us each time.
+static const char* stats_path = "/stats";
+
+// A file in our root, either a volume or a snapshot of one
+struct target
+{
+	uint32_t    base;    // First block of the volume
+	uint64_t    size;    // Size of the volume in bytes
+	const char* snap;    // Snapshot name, or NULL for the live volume
+};
+
+// Resolves '/<volume>' or '/<volume>@<snapshot>', returns 0 if there is no such file
+static 
+int resolve_path(const char* path, struct target* t)
+{
+	char name[64];
+	const char* at = strchr(path + 1, '@');
+	size_t len = at ? (size_t) (at - path - 1) : strlen(path + 1);
+	if (path[0] != '/' || len == 0 || len >= sizeof(name)) {
+		return 0;
+	}
+	memcpy(name, path + 1, len);
+	name[len] = 0;
+	uint32_t blocks;
+	if (!find_volume_block_map(bm, name, &t->base, &blocks)) {
+		return 0;
+	}
+	t->size = blocks * block_size;
+	t->snap = at ? at + 1 : NULL;
+	return !t->snap || *t->snap;
+}
 
 static 
 int safedisk_getattr(const char* path, struct stat* st)
 {
 	memset(st, 0, sizeof(*st));
 
-	if (strcmp(path, "/") != 0 && strcmp(path, "/data") != 0) {
+	struct target t;
+	int is_root = strcmp(path, "/") == 0;
+	int is_stats = strcmp(path, stats_path) == 0;
+	if (!is_root && !is_stats && !(resolve_path(path, &t) && (!t.snap || has_snapshot_block_map(bm, t.snap)))) {
 		return -ENOENT;
 	}
 	// Common bits
@@ -86,17 +134,21 @@ int safedisk_getattr(const char* path, struct stat* st)
 	st->st_ctime = create_time;
 #endif
 	st->st_blksize = block_size;
-	if (strcmp(path, "/") == 0) { 
+	if (is_root) { 
 		// The root directory of our file system
 		st->st_mode = S_IFDIR | 0755;
 		st->st_nlink = 3;
 	} 
-	else if (strcmp(path, "/data") == 0) { 
-		// The data file
-		st->st_mode = S_IFREG | 0644;
+	else if (is_stats) {
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+	}
+	else { 
+		// A volume, snapshots are read only
+		st->st_mode = S_IFREG | (t.snap ? 0444 : 0644);
 		st->st_nlink = 1;
-		st->st_size = file_size;
-		st->st_blocks = file_size / 512;
+		st->st_size = t.size;
+		st->st_blocks = t.size / 512;
 	} 
 
 	return 0;
@@ -110,17 +162,58 @@ int safedisk_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 			raise(SIGHUP);
 		}
 	}
+	struct target t;
+	if (resolve_path(path, &t) && t.snap) {
+		// Creating '/<volume>@<name>' takes a snapshot of every volume
+		if (!snapshot_block_map(bm, t.snap)) {
+			return -EEXIST;
+		}
+		open_count++;
+		return 0;
+	}
 	return -EPERM;
 }
 
+static 
+int safedisk_unlink(const char* path)
+{
+	struct target t;
+	if (!resolve_path(path, &t) || t.snap == NULL) {
+		return -EPERM;
+	}
+	// Removing '/<volume>@<name>' releases the snapshot of every volume
+	if (!release_snapshot_block_map(bm, t.snap)) {
+		return -ENOENT;
+	}
+	return 0;
+}
+
 
 static 
 int safedisk_open(const char* path, struct fuse_file_info* fi)
 {
-	if (strcmp(path, "/data") != 0) {
-		// We only recognize one file
+	if (strcmp(path, stats_path) == 0) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			return -EACCES;
+		}
+		fi->direct_io = 1;
+		open_count++;
+		return 0;
+	}
+	struct target t;
+	if (!resolve_path(path, &t)) {
+		// We only recognize volumes and their snapshots
 		return -ENOENT;
 	}
+	if (t.snap) {
+		if (!has_snapshot_block_map(bm, t.snap)) {
+			return -ENOENT;
+		}
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			// Snapshots are read only
+			return -EACCES;
+		}
+	}
 	open_count++;	
 
 	return 0;
@@ -168,7 +261,22 @@ int safedisk_readdir(
 
 	filler(buf, ".", NULL, 0); // Current directory (.)
 	filler(buf, "..", NULL, 0); // Parent directory (..) 
-	filler(buf, "data", NULL, 0); // The only file we have.
+	filler(buf, stats_path + 1, NULL, 0); // Runtime statistics
+	
+	char volume[64];
+	char snap[256];
+	char entry[sizeof(volume) + sizeof(snap)];
+	uint32_t which, which_snap;
+	for (which = 0; list_volume_block_map(bm, which, volume, sizeof(volume)); which++) {
+		filler(buf, volume, NULL, 0); // One file per volume
+		for (which_snap = 0; list_snapshot_block_map(bm, which_snap, snap, sizeof(snap)); which_snap++) {
+			if (snap[0] == 0) {
+				continue;  // Name too long to list, the rest still are
+			}
+			snprintf(entry, sizeof(entry), "%s@%s", volume, snap);
+			filler(buf, entry, NULL, 0); // And one per snapshot of it
+		}
+	}
 
 	return 0;
 }
@@ -181,19 +289,35 @@ int safedisk_read(
 	off_t offset,
 	struct fuse_file_info* fi)
 {
-	if (strcmp(path, "/data") != 0) {
-		// We can only be reading from the data file
+	if (strcmp(path, stats_path) == 0) {
+		char text[4096];
+		size_t len = stats_block_map(bm, text, sizeof(text));
+		if (len >= sizeof(text)) {
+			len = sizeof(text) - 1;
+		}
+		if ((size_t) offset >= len) {
+			return 0;
+		}
+		if (offset + size > len) {
+			size = len - offset;
+		}
+		memcpy(buf, text + offset, size);
+		return size;
+	}
+	struct target t;
+	if (!resolve_path(path, &t)) {
+		// We can only be reading from a volume or a snapshot
 		return -ENOENT;
 	}
 	
-	if (offset > file_size) {
+	if (offset > t.size) {
 		// Trying to read past the end of file
 		return 0;
 	}
 
-	if (offset + size > file_size) {
+	if (offset + size > t.size) {
 		// Trim the read to the file size
-		size = file_size - offset;
+		size = t.size - offset;
 	}
 
 	if (offset % block_size != 0 || size % block_size != 0) {
@@ -206,12 +330,17 @@ int safedisk_read(
 #else
 	access_time = time(0);
 #endif
+	trace_block_map(bm, 0, t.base * block_size + offset, size);
 	// Handle everything in blocks	
 	size /= block_size;
 	offset /= block_size;
 	uint32_t block;
 	for (block = 0; block < size; block++) {
-		if (!read_block_map(bm, offset + block, ((char*) buf) + block * block_size)) {
+		char* out = ((char*) buf) + block * block_size;
+		int ok = t.snap ? 
+			read_snapshot_block_map(bm, t.snap, t.base + offset + block, out) : 
+			read_block_map(bm, t.base + offset + block, out);
+		if (!ok) {
 			return -EIO;
 		}
 	}
@@ -227,19 +356,24 @@ int safedisk_write(
 	off_t offset,
 	struct fuse_file_info* fi)
 {
-	if (strcmp(path, "/data") != 0) {
-		// We can only be writing to the data file
+	struct target t;
+	if (strcmp(path, stats_path) == 0 || !resolve_path(path, &t)) {
+		// We can only be writing to a volume
 		return -ENOENT;
 	}
+	if (t.snap) {
+		// Snapshots are read only
+		return -EACCES;
+	}
 	
-	if (offset > file_size) {
+	if (offset > t.size) {
 		// Trying to read past the end of file
 		return 0;
 	}
 
-	if (offset + size > file_size) {
+	if (offset + size > t.size) {
 		// Trim the read to the file size
-		size = file_size - offset;
+		size = t.size - offset;
 	}
 
 	if (offset % block_size != 0 || size % block_size != 0) {
@@ -254,52 +388,130 @@ int safedisk_write(
 	modify_time = time(0);
 	access_time = time(0);
 #endif
+	trace_block_map(bm, 1, t.base * block_size + offset, size);
 
 	// Handle everything in blocks	
 	size /= block_size;
 	offset /= block_size;
 	uint32_t block;
 	for (block = 0; block < size; block++) {
-		if (!write_block_map(bm, offset + block, ((const char*) buf) + block * block_size)) {
+		if (!write_block_map(bm, t.base + offset + block, ((const char*) buf) + block * block_size)) {
 			return -EIO;
 		}
 	}
+	if (!write_done_block_map(bm, 0)) {
+		return -EIO;
+	}
 
 	return size*block_size;
 }
 
+// Both fsync and the flush done on every close make finished writes durable,
+// flushes that arrive together share one sync
+static 
+int safedisk_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+	return flush_block_map(bm) ? 0 : -EIO;
+}
+
+static 
+int safedisk_flush(const char* path, struct fuse_file_info* fi)
+{
+	return flush_block_map(bm) ? 0 : -EIO;
+}
+
 static 
 struct fuse_operations safedisk_filesystem_operations = {
 	.getattr    = safedisk_getattr,    // To provide size, permissions, etc.
-	.create     = safedisk_create,     // Allow creation attempts to hit shutdown switch 
+	.create     = safedisk_create,     // Allow creation attempts to hit shutdown switch, or snapshot
+	.unlink     = safedisk_unlink,     // Release snapshots
 	.open       = safedisk_open,       // Allow opening of a single file
 	.opendir    = safedisk_opendir,    // Track number of open dirs
 	.release    = safedisk_release,    // After close, shutdown
 	.releasedir = safedisk_releasedir, // Track number of open dirs
 	.read       = safedisk_read,       // Allow block reads
 	.write      = safedisk_write,      // Allow block writes
+	.flush      = safedisk_flush,      // Make writes durable on close
+	.fsync      = safedisk_fsync,      // Make writes durable on request
 	.readdir    = safedisk_readdir,    // Directory listing of our one directory
 #if __APPLE__
 	.getxattr   = safedisk_getxattr,   // YEAH APPLE!
 #endif
 };
 
+#define MAX_VOLUMES 64
+
+// Parses '<size>' or '<name>:<size>[,<name>:<size>...]', sizes in MB
+// Returns the number of volumes, or 0 if the spec is invalid
+static 
+int parse_volumes(char* spec, const char** names, uint32_t* blocks)
+{
+	int count = 0;
+	uint32_t total = 0;
+	char* save = NULL;
+	char* item;
+	for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (count == MAX_VOLUMES) {
+			return 0;
+		}
+		uint32_t size;
+		char* colon = strchr(item, ':');
+		if (colon) {
+			*colon = 0;
+			names[count] = item;
+			size = atoi(colon + 1);
+		} else {
+			names[count] = "data";
+			size = atoi(item);
+		}
+		if (size == 0 || size > 1000000 - total) {
+			return 0;
+		}
+		total += size;
+		blocks[count++] = size * 1024;
+	}
+	return count;
+}
+
 // TODO: Less lame option parsing 
 int main(int argc, char** argv)
 {
 	openlog("safediskd", LOG_PID | LOG_PERROR, LOG_DAEMON);
+
+	// Pull out '--<key>=<value>' container options, fuse gets the rest
+	char options[1024] = "";
+	int i;
+	int kept = 1;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0 || strchr(argv[i], '=') == NULL) {
+			argv[kept++] = argv[i];
+			continue;
+		}
+		if (strlen(options) + strlen(argv[i]) >= sizeof(options)) {
+			fprintf(stderr, "Too many options\n");
+			exit(1);
+		}
+		if (*options) {
+			strcat(options, ",");
+		}
+		strcat(options, argv[i] + 2);
+	}
+	argc = kept;
+	argv[argc] = NULL;
 	
 	// Validate one extra arguments are there
 	if (argc < 3) {
-		fprintf(stderr, "usage: %s [fuse-options] <mnt_point> <block_dir> [<size>]\n", argv[0]);
+		fprintf(stderr, "usage: %s [fuse-options] [--map_budget=<bytes>] [--trace=<file>] [--slow_ms=<ms>] [--latency_secs=<secs>] [--durability=none|flush|sync] [--open_chunks=<n>] [--readahead=<bytes>] [--mirror=<dir>[:<dir>...]] [--kdf_ms=<ms>] [--kdf_memory=<bytes>] <mnt_point> <block_dir> [<size>|<name>:<size>,...]\n", argv[0]);
 		exit(1);
 	}
-	// Get size if present
-	uint32_t size = 0;
+	// Get sizes if present
+	const char* names[MAX_VOLUMES];
+	uint32_t blocks[MAX_VOLUMES];
+	int count = 0;
 	if (argc == 4) {
-		size = atoi(argv[--argc]);
-		if (size == 0 || size > 1000000) {
-			fprintf(stderr, "Size must be non-zero and less than 1 million\n");
+		count = parse_volumes(argv[--argc], names, blocks);
+		if (count == 0) {
+			fprintf(stderr, "Sizes must be non-zero and total less than 1 million\n");
 			exit(1);
 		}
 	}
@@ -309,15 +521,15 @@ int main(int argc, char** argv)
 	// Ask for password
 	char* pass = getpass("Password: ");
 
-	if (size) {
-		// If size is set, 'create'
-		bm = create_block_map(block_dir, size*1024, pass);
+	if (count) {
+		// If sizes are set, 'create'
+		bm = create_volumes_block_map(block_dir, count, names, blocks, pass, options);
 	} else {
 		// Otherwise, 'open'
-		bm = open_block_map(block_dir, pass);
+		bm = open_options_block_map(block_dir, pass, options);
 	}
 	if (bm == NULL) {
-		fprintf(stderr, "Failed to %s block_map directory\n", size ? "create" : "open");
+		fprintf(stderr, "Failed to %s block_map directory\n", count ? "create" : "open");
 		exit(1);
 	}
 
@@ -333,7 +545,6 @@ int main(int argc, char** argv)
 	printf("block_dir: %s\n", block_dir);
 
 	// Set global variables
-	file_size = size_block_map(bm);
 	uid = st.st_uid;
 #ifdef __APPLE__
 	memset(&create_time, 0, sizeof(struct timespec));
@@ -16,6 +16,8 @@
  */
 
 #include "block_file.h"
+#include "latency.h"
+#include "stats.h"
 #include "utils.h"
 
 #include <syslog.h>
@@ -23,6 +25,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 static const uint64_t s_tag_size = 16;
@@ -74,8 +77,26 @@ uint32_t get_logical(char* buf, uint64_t which)
 	return ntohl(*((uint32_t*) (buf + which * sizeof(uint32_t))));
 }
 
-block_file::block_file(const cipher_key_t& key)
+// Grow a chunk's allocation to full size, the size then stops meaning much
+// Only a hint, it's fine if the file system can't
+static void preallocate(int fd, off_t from)
+{
+#ifdef __linux__
+	if (fallocate(fd, 0, from, off_t(s_chunk_total_size) - from) != 0 && errno != EOPNOTSUPP) {
+		syslog(LOG_WARNING, "Unable to preallocate chunk: %s", strerror(errno));
+	}
+#endif
+}
+
+const uint32_t block_file::s_max_run;
+
+block_file::block_file(const cipher_key_t& key, size_t open_chunks)
 	: m_cipher_ctx(key)
+	, m_low(0)
+	, m_high(0)
+	, m_open_chunks(std::max(open_chunks, size_t(1)))
+	, m_next(0)
+	, m_dir_dirty(false)
 	, m_region_footer(s_region_footer_size)
 	, m_chunk_footer(s_chunk_footer_size)
 {
@@ -94,6 +115,7 @@ bool block_file::open(const string& _dir)
 	struct dirent *de;
 	uint64_t low_chunk = -1;
 	uint64_t high_chunk = 0;
+	vector<uint64_t> torn;
 	errno = 0;
 	while ((de = readdir(dir)) != NULL) {
 		if (de->d_name[0] == '.') {
@@ -108,6 +130,28 @@ bool block_file::open(const string& _dir)
 		if (strcmp(de->d_name, "salt") == 0) {
 			continue;
 		}
+		if (strcmp(de->d_name, "kdf") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, "volumes") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, "index") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, "spare") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, "manifest") == 0 || strcmp(de->d_name, "manifest.new") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, "mirror") == 0 || strcmp(de->d_name, "mirror_of") == 0) {
+			continue;  // Left by a copy into this directory as a mirror
+		}
+		if (memcmp(de->d_name, "torn_", 5) == 0) {
+			torn.push_back(strtoull(de->d_name + 5, NULL, 10));
+			continue;  // Set aside by an earlier recovery
+		}
 		if (memcmp(de->d_name, "file_", 5) != 0) {
 			syslog(LOG_ERR, "Unexpected entry, forget it");
 			closedir(dir);
@@ -128,23 +172,70 @@ bool block_file::open(const string& _dir)
 	}
 	// Fix low chunk for empty directory case
 	low_chunk = std::min(low_chunk, high_chunk);
-	// Verify and open 'complete' files
+	// Anything set aside that the log has since moved past is no use
+	for (uint64_t chunk : torn) {
+		if (chunk < low_chunk) {
+			unlink(torn_name(chunk).c_str());
+		}
+	}
+	start_worker();
+	// A crash can leave the next chunk on disk without the end of the one
+	// before it, nothing was flushed into that chunk then, so if it holds no
+	// blocks it's set aside.  A bad footer with blocks after it is damage,
+	// not a crash, and is left alone for someone to look at.
+	while (high_chunk > low_chunk) {
+		bool sealed;
+		uint64_t valid = 0;
+		if (!chunk_sealed(high_chunk - 1, sealed) || (!sealed && !chunk_blocks(high_chunk, valid))) {
+			syslog(LOG_ERR, "Unable to read chunk %ju or %ju: %s", 
+				uintmax_t(high_chunk - 1), uintmax_t(high_chunk), strerror(errno));
+			close();
+			return false;
+		}
+		if (sealed) {
+			break;
+		}
+		if (valid) {
+			syslog(LOG_ERR, "Chunk %ju has a bad footer, but chunk %ju after it has data", 
+				uintmax_t(high_chunk - 1), uintmax_t(high_chunk));
+			close();
+			return false;
+		}
+		syslog(LOG_WARNING, "Chunk %ju was never sealed, moving empty chunk %ju to %s", 
+			uintmax_t(high_chunk - 1), uintmax_t(high_chunk), torn_name(high_chunk).c_str());
+		if (rename(file_name(high_chunk).c_str(), torn_name(high_chunk).c_str()) != 0) {
+			syslog(LOG_ERR, "Unable to move chunk: %s", strerror(errno));
+			close();
+			return false;
+		}
+		high_chunk--;
+	}
+	// Verify 'complete' files, they get opened when something reads them
 	for (uint64_t chunk = low_chunk; chunk < high_chunk; chunk++) {
-		int fd = ::open(file_name(chunk).c_str(), O_RDONLY);
-		if (fd < 0) {
-			syslog(LOG_ERR, "Unable to open file: %s, %s", file_name(chunk).c_str(), strerror(errno));
+		struct stat st;
+		if (stat(file_name(chunk).c_str(), &st) != 0) {
+			syslog(LOG_ERR, "Unable to stat file: %s, %s", file_name(chunk).c_str(), strerror(errno));
 			close();
 			return false;
 		}
-		off_t end = lseek(fd, 0, SEEK_END);
-		if (end != s_chunk_total_size) {
-			syslog(LOG_ERR, "Non-final file too short, or seek failed: %s", file_name(chunk).c_str());
-			::close(fd);
+		if (st.st_size != s_chunk_total_size) {
+			syslog(LOG_ERR, "Non-final file too short: %s", file_name(chunk).c_str());
 			close();
 			return false;
 		}
-		m_chunks[chunk].fd = fd;
-		m_chunks[chunk].size = end;
+		add_chunk(chunk, -1, st.st_size);
+	}
+	// The worker fills in what the manifest and the mirrors lack in the background
+	vector<uint64_t> undigested = m_manifest.open(m_dir, low_chunk, high_chunk, s_chunk_total_size);
+	vector<uint64_t> unmirrored;
+	if (m_mirror.enabled()) {
+		unmirrored = m_mirror.open(m_dir, low_chunk, high_chunk);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_work_lock);
+		m_digest_queue.assign(undigested.begin(), undigested.end());
+		m_mirror_queue.assign(unmirrored.begin(), unmirrored.end());
+		m_work_cv.notify_all();
 	}
 	// Open / create final file 
 	int fd = ::open(file_name(high_chunk).c_str(), O_RDWR | O_CREAT, 0777);
@@ -162,64 +253,122 @@ bool block_file::open(const string& _dir)
 		return false;
 	}
 	uint64_t chunk = high_chunk;
-	m_fi = &m_chunks[chunk];
-	m_fi->fd = fd;
-	if (end == s_chunk_total_size) {
+	add_chunk(chunk, fd, end);
+	m_dir_dirty = true;  // It may have just been created
+	// Chunks are preallocated, so the size doesn't say how much was written,
+	// the footers and block tags do
+	uint64_t valid = valid_blocks(fd, chunk);
+	if (valid == s_blocks_per_chunk) {
 		// Special case for final file also being complete
-		m_fi->size = s_chunk_total_size;
-		next_chunk(chunk);
+		slot(chunk).size = s_chunk_total_size;
 		m_next = (chunk + 1) * s_blocks_per_chunk;
+		if (!next_chunk(chunk)) {
+			close();
+			return false;
+		}
+		m_manifest.write();
 		return true;
 	}
-	
-	// Compute record offset based on file size, trucate to a valid size	
-	// Do binary search to find valid offset
-	// This could be probably be computed some other way, but I'm drunk
-	uint64_t low_phy = high_chunk * s_blocks_per_chunk;
-	uint64_t high_phy = (high_chunk + 1) * s_blocks_per_chunk;
-	while (low_phy + 1 < high_phy) {
-		//syslog(LOG_DEBUG, "End = %ju, low_phy = %ju, high_phu = %ju", end, low_phy, high_phy);
-		uint64_t mid_phy = (low_phy + high_phy) / 2;
-		coordinates c(mid_phy);
-		if (c.block_offset > (uint64_t)end) {
-			high_phy = mid_phy;
-		} else {
-			low_phy = mid_phy; 
-		}
-	}
-	// Ok, now truncate
-	m_next = low_phy;
-	coordinates c(low_phy);
+	m_next = chunk * s_blocks_per_chunk + valid;
+	coordinates c(m_next);
+	// Drop the rest, after another crash stale blocks there could pass as new
 	if ((uint64_t)end > c.block_offset) {
-		if (ftruncate(m_fi->fd, m_fi->size) != 0) {
+		if (ftruncate(fd, c.block_offset) != 0) {
 			close();
 			syslog(LOG_ERR, "Failed to truncate final file on reload");
 			return false;
 		}
 	}
-	m_fi->size = c.block_offset;
+	slot(chunk).size = c.block_offset;
+	preallocate(fd, c.block_offset);
+	m_manifest.set_live(chunk, c.block_offset);
+	m_manifest.write();
 	// Ready to go
 	return true;
 }
 
 void block_file::close()
 {
+	stop_worker();
+	// Only once open got as far as the final chunk
+	if (!m_ring.empty() && slot(m_high).fd >= 0) {
+		m_manifest.set_live(m_high, slot(m_high).size);
+		m_manifest.write();
+	}
+	m_manifest.close();
+	m_mirror.close();
 	m_dir = "";
-	m_fi = NULL;
-	for(auto& kvp : m_chunks) {
-		::close(kvp.second.fd);
+	for (uint64_t chunk = m_low; !m_ring.empty() && chunk <= m_high; chunk++) {
+		close_chunk(chunk, slot(chunk));
+	}
+	m_ring.clear();
+	m_lru.clear();
+}
+
+bool block_file::prepare_sync(sync_job& job)
+{
+	if (m_ring.empty()) {
+		return true;
+	}
+	// A rollover may hand the final chunk to the worker while we sync, so sync
+	// our own fd, run_sync then waits for the worker to finish sealed chunks
+	job.fd = dup(slot(m_high).fd);
+	if (job.fd < 0) {
+		syslog(LOG_ERR, "block_file::prepare_sync> dup failed: %s", strerror(errno));
+		return false;
+	}
+	job.dir = m_dir_dirty;
+	job.chunk_id = m_high;
+	job.size = slot(m_high).size;
+	m_dir_dirty = false;
+	return true;
+}
+
+bool block_file::run_sync(sync_job& job)
+{
+	lat_timer timer(lat_sync);
+	bool ok = wait_sealed();
+	if (job.fd >= 0) {
+		if (fdatasync(job.fd) != 0) {
+			syslog(LOG_ERR, "block_file::run_sync> fdatasync failed: %s", strerror(errno));
+			ok = false;
+		}
+		if (ok) {
+			m_mirror.live(job.chunk_id, job.fd, job.size);
+			// The worker writes the manifest, so the sync doesn't wait on it
+			m_manifest.set_live(job.chunk_id, job.size);
+			std::lock_guard<std::mutex> lock(m_work_lock);
+			m_manifest_due = true;
+			m_work_cv.notify_all();
+		}
+		::close(job.fd);
+		job.fd = -1;
+	}
+	if (job.dir) {
+		int fd = ::open(m_dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || fsync(fd) != 0) {
+			syslog(LOG_ERR, "block_file::run_sync> Unable to sync directory: %s", strerror(errno));
+			ok = false;
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
 	}
+	stat_add(stat_syncs);
+	return ok;
 }
 
-bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback)
+bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback, uint64_t from)
 {
 	//syslog(LOG_DEBUG, "Scanning till %ju", m_next);
 	coordinates c(m_next);
-	assert(m_chunks.size());
-	// Read chunk footers
-	for (auto it = m_chunks.begin(); it->first < c.chunk_id; it++) {
-		int fd = it->second.fd;
-		uint64_t chunk = it->first;
+	assert(m_ring.size());
+	// Read chunk footers, skipping whole chunks below from
+	for (uint64_t chunk = std::max(m_low, from / s_blocks_per_chunk); chunk < c.chunk_id; chunk++) {
+		int fd = chunk_fd(chunk, slot(chunk));
+		if (fd < 0) {
+			return false;
+		}
 		//syslog(LOG_DEBUG, "Reading footer of chunk %ju", chunk);
 		off_t r = lseek(fd, s_chunk_footer_off, SEEK_SET);
 		if (r != s_chunk_footer_off) {
@@ -239,11 +388,13 @@ bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback)
 		uint64_t base = chunk * s_blocks_per_chunk;
 		for (uint64_t boff = 0; boff < s_blocks_per_chunk; boff++) {
 			uint32_t logical = get_logical(data.buf() + s_tag_size, boff);
-			callback(base + boff, logical);
+			if (base + boff >= from) {
+				callback(base + boff, logical);
+			}
 		} 
 	}	
 	// Ok, I'm on the last chunk
-	int fd = m_chunks[c.chunk_id].fd;
+	int fd = slot(c.chunk_id).fd;
 	// Read region footers
 	for (uint64_t region = 0; region < c.region_id; region++) {
 		//syslog(LOG_DEBUG, "Reading footer of region %ju", region);
@@ -268,7 +419,9 @@ bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback)
 		}
 		for (uint64_t boff = 0; boff < s_blocks_per_region; boff++) {
 			uint32_t logical = get_logical(data.buf() + s_tag_size, boff);
-			callback(base + boff, logical);
+			if (base + boff >= from) {
+				callback(base + boff, logical);
+			}
 			set_logical(m_chunk_footer.buf(), rbase + boff, logical);
 		} 
 	}
@@ -293,7 +446,9 @@ bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback)
 			return false;
 		}
 		uint32_t logical = get_logical(data.buf() + s_tag_size, 0);
-		callback(base + block, logical);
+		if (base + block >= from) {
+			callback(base + block, logical);
+		}
 		set_logical(m_chunk_footer.buf(), c.region_id * s_blocks_per_region + block, logical);
 		set_logical(m_region_footer.buf(), block, logical);
 	}
@@ -303,20 +458,45 @@ bool block_file::scan(std::function<void (uint64_t, uint32_t)> callback)
 bool block_file::remove_old(uint64_t keep_after)
 {
 	coordinates c(keep_after);
-	while (m_chunks.size() && m_chunks.begin()->first < c.chunk_id) {
-		//syslog(LOG_DEBUG, "Keep after: %ju, chunk_id = %ju, top = %ju, removing", keep_after, c.chunk_id, m_chunks.begin()->first);
-		auto it = m_chunks.begin();
-		::close(it->second.fd);
-		int r = unlink(file_name(it->first).c_str());
-		m_chunks.erase(it);
+	if (m_ring.empty() || m_low >= c.chunk_id) {
+		return true;
+	}
+	lat_timer timer(lat_remove);
+	// Live copies of anything we drop may still be sitting in the page cache
+	if (!wait_sealed() || fdatasync(slot(m_high).fd) != 0) {
+		syslog(LOG_ERR, "Unable to sync final file before removing old ones: %s", strerror(errno));
+		return false;
+	}
+	// The manifest stops listing them first
+	m_manifest.set_low(c.chunk_id);
+	m_manifest.set_live(m_high, slot(m_high).size);
+	m_manifest.write();
+	while (m_low < c.chunk_id) {
+		//syslog(LOG_DEBUG, "Keep after: %ju, chunk_id = %ju, top = %ju, removing", keep_after, c.chunk_id, m_low);
+		close_chunk(m_low, slot(m_low));
+		int r = unlink(file_name(m_low).c_str());
+		unlink(torn_name(m_low).c_str());  // If a recovery set one aside
+		m_low++;
+		stat_add(stat_chunks_removed);
 		if (r != 0) {
 			syslog(LOG_ERR, "Unable to rm file");
 			return false;
 		}
 	}
+	m_mirror.removed(m_low);
 	return true;
 }
 
+// Builds a block's record, its tag, then the logical id and the data encrypted
+static void encrypt_record(cipher_ctx_t& ctx, uint64_t iv, uint32_t logical, const rslice_t& block, const slice_t& record)
+{
+	set_logical(record.buf(), 0, logical);
+	ctx.gcm_set_iv(iv);
+	ctx.gcm_partial_encrypt(record.slice(s_tag_size, sizeof(uint32_t)));
+	ctx.gcm_partial_encrypt(record.slice(s_block_header_size, s_bytes_per_block), block);
+	ctx.gcm_finalize(record.slice(0, s_tag_size));
+}
+
 bool block_file::write_block(uint32_t logical, const rslice_t& block, uint64_t& physical_out)
 {
 	//syslog(LOG_DEBUG, "Writing logical %u -> physical %ju", logical, m_next);
@@ -325,21 +505,22 @@ bool block_file::write_block(uint32_t logical, const rslice_t& block, uint64_t&
 	coordinates c(m_next);
 
 	// Make room for encrypted block
-	slice_t block_buf(s_block_total_size);
+	slice_t block_buf = slice_t::local(s_block_total_size);
 
-	// Set logical block and info into current, region, and chunk buffers
-	set_logical(block_buf.buf(), 0, logical);
+	// Set logical block and info into region, and chunk buffers
 	set_logical(m_region_footer.buf(), c.block_id, logical);
 	set_logical(m_chunk_footer.buf(), c.bid_chunk, logical);
 
 	// Do encryption 
-	m_cipher_ctx.gcm_set_iv(c.iv);
-	m_cipher_ctx.gcm_partial_encrypt(block_buf.slice(s_tag_size, sizeof(uint32_t)));
-	m_cipher_ctx.gcm_partial_encrypt(block_buf.slice(s_block_header_size, block.size()), block);
-	m_cipher_ctx.gcm_finalize(block_buf.slice(0, s_tag_size));
+	{
+		lat_timer timer(lat_crypt);
+		encrypt_record(m_cipher_ctx, c.iv, logical, block, block_buf);
+	}
 
 	// Seek to location for new block
-	off_t r = lseek(m_fi->fd, c.block_offset, SEEK_SET);
+	file_info& fi = slot(m_high);
+	uint64_t io_start = lat_now();
+	off_t r = lseek(fi.fd, c.block_offset, SEEK_SET);
 	if ((uint64_t)r != c.block_offset) {
 		syslog(LOG_ERR, "lseek returned invalid result for seek to %ju: %jd, %s", 
 			(uintmax_t)c.block_offset, (intmax_t)r, strerror(errno)
@@ -347,34 +528,40 @@ bool block_file::write_block(uint32_t logical, const rslice_t& block, uint64_t&
 		return false;
 	}
 	// Write block
-	if (!write_fully(m_fi->fd, block_buf.buf(), block_buf.size())) {
+	if (!write_fully(fi.fd, block_buf.buf(), block_buf.size())) {
 		syslog(LOG_ERR, "Unable to write block");
 		return false;
 	}	
-	m_fi->size += block_buf.size();
+	fi.size += block_buf.size();
+	stat_add(stat_blocks_appended);
+	stat_add(stat_bytes_appended, block_buf.size());
 	// If end of region, write region tailer
 	if (c.block_id + 1 == s_blocks_per_region) {
 		// Do encrypt
 		//syslog(LOG_DEBUG, "Writing region footer, iv = %ju", c.iv + 1);
 		simple_enc(c.iv + 1, m_region_footer);
 		// Do write
-		if (!write_fully(m_fi->fd, m_region_footer.buf(), m_region_footer.size())) {
+		if (!write_fully(fi.fd, m_region_footer.buf(), m_region_footer.size())) {
 			syslog(LOG_ERR, "Unable to write region footer");
 			return false;
 		}
-		m_fi->size += m_region_footer.size();
+		fi.size += m_region_footer.size();
+		stat_add(stat_bytes_appended, m_region_footer.size());
 	}
+	lat_record(lat_io, lat_now() - io_start);
 	// If end of chunk, write chunk tailer
 	if (c.bid_chunk + 1 == s_blocks_per_chunk) {
+		lat_timer timer(lat_rollover);
 		// Do encrypt
 		//syslog(LOG_DEBUG, "Writing chunk footer, iv = %ju", c.iv + 2);
 		simple_enc(c.iv + 2, m_chunk_footer);
 		// Do write
-		if (!write_fully(m_fi->fd, m_chunk_footer.buf(), m_chunk_footer.size())) {
+		if (!write_fully(fi.fd, m_chunk_footer.buf(), m_chunk_footer.size())) {
 			syslog(LOG_ERR, "Unable to write chunk footer");
 			return false;
 		}
-		m_fi->size += m_chunk_footer.size();
+		fi.size += m_chunk_footer.size();
+		stat_add(stat_bytes_appended, m_chunk_footer.size());
 		// Close old chunk and reopen readonly
 		if (!next_chunk(c.chunk_id)) {
 			return false;
@@ -387,76 +574,633 @@ bool block_file::write_block(uint32_t logical, const rslice_t& block, uint64_t&
 	return true;
 }
 
+slice_t block_file::encrypt_run(cipher_ctx_t& ctx, uint64_t physical, const vector<uint32_t>& logical, 
+	const rslice_t& blocks)
+{
+	assert(blocks.size() == logical.size() * s_bytes_per_block);
+	slice_t records(logical.size() * s_block_total_size);
+	for (size_t i = 0; i < logical.size(); i++) {
+		coordinates c(physical + i);
+		encrypt_record(ctx, c.iv, logical[i], blocks.slice(i * s_bytes_per_block, s_bytes_per_block), 
+			records.slice(i * s_block_total_size, s_block_total_size));
+	}
+	return records;
+}
+
+bool block_file::append_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& records)
+{
+	assert(records.size() == logical.size() * s_block_total_size);
+	if (physical != m_next) {
+		syslog(LOG_ERR, "Run was encrypted for %ju, but the top is %ju", uintmax_t(physical), uintmax_t(m_next));
+		return false;
+	}
+	size_t done = 0;
+	while (done < logical.size()) {
+		// Up to the end of the region in one write, then its footer
+		coordinates c(m_next);
+		size_t count = std::min(logical.size() - done, size_t(s_blocks_per_region - c.block_id));
+		for (size_t i = 0; i < count; i++) {
+			set_logical(m_region_footer.buf(), c.block_id + i, logical[done + i]);
+			set_logical(m_chunk_footer.buf(), c.bid_chunk + i, logical[done + i]);
+		}
+		file_info& fi = slot(m_high);
+		uint64_t size = count * s_block_total_size;
+		if (!pwrite_fully(fi.fd, records.buf() + done * s_block_total_size, size, c.block_offset)) {
+			syslog(LOG_ERR, "Unable to write blocks: %s", strerror(errno));
+			return false;
+		}
+		fi.size += size;
+		stat_add(stat_blocks_appended, count);
+		stat_add(stat_bytes_appended, size);
+		m_next += count;
+		done += count;
+		if (c.block_id + count < s_blocks_per_region) {
+			break;
+		}
+		simple_enc(c.iv - c.block_id + s_blocks_per_region, m_region_footer);
+		if (!pwrite_fully(fi.fd, m_region_footer.buf(), m_region_footer.size(), c.region_offset + s_region_footer_off)) {
+			syslog(LOG_ERR, "Unable to write region footer");
+			return false;
+		}
+		fi.size += m_region_footer.size();
+		stat_add(stat_bytes_appended, m_region_footer.size());
+		if (c.region_id + 1 < s_regions_per_chunk) {
+			continue;
+		}
+		simple_enc((c.chunk_id + 1) * s_ivs_per_chunk - 1, m_chunk_footer);
+		if (!pwrite_fully(fi.fd, m_chunk_footer.buf(), m_chunk_footer.size(), s_chunk_footer_off)) {
+			syslog(LOG_ERR, "Unable to write chunk footer");
+			return false;
+		}
+		fi.size += m_chunk_footer.size();
+		stat_add(stat_bytes_appended, m_chunk_footer.size());
+		if (!next_chunk(c.chunk_id)) {
+			return false;
+		}
+	}
+	return true;
+}
+
 bool block_file::read_block(uint64_t physical, rslice_t& block_out, uint32_t& logical_out)
+{
+	slice_t block(s_bytes_per_block);
+	if (!read_block_into(physical, block, logical_out)) {
+		return false;
+	}
+	block_out = block;
+	return true;
+}
+
+bool block_file::read_block_into(uint64_t physical, const slice_t& block_out, uint32_t& logical_out)
 {	
+	assert(block_out.size() == s_bytes_per_block);
 	//syslog(LOG_DEBUG, "Reading physical %ju", physical);
 	// Break things down into coordinates
 	coordinates c(physical);
 
-	// Find chunk in map
-	auto it = m_chunks.find(c.chunk_id);
-	if (it == m_chunks.end()) {
+	// Find chunk in the ring
+	file_info* fi = find_chunk(c.chunk_id);
+	if (fi == NULL) {
 		syslog(LOG_ERR, "Trying to read block from invalid chunk");
 		return false;
 	}
-	file_info& fi = it->second;
 
 	// Check that the data is there
-	if (c.block_offset + s_block_total_size > (uint64_t)fi.size) {
+	if (c.block_offset + s_block_total_size > (uint64_t)fi->size) {
 		syslog(LOG_ERR, "Attempt to read block past EOF, offset = %ju, size = %ju", 
-			(uintmax_t)c.block_offset, (uintmax_t)fi.size
+			(uintmax_t)c.block_offset, (uintmax_t)fi->size
 		);
 		return false;
 	}
 	// Do seek to proper offset
-	off_t r = lseek(fi.fd, c.block_offset, SEEK_SET);
+	uint64_t io_start = lat_now();
+	int fd = chunk_fd(c.chunk_id, *fi);
+	if (fd < 0) {
+		return false;
+	}
+	off_t r = lseek(fd, c.block_offset, SEEK_SET);
 	if ((uint64_t)r != c.block_offset) {
 		syslog(LOG_ERR, "lseek returned invalid result for seek to %ju: %jd", 
 			(uintmax_t)c.block_offset, (intmax_t)r
 		);
 		return false;
 	}
-	// Do read
-	slice_t block_buf(s_block_total_size);
-	if (!read_fully(fi.fd, block_buf.buf(), block_buf.size())) {
+	// Do read, the data portion goes straight to the output
+	char header[s_block_header_size];
+	struct iovec iov[2] = {
+		{ header, s_block_header_size },
+		{ block_out.buf(), s_bytes_per_block },
+	};
+	if (readv(fd, iov, 2) != ssize_t(s_block_total_size)) {
 		syslog(LOG_ERR, "Read of encrypted block failed");
 		return false;
 	}
-
-	if (!simple_dec(c.iv, block_buf)) {
+	lat_record(lat_io, lat_now() - io_start);
+	// Decrypt both parts in place
+	lat_timer timer(lat_crypt);
+	slice_t header_buf = slice_t::wrap(header, s_block_header_size);
+	m_cipher_ctx.gcm_set_iv(c.iv);
+	m_cipher_ctx.gcm_partial_decrypt(header_buf.hrest(s_tag_size));
+	m_cipher_ctx.gcm_partial_decrypt(block_out);
+	slice_t tag = slice_t::local(s_tag_size);
+	m_cipher_ctx.gcm_finalize(tag);
+	if (tag != header_buf.header(s_tag_size)) {
+		syslog(LOG_ERR, "Tag is invalid when reading block");
 		return false;
 	}
 	// Extract address portion
-	logical_out = get_logical(block_buf.buf() + s_tag_size, 0);
+	logical_out = get_logical(header + s_tag_size, 0);
 	//syslog(LOG_DEBUG, "Logical = %u", logical_out);
-	// Return data portion
-	block_out = block_buf.hrest(s_tag_size + sizeof(uint32_t));
 	return true;
 }
 
+int block_file::dup_chunk(uint64_t physical)
+{
+	coordinates c(physical);
+	file_info* fi = find_chunk(c.chunk_id);
+	if (fi == NULL) {
+		syslog(LOG_ERR, "Trying to read ahead from invalid chunk");
+		return -1;
+	}
+	int fd = chunk_fd(c.chunk_id, *fi);
+	if (fd < 0) {
+		return -1;
+	}
+	int r = dup(fd);
+	if (r < 0) {
+		syslog(LOG_ERR, "Unable to dup chunk: %s", strerror(errno));
+	}
+	return r;
+}
+
+bool block_file::read_run(cipher_ctx_t& ctx, int fd, uint64_t physical, uint32_t count, 
+	vector<rslice_t>& blocks_out, vector<uint32_t>& logical_out)
+{
+	assert(count && count <= s_max_run);
+	coordinates first(physical);
+	coordinates last(physical + count - 1);
+	assert(first.chunk_id == last.chunk_id);
+	// Region footers in the middle come along, they're small
+	uint64_t span = last.block_offset + s_block_total_size - first.block_offset;
+	slice_t buf(span);
+	if (!pread_fully(fd, buf.buf(), span, first.block_offset)) {
+		syslog(LOG_ERR, "Read ahead of %u blocks failed: %s", count, strerror(errno));
+		return false;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		coordinates c(physical + i);
+		slice_t record = buf.slice(c.block_offset - first.block_offset, s_block_total_size);
+		slice_t block(s_bytes_per_block);
+		ctx.gcm_set_iv(c.iv);
+		ctx.gcm_partial_decrypt(record.slice(s_tag_size, sizeof(uint32_t)));
+		ctx.gcm_partial_decrypt(block, record.hrest(s_block_header_size));
+		slice_t tag = slice_t::local(s_tag_size);
+		ctx.gcm_finalize(tag);
+		if (tag != record.header(s_tag_size)) {
+			syslog(LOG_ERR, "Tag is invalid when reading ahead");
+			return false;
+		}
+		blocks_out.push_back(block);
+		logical_out.push_back(get_logical(record.buf() + s_tag_size, 0));
+	}
+	return true;
+}
+
+// Reads what there is, a short count means the file ends early
+static ssize_t pread_some(int fd, char* buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t r = pread(fd, buf + done, size - done, offset + done);
+		if (r < 0 && errno == EAGAIN) {
+			continue;
+		}
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+// Decrypts a block or footer in place, true if its tag checks out
+static bool open_record(cipher_ctx_t& ctx, uint64_t iv, const slice_t& record)
+{
+	ctx.gcm_set_iv(iv);
+	ctx.gcm_partial_decrypt(record.hrest(s_tag_size));
+	slice_t tag = slice_t::local(s_tag_size);
+	ctx.gcm_finalize(tag);
+	return tag == record.header(s_tag_size);
+}
+
+void block_file::verify_region(cipher_ctx_t& ctx, int fd, uint64_t chunk_id, uint64_t region, 
+	bool final, verify_result& out)
+{
+	string where = "chunk " + std::to_string(chunk_id) + " region " + std::to_string(region);
+	slice_t buf(s_region_total_size);
+	off_t offset = region * s_region_total_size;
+	ssize_t got = pread_some(fd, buf.buf(), buf.size(), offset);
+	if (got < 0) {
+		out.problems.push_back(where + ": read failed, " + strerror(errno));
+		return;
+	}
+	out.bytes += got;
+	if (uint64_t(got) < buf.size()) {
+		if (!final) {
+			out.problems.push_back(where + ": chunk file is short");
+		}
+		memset(buf.buf() + got, 0, buf.size() - got);
+	}
+	slice_t footer = buf.slice(s_region_footer_off, s_region_footer_size);
+	out.footer = open_record(ctx, chunk_id * s_ivs_per_chunk + (region + 1) * s_ivs_per_region - 1, footer);
+	if (!out.footer && !final) {
+		out.problems.push_back(where + ": bad region footer");
+	}
+	// Without a footer in the final chunk, the log ends at the first bad block
+	// and the region's last block doesn't count, as when the log is opened
+	bool tail = final && !out.footer;
+	bool ended = false;
+	for (uint64_t block = 0; block < s_blocks_per_region; block++) {
+		coordinates c(chunk_id * s_blocks_per_chunk + region * s_blocks_per_region + block);
+		slice_t record = buf.slice(block * s_block_total_size, s_block_total_size);
+		bool good = open_record(ctx, c.iv, record);
+		string at = where + " block " + std::to_string(block);
+		if (tail) {
+			ended = ended || !good || block + 1 == s_blocks_per_region;
+			if (!ended) {
+				out.blocks++;
+			} else if (good && block + 1 < s_blocks_per_region) {
+				out.problems.push_back(at + ": good block past the end of the log");
+			}
+			continue;
+		}
+		if (!good) {
+			out.problems.push_back(at + ": bad block tag");
+			continue;
+		}
+		out.blocks++;
+		uint32_t logical = get_logical(record.buf() + s_tag_size, 0);
+		uint32_t listed = get_logical(footer.buf() + s_tag_size, block);
+		if (out.footer && logical != listed) {
+			out.problems.push_back(at + ": header says logical " + std::to_string(logical) + 
+				", region footer says " + std::to_string(listed));
+		}
+	}
+	// Checking a whole log would push everything else out of the page cache
+	posix_fadvise(fd, offset, s_region_total_size, POSIX_FADV_DONTNEED);
+}
+
+void block_file::verify_chunk_footer(cipher_ctx_t& ctx, int fd, uint64_t chunk_id, 
+	bool final, verify_result& out)
+{
+	string where = "chunk " + std::to_string(chunk_id);
+	slice_t footer(s_chunk_footer_size);
+	ssize_t got = pread_some(fd, footer.buf(), footer.size(), s_chunk_footer_off);
+	if (got < 0) {
+		out.problems.push_back(where + ": read failed, " + strerror(errno));
+		return;
+	}
+	out.bytes += got;
+	out.footer = uint64_t(got) == footer.size() && open_record(ctx, (chunk_id + 1) * s_ivs_per_chunk - 1, footer);
+	if (!out.footer) {
+		if (!final) {
+			out.problems.push_back(where + ": bad chunk footer");
+		}
+		return;
+	}
+	// The region checks hold the blocks to the region footers, this holds
+	// those to the chunk footer.  Bad region footers get reported there.
+	slice_t rfooter(s_region_footer_size);
+	for (uint64_t region = 0; region < s_regions_per_chunk; region++) {
+		off_t roff = region * s_region_total_size + s_region_footer_off;
+		uint64_t iv = chunk_id * s_ivs_per_chunk + (region + 1) * s_ivs_per_region - 1;
+		got = pread_some(fd, rfooter.buf(), rfooter.size(), roff);
+		if (uint64_t(got) != rfooter.size() || !open_record(ctx, iv, rfooter)) {
+			continue;
+		}
+		out.bytes += got;
+		uint64_t differ = 0;
+		for (uint64_t block = 0; block < s_blocks_per_region; block++) {
+			if (get_logical(rfooter.buf() + s_tag_size, block) != 
+					get_logical(footer.buf() + s_tag_size, region * s_blocks_per_region + block)) {
+				differ++;
+			}
+		}
+		if (differ) {
+			out.problems.push_back(where + " region " + std::to_string(region) + ": " + 
+				std::to_string(differ) + " entries differ from the chunk footer");
+		}
+	}
+}
+
+void block_file::prefetch_region(int fd, uint64_t region)
+{
+	posix_fadvise(fd, region * s_region_total_size, s_region_total_size, POSIX_FADV_WILLNEED);
+}
+
 bool block_file::next_chunk(uint64_t chunk) 
 {
-	// Close old chunk and reopen readonly
-	//syslog(LOG_DEBUG, "Making next chunk");
-	::close(m_fi->fd);
-	m_fi->fd = ::open(file_name(chunk).c_str(), O_RDONLY);
-	if (m_fi->fd < 0) {
-		syslog(LOG_ERR, "Unable to reopen final chunk");
+	// The sealed chunk stays open for reads, the worker syncs a dup of it
+	int seal_fd = dup(slot(chunk).fd);
+	if (seal_fd < 0) {
+		syslog(LOG_ERR, "Unable to dup sealed chunk: %s", strerror(errno));
 		return false;
 	}
-	// Add new chunk
-	int new_fd = ::open(file_name(chunk + 1).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0777);
+	int new_fd = -1;
+	{
+		std::unique_lock<std::mutex> lock(m_work_lock);
+		m_seal_fds.push_back(seal_fd);
+		m_digest_queue.push_back(chunk);
+		if (m_mirror.enabled()) {
+			m_mirror_queue.push_back(chunk);
+		}
+		m_work_cv.notify_all();
+		// The spare has normally been ready for ages
+		m_work_cv.wait(lock, [this] { return m_spare_fd >= 0 || m_spare_failed; });
+		if (m_spare_fd >= 0) {
+			// Still under the lock, so the worker can't start on a new spare yet
+			if (rename(spare_name().c_str(), file_name(chunk + 1).c_str()) == 0) {
+				new_fd = m_spare_fd;
+			} else {
+				syslog(LOG_ERR, "Unable to rename spare chunk: %s", strerror(errno));
+				::close(m_spare_fd);
+			}
+		}
+		m_spare_fd = -1;
+		m_spare_failed = false;
+		m_work_cv.notify_all();
+	}
 	if (new_fd < 0) {
-		syslog(LOG_ERR, "Unable to create new file");
-		return false;
+		// No spare, make the chunk the slow way
+		new_fd = ::open(file_name(chunk + 1).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0777);
+		if (new_fd < 0) {
+			syslog(LOG_ERR, "Unable to create new file");
+			return false;
+		}
 	}
-	m_fi = &m_chunks[chunk + 1];
-	m_fi->fd = new_fd;
-	m_fi->size = 0;
+	add_chunk(chunk + 1, new_fd, 0);
+	m_manifest.set_live(chunk + 1, 0);
+	// The sealed chunk joins the other sealed ones in the LRU
+	lru_add(chunk, slot(chunk));
+	m_dir_dirty = true;
+	stat_add(stat_chunks_created);
 	
 	return true;
 }
 
+// Chunks only ever get added after the final one
+void block_file::add_chunk(uint64_t chunk_id, int fd, off_t size)
+{
+	if (m_ring.empty()) {
+		m_ring.resize(16);
+		m_low = chunk_id;
+	} else {
+		assert(chunk_id == m_high + 1);
+		if (chunk_id - m_low == m_ring.size()) {
+			vector<file_info> bigger(m_ring.size() * 2);
+			for (uint64_t id = m_low; id < chunk_id; id++) {
+				bigger[id & (bigger.size() - 1)] = slot(id);
+			}
+			swap(m_ring, bigger);
+		}
+	}
+	m_high = chunk_id;
+	file_info& fi = slot(chunk_id);
+	fi.fd = fd;
+	fi.size = size;
+}
+
+block_file::file_info* block_file::find_chunk(uint64_t chunk_id)
+{
+	if (m_ring.empty() || chunk_id < m_low || chunk_id > m_high) {
+		return NULL;
+	}
+	return &slot(chunk_id);
+}
+
+// The fd of a chunk, (re)opening a sealed one if it was closed to make room
+int block_file::chunk_fd(uint64_t chunk_id, file_info& fi)
+{
+	if (chunk_id == m_high) {
+		return fi.fd;
+	}
+	if (fi.fd >= 0) {
+		m_lru.splice(m_lru.begin(), m_lru, fi.lru);
+		return fi.fd;
+	}
+	fi.fd = ::open(file_name(chunk_id).c_str(), O_RDONLY);
+	if (fi.fd < 0) {
+		syslog(LOG_ERR, "Unable to open file: %s, %s", file_name(chunk_id).c_str(), strerror(errno));
+		return -1;
+	}
+	stat_add(stat_chunk_opens);
+	lru_add(chunk_id, fi);
+	return fi.fd;
+}
+
+// Adds an open sealed chunk, closing the least recently used beyond the cap
+void block_file::lru_add(uint64_t chunk_id, file_info& fi)
+{
+	m_lru.push_front(chunk_id);
+	fi.lru = m_lru.begin();
+	while (m_lru.size() > m_open_chunks) {
+		uint64_t oldest = m_lru.back();
+		close_chunk(oldest, slot(oldest));
+	}
+}
+
+void block_file::close_chunk(uint64_t chunk_id, file_info& fi)
+{
+	if (fi.fd < 0) {
+		return;
+	}
+	::close(fi.fd);
+	fi.fd = -1;
+	if (chunk_id != m_high) {
+		m_lru.erase(fi.lru);
+	}
+}
+
+// Checks the GCM tag of a block or footer in place, quietly, as a failure is
+// the normal way to find the end of the log
+bool block_file::record_valid(int fd, off_t offset, uint64_t size, uint64_t iv)
+{
+	slice_t buf = slice_t::local(size);
+	if (!pread_fully(fd, buf.buf(), size, offset)) {
+		return false;
+	}
+	m_cipher_ctx.gcm_set_iv(iv);
+	m_cipher_ctx.gcm_partial_decrypt(buf.hrest(s_tag_size));
+	slice_t tag = slice_t::local(s_tag_size);
+	m_cipher_ctx.gcm_finalize(tag);
+	return tag == buf.header(s_tag_size);
+}
+
+bool block_file::chunk_sealed(uint64_t chunk_id, bool& sealed_out)
+{
+	int fd = ::open(file_name(chunk_id).c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	sealed_out = record_valid(fd, s_chunk_footer_off, s_chunk_footer_size, (chunk_id + 1) * s_ivs_per_chunk - 1);
+	::close(fd);
+	return true;
+}
+
+bool block_file::chunk_blocks(uint64_t chunk_id, uint64_t& valid_out)
+{
+	int fd = ::open(file_name(chunk_id).c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	valid_out = valid_blocks(fd, chunk_id);
+	::close(fd);
+	return true;
+}
+
+// Blocks at the start of a chunk that made it to disk, region footers first,
+// then block by block through the region that didn't get one
+uint64_t block_file::valid_blocks(int fd, uint64_t chunk_id)
+{
+	if (record_valid(fd, s_chunk_footer_off, s_chunk_footer_size, (chunk_id + 1) * s_ivs_per_chunk - 1)) {
+		return s_blocks_per_chunk;
+	}
+	uint64_t region = 0;
+	while (region + 1 < s_regions_per_chunk) {
+		uint64_t roff = region * s_region_total_size + s_region_footer_off;
+		uint64_t iv = chunk_id * s_ivs_per_chunk + (region + 1) * s_ivs_per_region - 1;
+		if (!record_valid(fd, roff, s_region_footer_size, iv)) {
+			break;
+		}
+		region++;
+	}
+	// A region's last block is written along with its footer, so without the
+	// footer it has to go again
+	uint64_t valid = region * s_blocks_per_region;
+	while (valid + 1 < (region + 1) * s_blocks_per_region) {
+		coordinates c(chunk_id * s_blocks_per_chunk + valid);
+		if (!record_valid(fd, c.block_offset, s_block_total_size, c.iv)) {
+			break;
+		}
+		valid++;
+	}
+	return valid;
+}
+
+void block_file::start_worker()
+{
+	m_stop = false;
+	m_spare_fd = -1;
+	m_spare_failed = false;
+	m_seal_failed = false;
+	m_manifest_due = false;
+	m_digest_queue.clear();
+	m_mirror_queue.clear();
+	m_worker = std::thread([this] { worker(); });
+}
+
+void block_file::stop_worker()
+{
+	if (!m_worker.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_work_lock);
+		m_stop = true;
+		m_work_cv.notify_all();
+	}
+	m_worker.join();
+	if (m_spare_fd >= 0) {
+		::close(m_spare_fd);
+		m_spare_fd = -1;
+		unlink(spare_name().c_str());
+	}
+}
+
+void block_file::worker()
+{
+	std::unique_lock<std::mutex> lock(m_work_lock);
+	while (true) {
+		if (!m_seal_fds.empty()) {
+			vector<int> fds;
+			swap(fds, m_seal_fds);
+			m_sealing += fds.size();
+			lock.unlock();
+			bool ok = true;
+			for (int fd : fds) {
+				if (fdatasync(fd) != 0) {
+					syslog(LOG_ERR, "Unable to sync sealed chunk: %s", strerror(errno));
+					ok = false;
+				}
+				::close(fd);
+			}
+			lock.lock();
+			m_sealing -= fds.size();
+			m_seal_failed = m_seal_failed || !ok;
+			m_work_cv.notify_all();
+			continue;
+		}
+		if (m_manifest_due && !m_stop) {
+			m_manifest_due = false;
+			lock.unlock();
+			m_manifest.write();
+			lock.lock();
+			continue;
+		}
+		// Digests and mirror copies wait for the spare, digests are left for
+		// the next open when stopping, mirror copies aren't
+		if (!m_digest_queue.empty() && !m_stop && (m_spare_fd >= 0 || m_spare_failed)) {
+			uint64_t chunk_id = m_digest_queue.front();
+			m_digest_queue.pop_front();
+			lock.unlock();
+			digest_t digest;
+			if (chunk_manifest::digest_file(file_name(chunk_id), digest)) {
+				m_manifest.set_digest(chunk_id, digest);
+				m_manifest.write();
+			}
+			lock.lock();
+			continue;
+		}
+		if (!m_mirror_queue.empty() && (m_stop || m_spare_fd >= 0 || m_spare_failed)) {
+			uint64_t chunk_id = m_mirror_queue.front();
+			m_mirror_queue.pop_front();
+			lock.unlock();
+			m_mirror.sealed(chunk_id);
+			lock.lock();
+			continue;
+		}
+		if (m_stop) {
+			return;
+		}
+		if (m_spare_fd < 0 && !m_spare_failed) {
+			lock.unlock();
+			int fd = ::open(spare_name().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0777);
+			if (fd < 0) {
+				syslog(LOG_ERR, "Unable to create spare chunk: %s", strerror(errno));
+			} else {
+				preallocate(fd, 0);
+			}
+			lock.lock();
+			m_spare_fd = fd;
+			m_spare_failed = fd < 0;
+			m_work_cv.notify_all();
+			continue;
+		}
+		m_work_cv.wait(lock);
+	}
+}
+
+// Sealed chunks have to be on disk before anything that depends on them
+bool block_file::wait_sealed()
+{
+	std::unique_lock<std::mutex> lock(m_work_lock);
+	m_work_cv.wait(lock, [this] { return m_seal_fds.empty() && m_sealing == 0; });
+	return !m_seal_failed;
+}
+
 string block_file::file_name(uint64_t chunk_id)
 {
 	char filename[50];
@@ -486,7 +1230,7 @@ bool block_file::simple_dec(uint64_t iv, const slice_t& buf)
 	// Decrypt in place
 	m_cipher_ctx.gcm_partial_decrypt(buf.hrest(s_tag_size));
 	// Compute tag
-	slice_t tag(s_tag_size);
+	slice_t tag = slice_t::local(s_tag_size);
 	m_cipher_ctx.gcm_finalize(tag);
 	//hexdump(stderr, buf.buf(), buf.size()); 
 	//hexdump(stderr, tag.buf(), tag.size()); 
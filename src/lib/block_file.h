@@ -19,60 +19,172 @@
 
 #include "types.h"
 #include "cipher.h"
+#include "chunk_mirror.h"
+#include "chunk_manifest.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+#ifndef SAFEDISK_SMALL_GEOMETRY
 static const uint64_t s_bytes_per_block = 1024;   // Block size in bytes
 static const uint64_t s_blocks_per_region = 1024;  // Region size in blocks
 static const uint64_t s_regions_per_chunk = 256;    // Chunk size in regions 
-
-//For tests
-/*
+#else
+// For tests, see './build test'
 static const uint64_t s_bytes_per_block = 50;   // Block size in bytes
 static const uint64_t s_blocks_per_region = 5;  // Region size in blocks
 static const uint64_t s_regions_per_chunk = 3;    // Chunk size in regions 
-*/
+#endif
+
+static const size_t s_default_open_chunks = 64;  // Sealed chunk files kept open at once
 
 class block_file 
 {
 public:
-	// Construct a block file
-	block_file(const cipher_key_t& key);
+	// Construct a block file, sealed chunks are opened as reads need them and
+	// at most open_chunks of them stay open, the final chunk is always open
+	block_file(const cipher_key_t& key, size_t open_chunks = s_default_open_chunks);
 	// Destruct
 	~block_file() { close(); }
 
-	// Open a directory, recover any existing blocks
+	// Directories to keep copies of the chunks in, call before open.  Sealed
+	// chunks are copied in the background, the final one by each sync.
+	void set_mirrors(const vector<string>& dirs) { m_mirror.set_targets(dirs); }
+	// Open a directory, recover any existing blocks.  A manifest of the chunks
+	// is kept there for sync tools, see chunk_manifest.
 	bool open(const string& dir);
 	// Close nicely
 	void close();
 	// Scan existing block file, call functor with physical->logical mapping, replay in physical order
-	bool scan(std::function<void (uint64_t, uint32_t)> callback);
+	// Only blocks >= from are reported, but the live chunk is always read to recover its footers
+	bool scan(std::function<void (uint64_t, uint32_t)> callback, uint64_t from = 0);
 	// Removes old chunks, keeping only physical blocks >= keep_after
 	bool remove_old(uint64_t keep_after); 
 	// Writes a block, returns true if no errors, also returns physical location
 	bool write_block(uint32_t logical, const rslice_t& block, uint64_t& physical_out);
 	// Reads a block, return true if no errors
 	bool read_block(uint64_t physical, rslice_t& block_out, uint32_t& logical_out);
+	// Same, but decrypts into block_out, which must be s_bytes_per_block long
+	bool read_block_into(uint64_t physical, const slice_t& block_out, uint32_t& logical_out);
+	// Bulk appends: encrypt_run makes the records for blocks that are to go at
+	// log positions physical on, with the caller's context, so runs can be
+	// encrypted ahead of time on several threads.  append_run then writes
+	// them with their footers, by then physical has to be the top.
+	static slice_t encrypt_run(cipher_ctx_t& ctx, uint64_t physical, const vector<uint32_t>& logical, 
+		const rslice_t& blocks);
+	bool append_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& records);
 	// Get 'top' of physical space
 	uint64_t top() { return m_next; }
 
+	// Reading without the caller's lock, for readahead: dup_chunk gives a dup of
+	// the fd of the chunk holding physical, it still works after the chunk is
+	// closed or removed.  read_run then reads count blocks from physical on, all
+	// in that chunk and below top, with one read, and checks and decrypts them
+	// with a cipher context that isn't shared.
+	int dup_chunk(uint64_t physical);
+	static bool read_run(cipher_ctx_t& ctx, int fd, uint64_t physical, uint32_t count, 
+		vector<rslice_t>& blocks_out, vector<uint32_t>& logical_out);
+	// Blocks read_run will take at once
+	static const uint32_t s_max_run = 64;
+
+	// Offline checking for safedisk-verify, straight from the chunk files.  Like
+	// read_run these use the caller's cipher context, so many threads can check
+	// at once.  Whatever doesn't check out is described in problems.
+	struct verify_result
+	{
+		uint64_t blocks = 0;      // Block records that checked out
+		uint64_t bytes = 0;       // Bytes read
+		bool     footer = false;  // The footer checked out
+		vector<string> problems;
+	};
+	// Checks every block tag of a region, and the block headers against the
+	// region footer.  The final chunk may end anywhere, then blocks only counts
+	// those before the end of the log.
+	static void verify_region(cipher_ctx_t& ctx, int fd, uint64_t chunk_id, uint64_t region, 
+		bool final, verify_result& out);
+	// Checks the chunk footer, and the region footers against it
+	static void verify_chunk_footer(cipher_ctx_t& ctx, int fd, uint64_t chunk_id, 
+		bool final, verify_result& out);
+	// Asks the kernel to start reading a region
+	static void prefetch_region(int fd, uint64_t region);
+
+	// Making the log durable happens in two steps, so the slow part can run
+	// without the caller's lock: prepare_sync grabs what needs syncing, and
+	// run_sync syncs it, it must not be called concurrently with open or close
+	struct sync_job
+	{
+		int  fd = -1;      // A dup of the final chunk
+		bool dir = false;  // New chunk files need their directory entries synced
+		uint64_t chunk_id = 0;  // The final chunk, and how much of it there is,
+		off_t    size = 0;      // for the mirrors
+	};
+	bool prepare_sync(sync_job& job);
+	bool run_sync(sync_job& job);
+	// Number of chunk files currently kept
+	size_t chunk_count() { return m_ring.empty() ? 0 : m_high - m_low + 1; }
+	// Number of sealed chunk files open right now
+	size_t open_chunk_count() { return m_lru.size(); }
+
 private:
+	struct file_info 
+	{
+		int   fd = -1;  // Sealed chunks are only open while in the LRU
+		off_t size = 0;
+		list<uint64_t>::iterator lru;
+	};
+
+	void add_chunk(uint64_t chunk_id, int fd, off_t size);
+	file_info* find_chunk(uint64_t chunk_id);
+	file_info& slot(uint64_t chunk_id) { return m_ring[chunk_id & (m_ring.size() - 1)]; }
+	int chunk_fd(uint64_t chunk_id, file_info& fi);
+	void lru_add(uint64_t chunk_id, file_info& fi);
+	void close_chunk(uint64_t chunk_id, file_info& fi);
 	bool next_chunk(uint64_t chunk_id);
 	string file_name(uint64_t chunk_id);
+	string spare_name() { return m_dir + "/spare"; }
+	string torn_name(uint64_t chunk_id) { return m_dir + "/torn_" + std::to_string(chunk_id); }
+	bool record_valid(int fd, off_t offset, uint64_t size, uint64_t iv);
+	bool chunk_sealed(uint64_t chunk_id, bool& sealed_out);
+	bool chunk_blocks(uint64_t chunk_id, uint64_t& valid_out);
+	uint64_t valid_blocks(int fd, uint64_t chunk_id);
+	void start_worker();
+	void stop_worker();
+	void worker();
+	bool wait_sealed();
 	void simple_enc(uint64_t iv, const slice_t& buf);
 	bool simple_dec(uint64_t iv, const slice_t& buf);
 
 private:
-	struct file_info 
-	{
-		int   fd;
-		off_t size;
-	};
-
-	typedef map<uint64_t, file_info> chunk_map_t;
 	cipher_ctx_t m_cipher_ctx;
 	string       m_dir;
-	chunk_map_t  m_chunks;
+	// Chunks m_low to m_high in a ring indexed by chunk id, it doubles when full
+	vector<file_info> m_ring;
+	uint64_t     m_low;
+	uint64_t     m_high;  // The final chunk, being written
+	list<uint64_t> m_lru;  // Open sealed chunks, most recently used first
+	size_t       m_open_chunks;
 	uint64_t     m_next;
-	file_info*   m_fi;
+	bool         m_dir_dirty;  // Chunks were created since the last sync
 	slice_t      m_region_footer;
 	slice_t      m_chunk_footer;
+
+	chunk_mirror   m_mirror;
+	chunk_manifest m_manifest;
+
+	// A background thread keeps a preallocated spare ready to become the next
+	// chunk, and syncs chunks once they are sealed, so rollover doesn't wait.
+	// When idle it rewrites the manifest after syncs, works out the digests of
+	// sealed chunks for it, then copies them to the mirrors.
+	std::thread             m_worker;
+	std::mutex              m_work_lock;
+	std::condition_variable m_work_cv;  // Any change to the state below
+	bool                    m_stop = false;
+	int                     m_spare_fd = -1;
+	bool                    m_spare_failed = false;
+	vector<int>             m_seal_fds;  // Dups of sealed chunks to sync
+	uint32_t                m_sealing = 0;  // Taken by the worker, not synced yet
+	bool                    m_seal_failed = false;
+	bool                    m_manifest_due = false;  // A sync moved the live size
+	deque<uint64_t>         m_digest_queue;  // Sealed chunks the manifest has no digest for
+	deque<uint64_t>         m_mirror_queue;  // Sealed chunks to copy to the mirrors
 };
@@ -16,47 +16,212 @@
  */
 
 #include "block_map.h"
+#include "latency.h"
+#include "stats.h"
 
+#include <stdio.h>
 #include <syslog.h>
+#include <unistd.h>
 
-block_map::block_map(const cipher_key_t& key, uint32_t logical_size) 
+// Unmapped blocks all read as this, one per thread
+static rslice_t zero_block()
+{
+	static thread_local rslice_t zero = slice_t(s_bytes_per_block);
+	return zero;
+}
+
+const uint32_t block_map::s_ahead_threads;
+
+block_map::block_map(const cipher_key_t& key, uint32_t logical_size, size_t map_budget, size_t open_chunks) 
 	: m_logical_size(logical_size)
 	, m_physical_size(2*logical_size)
-	, m_file(key)
-	, m_physical(m_logical_size)
+	, m_file(key, open_chunks)
+	, m_physical(map_budget ? 0 : m_logical_size)
 	, m_in_use(m_physical_size)
-{}
+	, m_key(key)
+{
+	if (map_budget) {
+		m_index.reset(new page_map(key, m_logical_size, map_budget));
+	}
+	m_cache.configure(s_default_readahead / s_bytes_per_block);
+}
+
+void block_map::set_readahead(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_cache.configure(bytes / s_bytes_per_block);
+}
+
+void block_map::set_mirrors(const vector<string>& dirs)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_file.set_mirrors(dirs);
+}
 
 bool block_map::open(const string& dir)
 {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_synced = 0;
 	if (!m_file.open(dir)) {
 		return false;
 	}
+	if (m_cache.enabled() && m_ahead_threads.empty()) {
+		m_ahead_stop = false;
+		uint32_t threads = std::max(1u, std::min(s_ahead_threads, std::thread::hardware_concurrency()));
+		for (uint32_t i = 0; i < threads; i++) {
+			m_ahead_threads.emplace_back([this] { readahead_worker(); });
+		}
+	}
+	m_snapshots.clear();
+	if (m_index) {
+		return open_paged(dir);
+	}
 	std::fill(m_physical.begin(), m_physical.end(), s_invalid);
+	// Replay the log into the map, last write wins
 	bool r = m_file.scan([&](uint64_t phys, uint32_t logical) {
 		//syslog(LOG_DEBUG, "Read mapping: %llu -> %u", phys, logical);
-		assert(logical < m_logical_size);
-		uint32_t phys_small = phys_contract(phys);
-		uint32_t old = m_physical[logical];
-		if (old != s_invalid) {
-			m_in_use.set(old, false);
+		if (logical & s_pinned) {
+			// Copy kept alive for a snapshot of a previous session
+			return;
 		}
-		m_in_use.set(phys_small, true);
-		m_physical[logical] = phys_small;	
+		assert(logical < m_logical_size);
+		m_physical[logical] = phys_contract(phys);	
 	});
+	// Then build the in-use bits in one pass
+	vector<uint64_t> bits((uint64_t(m_physical_size) + 63) / 64);
+	m_used = 0;
+	for (uint32_t phys_small : m_physical) {
+		if (phys_small != s_invalid) {
+			bits[phys_small / 64] |= uint64_t(1) << (phys_small % 64);
+			m_used++;
+		}
+	}
+	m_in_use.assign(bits);
 	return r;
 }
 
+bool block_map::open_paged(const string& dir)
+{
+	bool current;
+	vector<uint64_t> bits;
+	if (!m_index->open(dir, m_physical_size, m_file.top(), current, bits)) {
+		return false;
+	}
+	if (current) {
+		// The index already matches the log, only the live chunk needs reading
+		if (!m_file.scan([](uint64_t, uint32_t) {}, m_file.top())) {
+			return false;
+		}
+	} else {
+		// Replay the log into the index, last write wins
+		bool ok = true;
+		bool r = m_file.scan([&](uint64_t phys, uint32_t logical) {
+			if (logical & s_pinned) {
+				return;
+			}
+			assert(logical < m_logical_size);
+			ok = ok && set_phys(logical, phys_contract(phys));
+		});
+		if (!r || !ok) {
+			return false;
+		}
+		// Then build the in-use bits, a page at a time
+		bits.assign((uint64_t(m_physical_size) + 63) / 64, 0);
+		for (uint32_t logical = 0; logical < m_logical_size; logical++) {
+			uint32_t phys_small;
+			if (!get_phys(logical, phys_small)) {
+				return false;
+			}
+			if (phys_small != s_invalid) {
+				bits[phys_small / 64] |= uint64_t(1) << (phys_small % 64);
+			}
+		}
+	}
+	m_in_use.assign(bits);
+	m_used = m_in_use.count(0, m_physical_size);
+	m_save_index = true;
+	return true;
+}
+
+bool block_map::close()
+{
+	stop_readahead();
+	bool r = flush();
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (!m_save_index) {
+		return r;
+	}
+	m_save_index = false;
+	return m_index->close(m_file.top(), m_in_use.dense()) && r;
+}
+
+bool block_map::flush()
+{
+	stat_add(stat_flushes);
+	std::unique_lock<std::mutex> lock(m_lock);
+	uint64_t want = m_file.top();
+	while (m_synced < want) {
+		if (m_syncing) {
+			// The running sync may already cover us, if not we lead the next one
+			m_sync_done.wait(lock);
+			continue;
+		}
+		m_syncing = true;
+		uint64_t target = m_file.top();
+		block_file::sync_job job;
+		bool ok = m_file.prepare_sync(job);
+		lock.unlock();
+		ok = ok && m_file.run_sync(job);
+		lock.lock();
+		m_syncing = false;
+		m_sync_done.notify_all();
+		if (!ok) {
+			return false;
+		}
+		m_synced = max(m_synced, target);
+	}
+	return true;
+}
+
 bool block_map::write(uint32_t logical, const rslice_t& data)
 {
+	std::lock_guard<std::mutex> lock(m_lock);
+	lat_request request(lat_write);
+	m_cache.invalidate(logical);
+	if (!write_mapped(logical, data)) {
+		// The index may have missed an update, make the next open rebuild it
+		m_save_index = false;
+		return false;
+	}
+	stat_add(stat_user_writes);
+	return true;
+}
+
+bool block_map::write_mapped(uint32_t logical, const rslice_t& data)
+{
+	// Make sure the oldest block won't fall off the ring
+	if (!make_room()) {
+		return false;
+	}
 	// Free old physical block for this logical block (if any)
-	uint32_t prev = m_physical[logical];
+	uint32_t prev;
+	if (!get_phys(logical, prev)) {
+		return false;
+	}
 	if (prev != s_invalid) {
-		// Remove old in-use
-		m_in_use.set(prev, false);
-		// Move one block forward
-		if (!clean_one()) {
-			return false;
+		// Remove old in-use, unless a snapshot still needs it
+		if (!is_pinned(logical, prev)) {
+			free_block(prev);
+		}
+		// Each overwrite earns moving one block forward, done in batches
+		m_clean_credit++;
+		if (m_clean_credit >= s_clean_batch) {
+			uint32_t want = m_clean_credit;
+			m_clean_credit = 0;
+			// The batch may fill the slack make_room left for this write
+			if (!clean(want) || !make_room()) {
+				return false;
+			}
 		}
 	}
 	// Do write
@@ -65,8 +230,10 @@ bool block_map::write(uint32_t logical, const rslice_t& data)
 		return false;
 	}
 	// Update mappings
-	m_in_use.set(phys_contract(phys), true);
-	m_physical[logical] = phys_contract(phys);	
+	use_block(phys_contract(phys));
+	if (!set_phys(logical, phys_contract(phys))) {
+		return false;
+	}
 	// Do 'erase'
 	if (m_file.top() > m_physical_size) {
 		if (!m_file.remove_old(m_file.top() - m_physical_size)) {
@@ -78,14 +245,22 @@ bool block_map::write(uint32_t logical, const rslice_t& data)
 
 bool block_map::read(uint32_t logical, rslice_t& data_out)
 {
+	std::unique_lock<std::mutex> lock(m_lock);
+	lat_request request(lat_read);
+	stat_add(stat_user_reads);
+	read_ahead(logical);
+	if (read_cached(lock, logical, data_out)) {
+		return true;
+	}
 	// Look up physical address
-	uint32_t phys_small = m_physical[logical];
+	uint32_t phys_small;
+	if (!get_phys(logical, phys_small)) {
+		return false;
+	}
 	// If it's empty, return all 0's
 	if (phys_small == s_invalid) {
 		//syslog(LOG_DEBUG, "Returning empty");
-		slice_t empty(s_bytes_per_block);
-		memset(empty.buf(), 0, s_bytes_per_block);	
-		data_out = empty;
+		data_out = zero_block();
 		return true;
 	}
 	// Otherwise get the real data
@@ -95,30 +270,689 @@ bool block_map::read(uint32_t logical, rslice_t& data_out)
 	return r && logical == logical2;
 }
 
-bool block_map::clean_one()
+bool block_map::read_into(uint32_t logical, const slice_t& data_out)
 {
-	// Start by finding oldest block
-	uint32_t in_use = m_in_use.find_set(phys_contract(m_file.top()));
-	// If nothing is in use, return with success
-	if (in_use == m_physical_size) {
+	std::unique_lock<std::mutex> lock(m_lock);
+	lat_request request(lat_read);
+	stat_add(stat_user_reads);
+	read_ahead(logical);
+	rslice_t cached;
+	if (read_cached(lock, logical, cached)) {
+		memcpy(data_out.buf(), cached.buf(), data_out.size());
 		return true;
 	}
-	// Read the block in, determine where it's logical location is	
-	uint64_t phys = phys_expand(in_use);
-	uint32_t logical = 0;
-	rslice_t block;
-	if (!m_file.read_block(phys, block, logical)) {
+	uint32_t phys_small;
+	if (!get_phys(logical, phys_small)) {
+		return false;
+	}
+	if (phys_small == s_invalid) {
+		memset(data_out.buf(), 0, data_out.size());
+		return true;
+	}
+	uint32_t logical2;
+	bool r = m_file.read_block_into(phys_expand(phys_small), data_out, logical2);
+	return r && logical == logical2;
+}
+
+slice_t block_map::encrypt_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& blocks)
+{
+	cipher_ctx_t ctx(m_key);
+	return block_file::encrypt_run(ctx, physical, logical, blocks);
+}
+
+bool block_map::append_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& records)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	// The oldest block mustn't fall off the ring, and there is no cleaning
+	uint32_t oldest = m_in_use.find_set(phys_contract(m_file.top()));
+	uint64_t span = oldest == m_physical_size ? 0 : m_file.top() - phys_expand(oldest);
+	if (span + logical.size() + s_ring_slack >= m_physical_size) {
+		syslog(LOG_ERR, "block_map::append_run> No room without cleaning");
+		return false;
+	}
+	for (uint32_t l : logical) {
+		uint32_t phys_small;
+		if (l >= m_logical_size || !get_phys(l, phys_small) || phys_small != s_invalid) {
+			syslog(LOG_ERR, "block_map::append_run> Block %u is already written", l);
+			return false;
+		}
+	}
+	if (!m_file.append_run(physical, logical, records)) {
+		return false;
+	}
+	stat_add(stat_user_writes, logical.size());
+	for (size_t i = 0; i < logical.size(); i++) {
+		m_cache.invalidate(logical[i]);
+		use_block(phys_contract(physical + i));
+		if (!set_phys(logical[i], phys_contract(physical + i))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool block_map::read_range(uint32_t first, uint32_t count, const slice_t& data_out)
+{
+	assert(data_out.size() == count * s_bytes_per_block);
+	struct run
+	{
+		uint64_t phys;
+		uint32_t index;  // Where in the range it starts
+		uint32_t count;
+		int      fd;
+	};
+	const uint64_t blocks_per_chunk = s_blocks_per_region * s_regions_per_chunk;
+	vector<run> runs;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		stat_add(stat_user_reads, count);
+		if (uint64_t(first) + count > m_logical_size) {
+			syslog(LOG_ERR, "block_map::read_range> Range past the end");
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t phys_small;
+			if (!get_phys(first + i, phys_small)) {
+				return false;
+			}
+			if (phys_small == s_invalid) {
+				memset(data_out.buf() + i * s_bytes_per_block, 0, s_bytes_per_block);
+				continue;
+			}
+			uint64_t phys = phys_expand(phys_small);
+			if (runs.empty() || phys != runs.back().phys + runs.back().count || 
+					i != runs.back().index + runs.back().count || phys % blocks_per_chunk == 0 ||
+					runs.back().count == block_file::s_max_run) {
+				runs.push_back(run{ phys, i, 0, -1 });
+			}
+			runs.back().count++;
+		}
+		// Dups stay readable even if the cleaner drops the chunk meanwhile,
+		// and the log never changes what's already written
+		for (run& r : runs) {
+			if ((r.fd = m_file.dup_chunk(r.phys)) < 0) {
+				break;
+			}
+		}
+	}
+	bool ok = true;
+	cipher_ctx_t ctx(m_key);
+	vector<rslice_t> blocks;
+	vector<uint32_t> logical;
+	for (run& r : runs) {
+		if (r.fd < 0) {
+			ok = false;
+			continue;
+		}
+		blocks.clear();
+		logical.clear();
+		if (ok && !block_file::read_run(ctx, r.fd, r.phys, r.count, blocks, logical)) {
+			ok = false;
+		}
+		::close(r.fd);
+		for (uint32_t i = 0; ok && i < r.count; i++) {
+			if (logical[i] != first + r.index + i) {
+				syslog(LOG_ERR, "block_map::read_range> Block %u holds logical %u", first + r.index + i, logical[i]);
+				ok = false;
+				break;
+			}
+			memcpy(data_out.buf() + (r.index + i) * s_bytes_per_block, blocks[i].buf(), s_bytes_per_block);
+		}
+	}
+	return ok;
+}
+
+bool block_map::snapshot(const string& name)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_index) {
+		syslog(LOG_ERR, "block_map::snapshot> Snapshots need a resident map");
 		return false;
 	}
-	// Remove it from use
-	m_in_use.set(in_use, false);
-	// Rewrite
-	if (!m_file.write_block(logical, block, phys)) {
+	if (m_snapshots.count(name)) {
 		return false;
 	}
-	// Update mappings
-	m_in_use.set(phys_contract(phys), true);
-	m_physical[logical] = phys_contract(phys);	
+	// The copy pins every currently mapped block, the cleaner keeps them alive
+	m_snapshots[name] = m_physical;
+	return true;
+}
+
+bool block_map::release_snapshot(const string& name)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto it = m_snapshots.find(name);
+	if (it == m_snapshots.end()) {
+		return false;
+	}
+	map_vec_t snap;
+	swap(snap, it->second);
+	m_snapshots.erase(it);
+	// Free anything that neither the live map nor another snapshot refers to
+	for (uint32_t logical = 0; logical < m_logical_size; logical++) {
+		uint32_t phys_small = snap[logical];
+		if (phys_small == s_invalid || phys_small == m_physical[logical]) {
+			continue;
+		}
+		if (!is_pinned(logical, phys_small)) {
+			free_block(phys_small);
+		}
+	}
+	return true;
+}
+
+bool block_map::read_snapshot(const string& name, uint32_t logical, rslice_t& data_out)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	lat_request request(lat_read);
+	stat_add(stat_user_reads);
+	auto it = m_snapshots.find(name);
+	if (it == m_snapshots.end()) {
+		return false;
+	}
+	uint32_t phys_small = it->second[logical];
+	if (phys_small == s_invalid) {
+		data_out = zero_block();
+		return true;
+	}
+	uint32_t logical2;
+	bool r = m_file.read_block(phys_expand(phys_small), data_out, logical2);
+	return r && logical == (logical2 & ~s_pinned);
+}
+
+bool block_map::read_snapshot_into(const string& name, uint32_t logical, const slice_t& data_out)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	lat_request request(lat_read);
+	stat_add(stat_user_reads);
+	auto it = m_snapshots.find(name);
+	if (it == m_snapshots.end()) {
+		return false;
+	}
+	uint32_t phys_small = it->second[logical];
+	if (phys_small == s_invalid) {
+		memset(data_out.buf(), 0, data_out.size());
+		return true;
+	}
+	uint32_t logical2;
+	bool r = m_file.read_block_into(phys_expand(phys_small), data_out, logical2);
+	return r && logical == (logical2 & ~s_pinned);
+}
+
+vector<string> block_map::snapshots()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	vector<string> r;
+	for (const auto& kvp : m_snapshots) {
+		r.push_back(kvp.first);
+	}
+	return r;
+}
+
+void block_map::use_block(uint32_t phys_small)
+{
+	m_in_use.set(phys_small, true);
+	m_used++;
+}
+
+void block_map::free_block(uint32_t phys_small)
+{
+	m_in_use.set(phys_small, false);
+	m_used--;
+}
+
+bool block_map::is_pinned(uint32_t logical, uint32_t phys_small)
+{
+	for (const auto& kvp : m_snapshots) {
+		if (kvp.second[logical] == phys_small) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Without snapshots at most m_logical_size blocks are in use, and one clean per
+// overwrite keeps them all inside the ring.  Snapshots can pin more than that,
+// so keep cleaning until the oldest block can survive the coming write.
+bool block_map::make_room()
+{
+	if (m_used + s_ring_slack >= m_physical_size) {
+		if (m_snapshots.empty()) {
+			return true;  // Only tiny rings, normal cleaning is enough
+		}
+		syslog(LOG_ERR, "block_map::write> Out of space, release a snapshot");
+		return false;
+	}
+	while (true) {
+		uint32_t oldest = m_in_use.find_set(phys_contract(m_file.top()));
+		if (oldest == m_physical_size) {
+			return true;
+		}
+		if (m_file.top() - phys_expand(oldest) + s_ring_slack < m_physical_size) {
+			return true;
+		}
+		// Neighbors would only take up the room being made
+		if (!clean(s_clean_batch, false)) {
+			return false;
+		}
+	}
+}
+
+// Moves up to 'want' of the oldest blocks to the top of the log.  They go
+// back in logical order, so blocks of a file that got scattered by overwrites
+// end up next to each other again.
+bool block_map::clean(uint32_t want, bool pull_neighbors)
+{
+	struct victim
+	{
+		uint32_t logical;
+		uint32_t phys_small;
+		bool     live;
+		rslice_t block;
+	};
+	vector<victim> batch;
+	lat_timer timer(lat_clean);
+	// Gather the oldest blocks, stopping if the search wraps around to the top
+	uint32_t top_small = phys_contract(m_file.top());
+	uint32_t pos = top_small;
+	uint32_t last_dist = 0;
+	while (batch.size() < want) {
+		uint32_t in_use = m_in_use.find_set(pos);
+		if (in_use == m_physical_size) {
+			break;
+		}
+		uint32_t dist = (in_use + m_physical_size - top_small) % m_physical_size;
+		if (!batch.empty() && dist <= last_dist) {
+			break;
+		}
+		last_dist = dist;
+		pos = in_use + 1;
+		// Read the block in, determine where it's logical location is	
+		victim v;
+		v.phys_small = in_use;
+		if (!m_file.read_block(phys_expand(in_use), v.block, v.logical)) {
+			return false;
+		}
+		v.logical &= ~s_pinned;
+		assert(v.logical < m_logical_size);
+		// Copies only held by snapshots are flagged so a rescan ignores them
+		uint32_t current;
+		if (!get_phys(v.logical, current)) {
+			return false;
+		}
+		v.live = (current == in_use);
+		batch.push_back(v);
+	}
+	// The batch goes back at the top, into the victims' own slots and the
+	// free ones between them.  Past the last victim only the slots up to the
+	// next block in use are free, and the write that follows needs its slack.
+	size_t victims = batch.size();
+	uint32_t next = m_in_use.find_set(pos);
+	uint32_t next_dist = (next + m_physical_size - top_small) % m_physical_size;
+	uint32_t room = (next == m_physical_size || (victims && next_dist <= last_dist)) ? m_physical_size : next_dist;
+	std::sort(batch.begin(), batch.end(), [](const victim& a, const victim& b) {
+		return a.logical < b.logical;
+	});
+	// Sorting alone rarely makes neighbors, the oldest blocks of a scattered
+	// file are spread all over it.  So each one brings along the live blocks
+	// around it, within a budget of one more batch and the room above.  Only
+	// blocks in the older half of the ring come along, young ones are likely
+	// to be overwritten before their turn.
+	uint32_t spare = room > victims + s_ring_slack ? uint32_t(room - victims - s_ring_slack - 1) : 0;
+	uint32_t budget = std::min(want / 2, spare);
+	bool ok = true;
+	auto pull = [&](uint32_t logical) {
+		uint32_t current;
+		// The block the caller is overwriting is mapped but already free
+		if (!budget || !(ok = get_phys(logical, current)) || current == s_invalid || !m_in_use.get(current) ||
+				m_file.top() - phys_expand(current) < m_physical_size / 2) {
+			return false;
+		}
+		victim v;
+		v.logical = logical;
+		v.phys_small = current;
+		v.live = true;
+		uint32_t logical2;
+		if (!(ok = m_file.read_block(phys_expand(current), v.block, logical2))) {
+			return false;
+		}
+		batch.push_back(v);
+		budget--;
+		return true;
+	};
+	uint32_t covered = 0;  // Everything below is already in the batch or was tried
+	for (size_t i = 0; i < victims && pull_neighbors && budget && ok; i++) {
+		uint32_t logical = batch[i].logical;
+		uint32_t end = i + 1 < victims ? batch[i + 1].logical : m_logical_size;
+		for (uint32_t before = logical; before > covered && pull(before - 1); before--) {
+		}
+		covered = logical + 1;
+		while (covered < end && pull(covered)) {
+			covered++;
+		}
+	}
+	if (!ok) {
+		return false;
+	}
+	std::sort(batch.begin(), batch.end(), [](const victim& a, const victim& b) {
+		return a.logical < b.logical;
+	});
+	// Free them all before writing, the first writes may land where they were
+	for (const victim& v : batch) {
+		free_block(v.phys_small);
+	}
+	vector<uint32_t> moved(batch.size());
+	for (size_t i = 0; i < batch.size(); i++) {
+		const victim& v = batch[i];
+		// Rewrite
+		uint64_t phys;
+		if (!m_file.write_block(v.live ? v.logical : (v.logical | s_pinned), v.block, phys)) {
+			return false;
+		}
+		stat_add(stat_relocations);
+		// Update mappings
+		moved[i] = phys_contract(phys);
+		use_block(moved[i]);
+		if (v.live && !set_phys(v.logical, moved[i])) {
+			return false;
+		}
+	}
+	// A snapshot follows its copy once, another copy of the same block may
+	// have landed where that one was
+	for (auto& kvp : m_snapshots) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			uint32_t& pinned = kvp.second[batch[i].logical];
+			if (pinned != batch[i].phys_small) {
+				continue;
+			}
+			pinned = moved[i];
+			while (i + 1 < batch.size() && batch[i + 1].logical == batch[i].logical) {
+				i++;
+			}
+		}
+	}
+	return true;
+}
+
+// Takes a block from the readahead cache, waiting for it if it's being read
+bool block_map::read_cached(std::unique_lock<std::mutex>& lock, uint32_t logical, rslice_t& data_out)
+{
+	if (!m_cache.enabled()) {
+		return false;
+	}
+	m_ahead_cv.wait(lock, [&] { return !ahead_busy(logical); });
+	if (!m_cache.take(logical, data_out)) {
+		return false;
+	}
+	stat_add(stat_readahead_hits);
+	return true;
+}
+
+// Queues the next window for the readahead thread if logical continues a stream
+void block_map::read_ahead(uint32_t logical)
+{
+	uint32_t first;
+	uint32_t count;
+	if (!m_ahead_threads.empty() && m_cache.note_read(logical, m_logical_size, first, count)) {
+		m_ahead_queue.emplace_back(first, count);
+		m_ahead_cv.notify_all();
+	}
+}
+
+void block_map::stop_readahead()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	if (m_ahead_threads.empty()) {
+		return;
+	}
+	m_ahead_stop = true;
+	m_ahead_cv.notify_all();
+	lock.unlock();
+	for (auto& t : m_ahead_threads) {
+		t.join();
+	}
+	lock.lock();
+	m_ahead_threads.clear();
+	m_ahead_queue.clear();
+	m_cache.clear();
+}
+
+void block_map::readahead_worker()
+{
+	cipher_ctx_t ctx(m_key);
+	std::unique_lock<std::mutex> lock(m_lock);
+	while (true) {
+		m_ahead_cv.wait(lock, [this] { return m_ahead_stop || !m_ahead_queue.empty(); });
+		if (m_ahead_stop) {
+			return;
+		}
+		auto& range = m_ahead_queue.front();
+		uint32_t first = range.first;
+		uint32_t count = std::min(range.second, block_file::s_max_run);
+		range.first += count;
+		range.second -= count;
+		if (range.second == 0) {
+			m_ahead_queue.pop_front();
+		}
+		readahead_batch(lock, ctx, first, count);
+	}
+}
+
+// Looks blocks up under the lock, reads runs of them that are next to each
+// other in the log without it, then caches whatever wasn't written or moved
+// in the meantime
+void block_map::readahead_batch(std::unique_lock<std::mutex>& lock, cipher_ctx_t& ctx, uint32_t first, uint32_t count)
+{
+	struct run
+	{
+		uint64_t         phys;
+		vector<uint32_t> logical;
+		int              fd;
+		vector<rslice_t> blocks;
+		vector<uint32_t> logical_read;
+	};
+	const uint64_t blocks_per_chunk = s_blocks_per_region * s_regions_per_chunk;
+	vector<run> runs;
+	for (uint32_t logical = first; logical < first + count; logical++) {
+		uint32_t phys_small;
+		if (m_cache.contains(logical) || !get_phys(logical, phys_small) || phys_small == s_invalid) {
+			continue;
+		}
+		uint64_t phys = phys_expand(phys_small);
+		if (runs.empty() || phys != runs.back().phys + runs.back().logical.size() || 
+				phys % blocks_per_chunk == 0) {
+			runs.push_back(run{ phys, {}, -1, {}, {} });
+		}
+		runs.back().logical.push_back(logical);
+	}
+	for (run& r : runs) {
+		r.fd = m_file.dup_chunk(r.phys);
+	}
+	auto busy = m_ahead_busy.emplace(m_ahead_busy.end(), first, count);
+	lock.unlock();
+	for (run& r : runs) {
+		if (r.fd >= 0) {
+			block_file::read_run(ctx, r.fd, r.phys, r.logical.size(), r.blocks, r.logical_read);
+			::close(r.fd);
+		}
+	}
+	lock.lock();
+	m_ahead_busy.erase(busy);
+	for (run& r : runs) {
+		for (size_t i = 0; i < r.blocks.size(); i++) {
+			uint32_t logical = r.logical[i];
+			uint32_t phys_small;
+			if (r.logical_read[i] == logical && get_phys(logical, phys_small) && 
+					phys_small == phys_contract(r.phys + i)) {
+				m_cache.put(logical, r.blocks[i]);
+				stat_add(stat_readahead_blocks);
+			}
+		}
+	}
+	m_ahead_cv.notify_all();
+}
+
+bool block_map::ahead_busy(uint32_t logical)
+{
+	for (const block_range_t& range : m_ahead_busy) {
+		if (logical >= range.first && logical - range.first < range.second) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool block_map::get_phys(uint32_t logical, uint32_t& phys_small_out)
+{
+	if (!m_index) {
+		phys_small_out = m_physical[logical];
+		return true;
+	}
+	return m_index->get(logical, phys_small_out);
+}
+
+bool block_map::set_phys(uint32_t logical, uint32_t phys_small)
+{
+	if (!m_index) {
+		m_physical[logical] = phys_small;
+		return true;
+	}
+	return m_index->set(logical, phys_small);
+}
+
+string block_map::stats()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	stat_totals_t totals = stat_totals();
+	string r;
+	char line[64];
+	for (size_t i = 0; i < stat_count; i++) {
+		snprintf(line, sizeof(line), "%s %ju\n", stat_name(stat_counter(i)), uintmax_t(totals[i]));
+		r += line;
+	}
+	// Log blocks per user block, 1 means the cleaner had nothing to move
+	double amplification = totals[stat_user_writes] ? 
+		double(totals[stat_blocks_appended]) / totals[stat_user_writes] : 0;
+	snprintf(line, sizeof(line), "write_amplification %.3f\n", amplification);
+	r += line;
+	snprintf(line, sizeof(line), "ring_blocks %u\n", m_physical_size);
+	r += line;
+	snprintf(line, sizeof(line), "used_blocks %u\n", m_used);
+	r += line;
+	snprintf(line, sizeof(line), "free_ring_blocks %u\n", m_physical_size - m_used);
+	r += line;
+	snprintf(line, sizeof(line), "live_chunks %zu\n", m_file.chunk_count());
+	r += line;
+	snprintf(line, sizeof(line), "open_chunks %zu\n", m_file.open_chunk_count());
+	r += line;
+	snprintf(line, sizeof(line), "log_top %ju\n", uintmax_t(m_file.top()));
+	r += line;
+	return r;
+}
+
+bool block_map::compact()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (!m_snapshots.empty()) {
+		syslog(LOG_ERR, "block_map::compact> Release all snapshots first");
+		return false;
+	}
+	if (!compact_log()) {
+		// The index may have missed an update, make the next open rebuild it
+		m_save_index = false;
+		return false;
+	}
+	return true;
+}
+
+bool block_map::compact_log()
+{
+	// The second pass goes in logical order, so it may need the oldest block
+	// last.  Until then m_used more blocks get written, so first move the
+	// oldest blocks up until they are about that close to the top, or until
+	// each one has moved once.  The second pass cleans the rest as writes do.
+	uint64_t first_top = m_file.top();
+	while (true) {
+		uint32_t oldest = m_in_use.find_set(phys_contract(m_file.top()));
+		if (oldest == m_physical_size || phys_expand(oldest) >= first_top ||
+				m_file.top() - phys_expand(oldest) + m_used <= m_physical_size) {
+			break;
+		}
+		if (!clean(s_clean_batch, false)) {
+			return false;
+		}
+	}
+	// Then rewrite everything in order.  Blocks make_room moves up on the way
+	// get rewritten again in their turn, so nothing live stays below start.
+	uint64_t start = m_file.top();
+	for (uint32_t logical = 0; logical < m_logical_size; logical++) {
+		if (!make_room()) {
+			return false;
+		}
+		uint32_t phys_small;
+		if (!get_phys(logical, phys_small)) {
+			return false;
+		}
+		if (phys_small == s_invalid) {
+			continue;
+		}
+		rslice_t block;
+		uint32_t logical2;
+		if (!m_file.read_block(phys_expand(phys_small), block, logical2) || logical2 != logical) {
+			return false;
+		}
+		free_block(phys_small);
+		uint64_t phys;
+		if (!m_file.write_block(logical, block, phys)) {
+			return false;
+		}
+		stat_add(stat_relocations);
+		use_block(phys_contract(phys));
+		if (!set_phys(logical, phys_contract(phys))) {
+			return false;
+		}
+	}
+	m_clean_credit = 0;
+	// Only the chunk holding start keeps some garbage
+	return m_file.remove_old(start);
+}
+
+bool block_map::check_ring()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_in_use.count(0, m_physical_size) == m_used;
+}
+
+double block_map::fragmentation()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	uint64_t pairs;
+	uint64_t breaks;
+	if (!count_breaks(pairs, breaks) || pairs == 0) {
+		return 0;
+	}
+	return double(breaks) / pairs;
+}
+
+// Counts pairs of mapped blocks with neighboring logical addresses, and the
+// ones among them that a sequential read has to seek between
+bool block_map::count_breaks(uint64_t& pairs_out, uint64_t& breaks_out)
+{
+	pairs_out = 0;
+	breaks_out = 0;
+	uint32_t prev = s_invalid;
+	for (uint32_t logical = 0; logical < m_logical_size; logical++) {
+		uint32_t phys_small;
+		if (!get_phys(logical, phys_small)) {
+			return false;
+		}
+		if (prev != s_invalid && phys_small != s_invalid) {
+			pairs_out++;
+			if (phys_small != (prev + 1) % m_physical_size) {
+				breaks_out++;
+			}
+		}
+		prev = phys_small;
+	}
 	return true;
 }
 
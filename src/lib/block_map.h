@@ -20,28 +20,134 @@
 #include "types.h"
 #include "block_file.h"
 #include "fast_bit.h"
+#include "page_map.h"
+#include "read_cache.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
+static const size_t s_default_readahead = 2 * 1024 * 1024;  // Largest readahead window in bytes
+
+// All public calls are safe from any thread, they take turns on one lock
 class block_map
 {
 public:
-	block_map(const cipher_key_t& key, uint32_t logical_size);
+	// With a map_budget (in bytes) the logical map lives in an index file and
+	// only that much of it is cached, otherwise it is fully resident.
+	// open_chunks caps the chunk files held open for reads.
+	block_map(const cipher_key_t& key, uint32_t logical_size, size_t map_budget = 0, 
+		size_t open_chunks = s_default_open_chunks);
+	~block_map() { close(); }
+
+	// Largest readahead window in bytes, 0 turns readahead off, call before open
+	void set_readahead(size_t bytes);
+	// Keep copies of the log in these directories, call before open.  Each
+	// flush copies the new part of the final chunk, sealed chunks are copied
+	// in the background, and close waits for any still to copy.
+	void set_mirrors(const vector<string>& dirs);
 
 	bool open(const string& dir);
+	// Flush, then save the index, if any, so the next open can skip the log replay
+	bool close();
+	// Make every write that returned before this call durable.  Concurrent
+	// flushes share one sync, and writes carry on while it runs.
+	bool flush();
 	bool write(uint32_t logical, const rslice_t& data);
 	bool read(uint32_t logical, rslice_t& data_out);
+	// Read into a caller's block sized buffer, without copying
+	bool read_into(uint32_t logical, const slice_t& data_out);
+	// Read count blocks from first on into data_out, for bulk copies.  The lock
+	// is only taken to look them up, so several threads can each read and
+	// decrypt a range at once.
+	bool read_range(uint32_t first, uint32_t count, const slice_t& data_out);
+	// Bulk loading for safedisk-import, with a single writer.  encrypt_run makes
+	// the records for blocks that go at log positions physical on, and can run
+	// on several threads ahead of time.  append_run then puts them on the log
+	// at the top, which has to be physical, without any cleaning.  The blocks
+	// must never have been written, and have to fit the ring as it is.
+	slice_t encrypt_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& blocks);
+	bool append_run(uint64_t physical, const vector<uint32_t>& logical, const rslice_t& records);
 	uint32_t block_count() { return m_logical_size; }
+	// Log position of the next block, a write's own block lands just below it
+	uint64_t top() { return m_file.top(); }
+	// Process wide counters plus this map's ring usage, as 'name value' lines
+	string stats();
+	// Share of logically adjacent mapped blocks that aren't next to each other
+	// in the log, 0 when every file is contiguous.  Walks the whole map under
+	// the lock, so it's left to offline tools rather than stats().
+	double fragmentation();
+	// Rewrite every mapped block to the top of the log in logical order, then
+	// drop the chunks before them.  Writes up to twice the live data, and holds
+	// the lock all along, so it's meant for offline use.  No snapshots allowed.
+	bool compact();
+
+	// Take a named point-in-time snapshot of the logical map, no data is copied
+	// Snapshots share the ring's spare space, so together they can only diverge
+	// from the live map by about block_count() blocks, and they are lost on close
+	// Not available with a paged map
+	bool snapshot(const string& name);
+	// Drop a snapshot, the cleaner then reclaims blocks only it referenced
+	bool release_snapshot(const string& name);
+	// Read a block as it was when the snapshot was taken
+	bool read_snapshot(const string& name, uint32_t logical, rslice_t& data_out);
+	bool read_snapshot_into(const string& name, uint32_t logical, const slice_t& data_out);
+	// Names of all current snapshots
+	vector<string> snapshots();
+	// The ring's books balance, the in-use count matches the in-use bits, for tests
+	bool check_ring();
 	
 private:
+	bool open_paged(const string& dir);
+	bool write_mapped(uint32_t logical, const rslice_t& data);
+	bool get_phys(uint32_t logical, uint32_t& phys_small_out);
+	bool set_phys(uint32_t logical, uint32_t phys_small);
 	uint64_t phys_expand(uint32_t small);
 	uint32_t phys_contract(uint64_t large);
-	bool clean_one();
+	void use_block(uint32_t phys_small);
+	void free_block(uint32_t phys_small);
+	bool is_pinned(uint32_t logical, uint32_t phys_small);
+	bool make_room();
+	bool clean(uint32_t want, bool pull_neighbors = true);
+	bool compact_log();
+	bool count_breaks(uint64_t& pairs_out, uint64_t& breaks_out);
+	bool read_cached(std::unique_lock<std::mutex>& lock, uint32_t logical, rslice_t& data_out);
+	void read_ahead(uint32_t logical);
+	void stop_readahead();
+	void readahead_worker();
+	void readahead_batch(std::unique_lock<std::mutex>& lock, cipher_ctx_t& ctx, uint32_t first, uint32_t count);
+	bool ahead_busy(uint32_t logical);
 
 private:	
 	const uint32_t s_invalid = -1;
+	const uint32_t s_pinned = 0x80000000;  // Logical id flag for snapshot-only copies
+	const uint32_t s_ring_slack = 3;       // Ring positions kept free for one write
+	const uint32_t s_clean_batch = 64;     // Blocks the cleaner sorts and moves at once
 	typedef vector<uint32_t> map_vec_t;
-	uint32_t   m_logical_size;
-	uint32_t   m_physical_size;
-	block_file m_file;
-	map_vec_t  m_physical;
-	fast_bit   m_in_use;
+	typedef map<string, map_vec_t> snapshot_map_t;
+	uint32_t       m_logical_size;
+	uint32_t       m_physical_size;
+	uint32_t       m_used = 0;
+	uint32_t       m_clean_credit = 0;  // Overwrites not yet paid for by cleaning
+	block_file     m_file;
+	map_vec_t      m_physical;  // Empty when paged
+	std::unique_ptr<page_map> m_index;
+	bool           m_save_index = false;  // Index matches the log so far
+	fast_bit       m_in_use;
+	snapshot_map_t m_snapshots;
+	std::mutex     m_lock;
+	std::condition_variable m_sync_done;
+	bool           m_syncing = false;  // A group commit is running without the lock
+	uint64_t       m_synced = 0;       // Log position known to be durable
+
+	// Sequential readers get the next blocks read and decrypted by a few
+	// threads, which only take the lock to look them up and to hand them over
+	static const uint32_t s_ahead_threads = 4;
+	typedef std::pair<uint32_t, uint32_t> block_range_t;  // First block and count
+	cipher_key_t   m_key;
+	read_cache     m_cache;
+	vector<std::thread> m_ahead_threads;
+	std::condition_variable m_ahead_cv;  // Work queued, a batch done, or stopping
+	deque<block_range_t> m_ahead_queue;
+	list<block_range_t>  m_ahead_busy;   // Being read right now, outside the lock
+	bool           m_ahead_stop = false;
 };
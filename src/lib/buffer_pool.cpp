@@ -0,0 +1,133 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "buffer_pool.h"
+
+#include <atomic>
+#include <mutex>
+
+static const uint32_t s_min_shift = 5;   // Smallest class, 32 bytes
+static const uint32_t s_max_shift = 12;  // Largest class, 4096 bytes
+static const uint32_t s_classes = s_max_shift - s_min_shift + 1;
+static const size_t s_batch = 32;        // Buffers moved to or from the global list at once
+static const size_t s_local_max = 2 * s_batch;
+
+// Free buffers hold the list links themselves
+struct free_node
+{
+	free_node* next;
+};
+
+struct free_list
+{
+	free_node* head = nullptr;
+	size_t     count = 0;
+
+	void push(free_node* n) 
+	{
+		n->next = head;
+		head = n;
+		count++;
+	}
+
+	free_node* pop()
+	{
+		free_node* n = head;
+		head = n->next;
+		count--;
+		return n;
+	}
+
+	// Move up to n buffers onto another list
+	void move_to(free_list& other, size_t n)
+	{
+		while (head && n--) {
+			other.push(pop());
+		}
+	}
+};
+
+static std::mutex s_global_lock;
+static free_list s_global[s_classes];
+static std::atomic<uint64_t> s_heap_allocs(0);
+
+// Per thread lists, handed back to the global lists when the thread exits
+struct local_lists
+{
+	free_list lists[s_classes];
+
+	~local_lists()
+	{
+		std::lock_guard<std::mutex> lock(s_global_lock);
+		for (uint32_t i = 0; i < s_classes; i++) {
+			lists[i].move_to(s_global[i], lists[i].count);
+		}
+	}
+};
+
+static thread_local local_lists t_local;
+
+// Returns s_classes if the size is too large to pool
+static uint32_t size_class(uint32_t size)
+{
+	uint32_t cls = 0;
+	while (cls < s_classes && (uint32_t(1) << (cls + s_min_shift)) < size) {
+		cls++;
+	}
+	return cls;
+}
+
+char* pool_alloc(uint32_t size, uint32_t& capacity_out)
+{
+	uint32_t cls = size_class(size);
+	if (cls == s_classes) {
+		s_heap_allocs++;
+		capacity_out = size;
+		return new char[size];
+	}
+	capacity_out = uint32_t(1) << (cls + s_min_shift);
+	free_list& local = t_local.lists[cls];
+	if (!local.head) {
+		std::lock_guard<std::mutex> lock(s_global_lock);
+		s_global[cls].move_to(local, s_batch);
+	}
+	if (!local.head) {
+		s_heap_allocs++;
+		return new char[capacity_out];
+	}
+	return (char*) local.pop();
+}
+
+void pool_free(char* buf, uint32_t size)
+{
+	uint32_t cls = size_class(size);
+	if (cls == s_classes) {
+		delete[] buf;
+		return;
+	}
+	free_list& local = t_local.lists[cls];
+	local.push((free_node*) buf);
+	if (local.count > s_local_max) {
+		std::lock_guard<std::mutex> lock(s_global_lock);
+		local.move_to(s_global[cls], s_batch);
+	}
+}
+
+uint64_t pool_heap_allocs()
+{
+	return s_heap_allocs;
+}
@@ -0,0 +1,30 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "types.h"
+
+// Size class pool for small buffers, blocks and their staging buffers included
+// Each thread keeps its own free lists and trades batches with a global list,
+// so in steady state neither allocation nor free touches the heap or a lock
+
+// Get a buffer of at least size bytes, capacity_out is what was really given
+char* pool_alloc(uint32_t size, uint32_t& capacity_out);
+// Give back a buffer from pool_alloc, with either the size asked for or the capacity
+void pool_free(char* buf, uint32_t size);
+// Number of times a buffer had to come from the heap, for benchmarks
+uint64_t pool_heap_allocs();
@@ -16,186 +16,168 @@
  */
 
 
-#include "block_map.h"
-#include "digest.h"
-#include <unistd.h>
-#include <sys/stat.h>
-#include <arpa/inet.h>
-#include <openssl/rand.h>
-extern "C" {
-#include <libscrypt.h>
-};
-
-struct meta_data
-{
-	uint32_t blocks;
-};
-
-static bool make_file(const string& filename, const rslice_t& data) 
-{
-	FILE *f = fopen(filename.c_str(), "w");
-	if (f == NULL) {
-		fprintf(stderr, "Unable to make file: %s\n", filename.c_str());
-		return false;
-	}
-	if (fwrite(data.buf(), 1, data.size(), f) != data.size()) {
-		fprintf(stderr, "Unable to write file: %s\n", filename.c_str());
-		fclose(f);
-		unlink(filename.c_str());
-		return false;
-	}
-	fclose(f);
-	return true;
-}
+#include "container.h"
 
-static bool read_file(const string& filename, slice_t& data)
+static block_map* get_map(void* bm)
 {
-	FILE *f = fopen(filename.c_str(), "r");
-	if (f == NULL) {
-		fprintf(stderr, "Unable to open file: %s\n", filename.c_str());
-		return false;
-	}
-	if (fread(data.buf(), 1, data.size(), f) != data.size()) {
-		fprintf(stderr, "Unable to read file: %s\n", filename.c_str());
-		fclose(f);
-		return false;
-	}
-	fclose(f);
-	return true;
-}
-
-/* TODO: Move these two static functions into the logic of block_map directly */
-static bool make_meta_file(const string& filename, const cipher_key_t& k, const meta_data& md)
-{
-	cipher_ctx_t ctx(k);
-	slice_t s((char*) &md, sizeof(meta_data));
-	uint64_t iv = 0;
-	iv--;  // Magic meta-data iv
-	slice_t r = ctx.encrypt_and_sign(iv, s);
-	return make_file(filename, r);
-}
-
-static bool read_meta_file(const string& filename, const cipher_key_t& k, meta_data& md)
-{
-	slice_t s(sizeof(meta_data) + 16);
-	if (!read_file(filename, s)) {
-		return false;
-	}	
-	cipher_ctx_t ctx(k);
-	uint64_t iv = 0;
-	iv--;  // Magic meta-data iv
-	slice_t r;
-	if (!ctx.decrypt_and_verify(iv, r, s)) {
-		fprintf(stderr, "Unable to decrypt meta-file: %s\n", filename.c_str());
-		return false;
-	}
-	memcpy((char*) &md, r.buf(), r.size());
-	return true;
+	return &((container*) bm)->map();
 }
 
 extern "C" void* create_block_map(const char* dir, uint32_t blocks, const char* key)
 {
-	int r = mkdir(dir, 0777);
-	if (r < 0) {
-		fprintf(stderr, "Unable to make directory %s: %s\n", dir, strerror(errno));
-		return NULL;
-	}
-	slice_t salt(32);
-	RAND_pseudo_bytes(salt.ubuf(), salt.size());
-	if (!make_file(string(dir) + "/salt", salt)) {
-		return NULL;
-	}
-	slice_t kbuf(32);
-	r = libscrypt_scrypt(
-		(const unsigned char*) key, strlen(key), 
-		salt.ubuf(), salt.size(), 
-		SCRYPT_N, SCRYPT_r, SCRYPT_p, 
-		kbuf.ubuf(), kbuf.size());
-	if (r != 0) {
-		unlink((string(dir) + "/salt").c_str());
-		rmdir(dir);
-		return NULL;
-	}
-
-	cipher_key_t k = kbuf;
+	vector<volume_info> volumes;
+	volumes.push_back(volume_info{ s_default_volume, 0, blocks });
+	return container::create(dir, volumes, key).release();
+}
 
-	meta_data md;
-	md.blocks = htonl(blocks);
-	if (!make_meta_file(string(dir) + "/meta", k, md)) {
-		unlink((string(dir) + "/salt").c_str());
-		rmdir(dir);
+// Options are 'key=value,...', see container_options
+extern "C" void* create_volumes_block_map(
+	const char* dir, uint32_t count, const char* const* names, const uint32_t* blocks, const char* key,
+	const char* options)
+{
+	container_options co;
+	if (!co.parse(options)) {
 		return NULL;
 	}
-
-	block_map* bm = new block_map(k, blocks);
-	if (!bm->open(dir)) {
-		delete bm;
-		return NULL;
+	vector<volume_info> volumes;
+	for (uint32_t i = 0; i < count; i++) {
+		volumes.push_back(volume_info{ names[i], 0, blocks[i] });
 	}
-	return bm;
+	return container::create(dir, volumes, key, co).release();
 }
 
 extern "C" void* open_block_map(const char* dir, const char* key)
 {
-	slice_t salt(32);
-	if (!read_file(string(dir) + "/salt", salt)) {
-		return NULL;
-	}
-	slice_t kbuf(32);
-	int r = libscrypt_scrypt(
-		(const unsigned char*) key, strlen(key), 
-		salt.ubuf(), salt.size(), 
-		SCRYPT_N, SCRYPT_r, SCRYPT_p, 
-		kbuf.ubuf(), kbuf.size());
-	if (r != 0) {
+	return container::open(dir, key).release();
+}
+
+extern "C" void* open_options_block_map(const char* dir, const char* key, const char* options)
+{
+	container_options co;
+	if (!co.parse(options)) {
 		return NULL;
 	}
+	return container::open(dir, key, co).release();
+}
 
-	cipher_key_t k = kbuf;
+extern "C" void close_block_map(void* bm)
+{
+	delete ((container*) bm);
+}
 
-	meta_data md;
-	if (!read_meta_file(string(dir) + "/meta", k, md)) {
-		rmdir(dir);
-		return NULL;
+// Copies the name of volume 'which' into name_out, returns 0 past the last one
+extern "C" int list_volume_block_map(void* bm, uint32_t which, char* name_out, size_t size)
+{
+	const vector<volume_info>& volumes = ((container*) bm)->volumes();
+	if (which >= volumes.size() || volumes[which].name.size() >= size) {
+		return 0;
 	}
-	uint32_t blocks = ntohl(md.blocks);
+	strcpy(name_out, volumes[which].name.c_str());
+	return 1;
+}
 
-	block_map* bm = new block_map(k, blocks);
-	if (!bm->open(dir)) {
-		delete bm;
-		return NULL;
+// Finds a volume's first block and size in the container's block space
+extern "C" int find_volume_block_map(void* bm, const char* name, uint32_t* base, uint32_t* blocks)
+{
+	const volume_info* vi = ((container*) bm)->find_volume(name);
+	if (vi == NULL) {
+		return 0;
 	}
-	return bm;
+	*base = vi->base;
+	*blocks = vi->blocks;
+	return 1;
 }
 
-extern "C" void close_block_map(void* bm)
+extern "C" uint64_t size_block_map(void* bm)
 {
-	delete ((block_map*) bm);
+	return uint64_t(get_map(bm)->block_count()) * s_bytes_per_block;
 }
 
-extern "C" uint64_t size_block_map(void* bm)
+// Renders the runtime statistics as 'name value' lines into buf, always nul
+// terminated.  Like snprintf it returns the full length, which may not fit.
+extern "C" size_t stats_block_map(void* bm, char* buf, size_t size)
+{
+	string text = get_map(bm)->stats();
+	if (size) {
+		size_t n = min(text.size(), size - 1);
+		memcpy(buf, text.data(), n);
+		buf[n] = 0;
+	}
+	return text.size();
+}
+
+// Records one request in the trace, if the container was opened with one
+// op is 0 for reads and 1 for writes, offset is in bytes from the container start
+extern "C" void trace_block_map(void* bm, int op, uint64_t offset, uint32_t length)
 {
-	return uint64_t(((block_map*) bm)->block_count()) * s_bytes_per_block;
+	((container*) bm)->trace(uint8_t(op), offset, length);
 }
 
 extern "C" int read_block_map(void* bm, uint32_t block, char* buf)
 {
-	// TODO: Make slice stuff support external buffers
-	// This is actually pretty easy, but not relevant for now
-	rslice_t data;
-	bool r = ((block_map*) bm)->read(block, data);
-	if (r) {
-		memcpy(buf, data.buf(), s_bytes_per_block);
-	}
+	// Decrypts straight into the caller's buffer
+	bool r = get_map(bm)->read_into(block, slice_t::wrap(buf, s_bytes_per_block));
 	return r ? 1 : 0;
 }
 
 extern "C" int write_block_map(void* bm, uint32_t block, const char* buf)
 {
-	// TODO: Make slice stuff support external buffers
-	// This is actually pretty easy, but not relevant for now
-	slice_t data(buf, s_bytes_per_block);
-	bool r = ((block_map*) bm)->write(block, data);
+	// Encrypts straight from the caller's buffer
+	bool r = get_map(bm)->write(block, rslice_t::wrap(buf, s_bytes_per_block));
 	return r ? 1 : 0;
 }
 
+// Call once a whole write request is done, fua asks for it to be made durable
+// Depending on the container's durability mode, this may sync
+extern "C" int write_done_block_map(void* bm, int fua)
+{
+	bool r = ((container*) bm)->write_done(fua != 0);
+	return r ? 1 : 0;
+}
+
+// Makes all finished writes durable, unless the durability mode is none
+extern "C" int flush_block_map(void* bm)
+{
+	bool r = ((container*) bm)->flush();
+	return r ? 1 : 0;
+}
+
+extern "C" int snapshot_block_map(void* bm, const char* name)
+{
+	bool r = get_map(bm)->snapshot(name);
+	return r ? 1 : 0;
+}
+
+extern "C" int release_snapshot_block_map(void* bm, const char* name)
+{
+	bool r = get_map(bm)->release_snapshot(name);
+	return r ? 1 : 0;
+}
+
+extern "C" int has_snapshot_block_map(void* bm, const char* name)
+{
+	vector<string> names = get_map(bm)->snapshots();
+	return std::count(names.begin(), names.end(), string(name)) ? 1 : 0;
+}
+
+// Copies the name of snapshot 'which' into name_out, returns 0 past the last one.
+// A name too long for name_out comes back empty, so the listing can go on.
+extern "C" int list_snapshot_block_map(void* bm, uint32_t which, char* name_out, size_t size)
+{
+	vector<string> names = get_map(bm)->snapshots();
+	if (which >= names.size() || size == 0) {
+		return 0;
+	}
+	if (names[which].size() >= size) {
+		name_out[0] = 0;
+		return 1;
+	}
+	strcpy(name_out, names[which].c_str());
+	return 1;
+}
+
+extern "C" int read_snapshot_block_map(void* bm, const char* name, uint32_t block, char* buf)
+{
+	bool r = get_map(bm)->read_snapshot_into(name, block, slice_t::wrap(buf, s_bytes_per_block));
+	return r ? 1 : 0;
+}
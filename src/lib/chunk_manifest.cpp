@@ -0,0 +1,179 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_manifest.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static const size_t s_read_size = 1024 * 1024;  // Bytes hashed at once
+
+static string to_hex(const rslice_t& data)
+{
+	static const char digits[] = "0123456789abcdef";
+	string out;
+	for (size_t i = 0; i < data.size(); i++) {
+		out += digits[(unsigned char) data[i] >> 4];
+		out += digits[(unsigned char) data[i] & 15];
+	}
+	return out;
+}
+
+static bool from_hex(const char* text, const slice_t& out)
+{
+	for (size_t i = 0; i < out.size(); i++) {
+		unsigned int byte;
+		if (sscanf(text + 2 * i, "%2x", &byte) != 1) {
+			return false;
+		}
+		out[i] = char(byte);
+	}
+	return text[2 * out.size()] == 0;
+}
+
+vector<uint64_t> chunk_manifest::open(const string& dir, uint64_t low, uint64_t high, off_t sealed_size)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_dir = dir;
+	m_generation = 0;
+	m_low = low;
+	m_high = high;
+	m_live_size = 0;
+	m_sealed_size = sealed_size;
+	m_digests.clear();
+	m_dirty = true;
+	// An old manifest is only a cache of digests, anything off in it is ignored
+	FILE* f = fopen((dir + "/manifest").c_str(), "r");
+	if (f != NULL) {
+		char line[256];
+		while (fgets(line, sizeof(line), f) != NULL) {
+			uintmax_t generation, chunk_id;
+			intmax_t size;
+			char hex[2 * digest_t::required_size + 2];
+			if (sscanf(line, "generation %ju", &generation) == 1) {
+				m_generation = generation;
+			} else if (sscanf(line, "file_%ju sealed %jd %65s", &chunk_id, &size, hex) == 3 &&
+				chunk_id >= low && chunk_id < high && size == sealed_size) {
+				slice_t digest(digest_t::required_size);
+				if (from_hex(hex, digest)) {
+					m_digests[chunk_id] = digest;
+				}
+			}
+		}
+		fclose(f);
+	}
+	vector<uint64_t> missing;
+	for (uint64_t chunk_id = low; chunk_id < high; chunk_id++) {
+		if (m_digests.count(chunk_id) == 0) {
+			missing.push_back(chunk_id);
+		}
+	}
+	return missing;
+}
+
+void chunk_manifest::close()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_dir.clear();
+	m_digests.clear();
+}
+
+void chunk_manifest::set_live(uint64_t high, off_t size)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	// Syncs can finish out of order, never go back
+	if (high < m_high || (high == m_high && size < m_live_size)) {
+		return;
+	}
+	m_dirty = m_dirty || high != m_high || size != m_live_size;
+	m_high = high;
+	m_live_size = size;
+}
+
+void chunk_manifest::set_low(uint64_t low)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (low <= m_low) {
+		return;
+	}
+	m_low = low;
+	m_digests.erase(m_digests.begin(), m_digests.lower_bound(low));
+	m_dirty = true;
+}
+
+void chunk_manifest::set_digest(uint64_t chunk_id, const digest_t& digest)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (chunk_id >= m_low) {
+		m_digests[chunk_id] = digest;
+		m_dirty = true;
+	}
+}
+
+bool chunk_manifest::write()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_dir.empty() || !m_dirty) {
+		return true;
+	}
+	string text = "generation " + std::to_string(m_generation + 1) + "\n";
+	for (uint64_t chunk_id = m_low; chunk_id < m_high; chunk_id++) {
+		auto it = m_digests.find(chunk_id);
+		text += "file_" + std::to_string(chunk_id) + " sealed " + std::to_string(m_sealed_size) + " " +
+			(it == m_digests.end() ? string("-") : to_hex(it->second.cast())) + "\n";
+	}
+	text += "file_" + std::to_string(m_high) + " live " + std::to_string(m_live_size) + "\n";
+	string tmp = m_dir + "/manifest.new";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	bool ok = fd >= 0 && write_fully(fd, text.data(), text.size()) && fdatasync(fd) == 0;
+	if (fd >= 0) {
+		::close(fd);
+	}
+	if (!ok || rename(tmp.c_str(), (m_dir + "/manifest").c_str()) != 0) {
+		syslog(LOG_ERR, "Unable to write manifest: %s", strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+	m_generation++;
+	m_dirty = false;
+	return true;
+}
+
+bool chunk_manifest::digest_file(const string& path, digest_t& out)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	digest_ctx_t ctx;
+	vector<char> buf(s_read_size);
+	ssize_t r;
+	while ((r = read(fd, buf.data(), buf.size())) > 0 || (r < 0 && errno == EINTR)) {
+		if (r > 0) {
+			ctx.update(buf.data(), r);
+		}
+	}
+	::close(fd);
+	if (r < 0) {
+		return false;
+	}
+	out = ctx.finish();
+	return true;
+}
@@ -0,0 +1,68 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "digest.h"
+#include <sys/types.h>
+#include <mutex>
+
+// The 'manifest' file of a block directory, for sync tools, so they can copy
+// new chunks and the tail of the final one without hashing everything.  It's
+// plain text, nothing in it is secret:
+//
+//   generation 12
+//   file_4 sealed 275779600 <sha-256 in hex, or - until it's known>
+//   file_5 live 1234567
+//
+// The generation goes up with every change.  Each write goes to a temporary
+// that is synced, then renamed over the old one, so readers see a whole one.
+// The live size covers at least what the last sync made durable, written
+// shortly after it, and also when a sealed chunk's digest is ready, when
+// chunks are removed, and on open and close.  All calls are thread safe.
+class chunk_manifest
+{
+public:
+	// Picks up the digests and generation an earlier run left in dir, which
+	// holds chunks low to high, sealed ones being sealed_size bytes.  Returns
+	// the sealed chunks that still need a digest, oldest first.
+	vector<uint64_t> open(const string& dir, uint64_t low, uint64_t high, off_t sealed_size);
+	void close();
+	// The final chunk is high, with size bytes written, ignored if older
+	void set_live(uint64_t high, off_t size);
+	// Chunks below low are gone
+	void set_low(uint64_t low);
+	// A sealed chunk's digest is known
+	void set_digest(uint64_t chunk_id, const digest_t& digest);
+	// Writes the file out under a new generation, if anything changed
+	bool write();
+
+	// Digest of a whole file, read a piece at a time
+	static bool digest_file(const string& path, digest_t& out);
+
+private:
+	std::mutex m_lock;
+	string     m_dir;
+	uint64_t   m_generation = 0;
+	uint64_t   m_low = 0;
+	uint64_t   m_high = 0;
+	off_t      m_live_size = 0;
+	off_t      m_sealed_size = 0;
+	map<uint64_t, digest_t> m_digests;  // Sealed chunks that have one
+	bool       m_dirty = false;
+};
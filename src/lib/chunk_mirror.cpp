@@ -0,0 +1,444 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_mirror.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <climits>
+#include <cstdlib>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+static const size_t s_copy_buffer = 1024 * 1024;  // For copies the kernel can't do itself
+
+static string chunk_path(const string& dir, uint64_t chunk_id)
+{
+	return dir + "/file_" + std::to_string(chunk_id);
+}
+
+// Reads a small file whole, false if it isn't there
+static bool read_small(const string& path, string& out)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && st.st_size <= 64 * 1024;
+	if (ok) {
+		out.resize(st.st_size);
+		ok = pread_fully(fd, &out[0], st.st_size, 0);
+	}
+	::close(fd);
+	return ok;
+}
+
+// What a mirror of dir records to know its copies later: the container's salt
+// and guid, or where it is when it has neither
+static string identity_of(const string& dir)
+{
+	string salt, guid;
+	bool has_salt = read_small(dir + "/salt", salt);
+	bool has_guid = read_small(dir + "/guid", guid);
+	if (has_salt || has_guid) {
+		return "salt " + salt + "\nguid " + guid + "\n";
+	}
+	char path[PATH_MAX];
+	return string("dir ") + (realpath(dir.c_str(), path) ? path : dir.c_str()) + "\n";
+}
+
+static bool sync_dir(const string& dir)
+{
+	int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = fsync(fd) == 0;
+	::close(fd);
+	return ok;
+}
+
+// Copies bytes from to to of in to the same place in out, within the kernel
+// when it can, across file systems older kernels can't
+static bool copy_range(int in, int out, off_t from, off_t to)
+{
+#ifdef __linux__
+	while (from < to) {
+		loff_t in_off = from;
+		loff_t out_off = from;
+		ssize_t r = copy_file_range(in, &in_off, out, &out_off, to - from, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+			break;
+		}
+		if (r <= 0) {
+			errno = r == 0 ? EIO : errno;
+			return false;
+		}
+		from += r;
+	}
+#endif
+	vector<char> buf(std::min(size_t(to - from), s_copy_buffer));
+	while (from < to) {
+		size_t n = std::min(size_t(to - from), buf.size());
+		if (!pread_fully(in, buf.data(), n, from) || !pwrite_fully(out, buf.data(), n, from)) {
+			return false;
+		}
+		from += n;
+	}
+	return true;
+}
+
+vector<uint64_t> chunk_mirror::open(const string& dir, uint64_t low, uint64_t high)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_dir = dir;
+	m_low = low;
+	m_live_chunk = high;
+	m_live_copied = 0;
+	m_targets.clear();
+	struct stat dir_st;
+	if (stat(dir.c_str(), &dir_st) != 0) {
+		syslog(LOG_ERR, "chunk_mirror::open> Unable to stat %s: %s", dir.c_str(), strerror(errno));
+		return {};
+	}
+	string identity = identity_of(dir);
+	vector<bool> need(high - low, false);
+	for (const string& d : m_dirs) {
+		m_targets.emplace_back();
+		target& t = m_targets.back();
+		t.dir = d;
+		struct stat st;
+		if (mkdir(d.c_str(), 0777) != 0 && errno != EEXIST) {
+			fail(t, "make", errno);
+			continue;
+		}
+		if (stat(d.c_str(), &st) != 0) {
+			fail(t, "stat", errno);
+			continue;
+		}
+		if (st.st_dev == dir_st.st_dev && st.st_ino == dir_st.st_ino) {
+			fail(t, "mirror into", EINVAL);
+			continue;
+		}
+		if (!claim(t, identity)) {
+			continue;
+		}
+		if (!copy_small(t, "salt") || !copy_small(t, "kdf") || !copy_small(t, "meta") ||
+			!copy_small(t, "volumes") || !copy_small(t, "guid")) {
+			continue;
+		}
+		// Drop what the log no longer has, and any half made copy
+		DIR* dp = opendir(d.c_str());
+		if (dp == NULL) {
+			fail(t, "list", errno);
+			continue;
+		}
+		struct dirent* de;
+		while ((de = readdir(dp)) != NULL) {
+			if (strcmp(de->d_name, "mirror") == 0) {
+				unlink((d + "/mirror").c_str());
+			}
+			if (memcmp(de->d_name, "file_", 5) != 0 || de->d_name[5] == '\0' ||
+				strspn(de->d_name + 5, "0123456789") != strlen(de->d_name + 5)) {
+				continue;
+			}
+			uint64_t chunk_id = strtoull(de->d_name + 5, NULL, 10);
+			if (chunk_id < low || chunk_id > high) {
+				unlink(chunk_path(d, chunk_id).c_str());
+			}
+		}
+		closedir(dp);
+		for (uint64_t chunk_id = low; chunk_id < high; chunk_id++) {
+			struct stat src;
+			if (stat(chunk_path(dir, chunk_id).c_str(), &src) == 0 &&
+				(stat(chunk_path(d, chunk_id).c_str(), &st) != 0 || st.st_size != src.st_size)) {
+				need[chunk_id - low] = true;
+			}
+		}
+		if (!sync_dir(d)) {
+			fail(t, "sync", errno);
+		}
+	}
+	vector<uint64_t> missing;
+	for (uint64_t chunk_id = low; chunk_id < high; chunk_id++) {
+		if (need[chunk_id - low]) {
+			missing.push_back(chunk_id);
+		}
+	}
+	return missing;
+}
+
+void chunk_mirror::close()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	close_live();
+	m_targets.clear();
+	m_dir.clear();
+}
+
+void chunk_mirror::sealed(uint64_t chunk_id)
+{
+	// Only the one thread copies sealed chunks, and the targets don't change
+	// until close, so the lock is only needed to check and to rename
+	int in = ::open(chunk_path(m_dir, chunk_id).c_str(), O_RDONLY);
+	if (in < 0) {
+		return;  // Removed already
+	}
+	struct stat st;
+	if (fstat(in, &st) != 0) {
+		::close(in);
+		return;
+	}
+	for (target& t : m_targets) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (t.failed || chunk_id < m_low) {
+				continue;
+			}
+		}
+		struct stat have;
+		if (stat(chunk_path(t.dir, chunk_id).c_str(), &have) == 0 && have.st_size == st.st_size) {
+			continue;
+		}
+		string tmp = t.dir + "/mirror";
+		int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		bool ok = out >= 0;
+#ifdef __linux__
+		bool cloned = ok && ioctl(out, FICLONE, in) == 0;
+#else
+		bool cloned = false;
+#endif
+		ok = ok && (cloned || copy_range(in, out, 0, st.st_size));
+		ok = ok && fdatasync(out) == 0;
+		int err = errno;
+		if (out >= 0) {
+			::close(out);
+		}
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!ok || chunk_id < m_low) {
+			unlink(tmp.c_str());
+			if (!ok) {
+				fail(t, "copy a chunk to", err);
+			}
+			continue;
+		}
+		if (rename(tmp.c_str(), chunk_path(t.dir, chunk_id).c_str()) != 0 || !sync_dir(t.dir)) {
+			fail(t, "rename a chunk in", errno);
+			continue;
+		}
+		stat_add(stat_mirror_bytes, st.st_size);
+	}
+	::close(in);
+	// A copy of the whole chunk replaces the one made as it was written
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (chunk_id == m_live_chunk) {
+		close_live();
+		m_live_chunk = chunk_id + 1;
+		m_live_copied = 0;
+	}
+}
+
+void chunk_mirror::live(uint64_t chunk_id, int fd, off_t size)
+{
+	// The copies and syncs run without the lock, remove_old waits on it while
+	// holding the map's lock.  Each target's file is made, and a dup of it
+	// taken, under the lock, so sealed() can't replace it or close it on us.
+	struct copy
+	{
+		size_t index;
+		int    fd;
+		bool   created;
+		int    err;
+	};
+	vector<copy> copies;
+	off_t from;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_dir.empty() || chunk_id < m_live_chunk) {
+			return;
+		}
+		if (chunk_id > m_live_chunk) {
+			close_live();
+			m_live_chunk = chunk_id;
+			m_live_copied = 0;
+		}
+		if (size <= m_live_copied) {
+			return;
+		}
+		from = m_live_copied;
+		for (size_t i = 0; i < m_targets.size(); i++) {
+			target& t = m_targets[i];
+			if (t.failed) {
+				continue;
+			}
+			// Whatever a target had for the chunk before is stale
+			bool created = t.live_fd < 0;
+			if (created) {
+				t.live_fd = ::open(chunk_path(t.dir, chunk_id).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			}
+			int dup_fd = t.live_fd < 0 ? -1 : dup(t.live_fd);
+			if (dup_fd < 0) {
+				fail(t, "copy the final chunk to", errno);
+				continue;
+			}
+			copies.push_back({ i, dup_fd, created, 0 });
+		}
+	}
+	for (copy& c : copies) {
+		if (!copy_range(fd, c.fd, from, size) || fdatasync(c.fd) != 0 ||
+			(c.created && !sync_dir(m_targets[c.index].dir))) {
+			c.err = errno ? errno : EIO;
+		}
+		::close(c.fd);
+	}
+	std::lock_guard<std::mutex> lock(m_lock);
+	// A sealed copy may have taken over meanwhile, it has all of this
+	if (chunk_id != m_live_chunk || m_live_copied != from) {
+		return;
+	}
+	for (const copy& c : copies) {
+		target& t = m_targets[c.index];
+		if (t.failed) {
+			continue;
+		}
+		if (c.err) {
+			fail(t, "copy the final chunk to", c.err);
+			continue;
+		}
+		stat_add(stat_mirror_bytes, size - from);
+	}
+	m_live_copied = size;
+}
+
+void chunk_mirror::removed(uint64_t low)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (; m_low < low; m_low++) {
+		for (target& t : m_targets) {
+			if (!t.failed && unlink(chunk_path(t.dir, m_low).c_str()) != 0 && errno != ENOENT) {
+				fail(t, "remove a chunk from", errno);
+			}
+		}
+	}
+}
+
+void chunk_mirror::fail(target& t, const char* what, int err)
+{
+	syslog(LOG_ERR, "Unable to %s mirror %s, no longer mirroring there: %s", what, t.dir.c_str(), strerror(err));
+	t.failed = true;
+	if (t.live_fd >= 0) {
+		::close(t.live_fd);
+		t.live_fd = -1;
+	}
+}
+
+// A target is only used if it's empty, was made by a mirror of this same log,
+// or holds this container's own salt and guid.  Anything else is left alone,
+// open would otherwise overwrite its files and remove its chunks.
+bool chunk_mirror::claim(target& t, const string& identity)
+{
+	DIR* dp = opendir(t.dir.c_str());
+	if (dp == NULL) {
+		fail(t, "list", errno);
+		return false;
+	}
+	bool empty = true;
+	struct dirent* de;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+			empty = false;
+			break;
+		}
+	}
+	closedir(dp);
+	string marker;
+	bool ours = empty || (read_small(t.dir + "/mirror_of", marker) && marker == identity);
+	if (!ours && identity.compare(0, 5, "salt ") == 0) {
+		// Made before mirrors were marked
+		ours = identity_of(t.dir) == identity;
+	}
+	if (!ours) {
+		syslog(LOG_ERR, "Mirror %s holds something other than a copy of %s, not mirroring there",
+			t.dir.c_str(), m_dir.c_str());
+		t.failed = true;
+		return false;
+	}
+	if (marker == identity) {
+		return true;
+	}
+	string tmp = t.dir + "/mirror";
+	int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	bool ok = out >= 0 && write_fully(out, identity.data(), identity.size()) && fdatasync(out) == 0;
+	int err = errno;
+	if (out >= 0) {
+		::close(out);
+	}
+	if (!ok || rename(tmp.c_str(), (t.dir + "/mirror_of").c_str()) != 0) {
+		err = ok ? errno : err;
+		unlink(tmp.c_str());
+		fail(t, "mark", err);
+		return false;
+	}
+	return true;
+}
+
+// Copies one of the container's small files, if it has it, by way of a
+// temporary so a crash can't leave it half written
+bool chunk_mirror::copy_small(target& t, const char* name)
+{
+	int in = ::open((m_dir + "/" + name).c_str(), O_RDONLY);
+	if (in < 0) {
+		return true;
+	}
+	string tmp = t.dir + "/mirror";
+	int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	struct stat st;
+	bool ok = out >= 0 && fstat(in, &st) == 0 && copy_range(in, out, 0, st.st_size) && fdatasync(out) == 0;
+	int err = errno;
+	::close(in);
+	if (out >= 0) {
+		::close(out);
+	}
+	if (!ok || rename(tmp.c_str(), (t.dir + "/" + name).c_str()) != 0) {
+		err = ok ? errno : err;
+		unlink(tmp.c_str());
+		fail(t, "copy the container files to", err);
+		return false;
+	}
+	return true;
+}
+
+void chunk_mirror::close_live()
+{
+	for (target& t : m_targets) {
+		if (t.live_fd >= 0) {
+			::close(t.live_fd);
+			t.live_fd = -1;
+		}
+	}
+}
@@ -0,0 +1,74 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include <sys/types.h>
+#include <mutex>
+
+// Keeps copies of a block directory in other local directories.  Sealed chunks
+// never change, so each is copied once, as a reflink where the file system
+// can, otherwise with copy_file_range, then renamed into place.  The final
+// chunk is copied a piece at a time as syncs make it durable.  Chunks removed
+// from the log are removed from the copies.  A target that fails is logged
+// and dropped, it never fails the log itself.  All calls are thread safe.
+class chunk_mirror
+{
+public:
+	~chunk_mirror() { close(); }
+
+	// Directories to mirror into, call before open
+	void set_targets(const vector<string>& dirs) { m_dirs = dirs; }
+	bool enabled() const { return !m_dirs.empty(); }
+
+	// Start mirroring dir, which holds chunks low to high, high being the final
+	// one.  Targets are made if need be, the small files copied and chunks
+	// outside that range removed.  A target that's neither empty nor already a
+	// copy of this log is refused and left as it is.  Returns the sealed chunks that still need
+	// copying somewhere, oldest first.
+	vector<uint64_t> open(const string& dir, uint64_t low, uint64_t high);
+	void close();
+	// A sealed chunk, copy it whole to every target that lacks it
+	void sealed(uint64_t chunk_id);
+	// The final chunk is durable up to size, copy what's new since last time
+	void live(uint64_t chunk_id, int fd, off_t size);
+	// Chunks below low are gone
+	void removed(uint64_t low);
+
+private:
+	struct target
+	{
+		string dir;
+		bool   failed = false;
+		int    live_fd = -1;  // Copy of the final chunk
+	};
+
+	void fail(target& t, const char* what, int err);
+	bool claim(target& t, const string& identity);
+	bool copy_small(target& t, const char* name);
+	void close_live();
+
+private:
+	std::mutex     m_lock;
+	string         m_dir;
+	vector<string> m_dirs;
+	vector<target> m_targets;
+	uint64_t       m_low = 0;         // Chunks below this are removed
+	uint64_t       m_live_chunk = 0;  // The final chunk, as far as the copies know
+	off_t          m_live_copied = 0; // Bytes of it already copied
+};
@@ -56,6 +56,8 @@ void cipher_ctx_t::set_key(const cipher_key_t& key)
 	assert(key.cast().size() == 32);
 	// Set the AES key schedule
 	AES_set_encrypt_key(key.cast().ubuf(), 256, m_key.get());	
+	// GCM keeps its own hash key derived from the AES key, redo it
+	CRYPTO_gcm128_init(m_context, m_key.get(), block128_f(AES_encrypt));
 }
 
 cipher_ctx_t::~cipher_ctx_t()
@@ -91,7 +93,7 @@ bool cipher_ctx_t::decrypt_and_verify(uint64_t iv, slice_t& out, const rslice_t&
 	// Do the actual decrypt, skipping tag
 	gcm_partial_decrypt(out, in.slice(16, out.size()));
 	// Get tag for comparision
-	slice_t tag(16);
+	slice_t tag = slice_t::local(16);
 	gcm_finalize(tag);
 	// Check tag
 	if (memcmp(tag.buf(), in.buf(), 16) != 0) {
@@ -0,0 +1,522 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "container.h"
+#include "latency.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/rand.h>
+extern "C" {
+#include <libscrypt.h>
+};
+
+struct meta_data
+{
+	uint32_t blocks;
+};
+
+struct volume_record
+{
+	char     name[32];
+	uint32_t blocks;
+};
+
+// scrypt costs, in the plain text 'kdf' file as 'scrypt N r p', containers
+// without one use the library's
+struct kdf_params
+{
+	uint64_t N = SCRYPT_N;
+	uint32_t r = SCRYPT_r;
+	uint32_t p = SCRYPT_p;
+};
+
+static const uint64_t s_meta_iv = uint64_t(-1);     // Magic meta-data iv
+static const uint64_t s_volumes_iv = uint64_t(-2);  // Magic volume table iv
+static const uint32_t s_max_blocks = 0x80000000;    // Top logical bit is reserved
+
+static bool make_file(const string& filename, const rslice_t& data) 
+{
+	FILE *f = fopen(filename.c_str(), "w");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to make file: %s\n", filename.c_str());
+		return false;
+	}
+	if (fwrite(data.buf(), 1, data.size(), f) != data.size()) {
+		fprintf(stderr, "Unable to write file: %s\n", filename.c_str());
+		fclose(f);
+		unlink(filename.c_str());
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+static bool read_file(const string& filename, slice_t& data)
+{
+	FILE *f = fopen(filename.c_str(), "r");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to open file: %s\n", filename.c_str());
+		return false;
+	}
+	if (fread(data.buf(), 1, data.size(), f) != data.size()) {
+		fprintf(stderr, "Unable to read file: %s\n", filename.c_str());
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+static bool make_meta_file(const string& filename, const cipher_key_t& k, const meta_data& md)
+{
+	cipher_ctx_t ctx(k);
+	slice_t s((char*) &md, sizeof(meta_data));
+	slice_t r = ctx.encrypt_and_sign(s_meta_iv, s);
+	return make_file(filename, r);
+}
+
+static bool read_meta_file(const string& filename, const cipher_key_t& k, meta_data& md)
+{
+	slice_t s(sizeof(meta_data) + 16);
+	if (!read_file(filename, s)) {
+		return false;
+	}	
+	cipher_ctx_t ctx(k);
+	slice_t r;
+	if (!ctx.decrypt_and_verify(s_meta_iv, r, s)) {
+		fprintf(stderr, "Unable to decrypt meta-file: %s\n", filename.c_str());
+		return false;
+	}
+	memcpy((char*) &md, r.buf(), r.size());
+	return true;
+}
+
+static bool make_volumes_file(const string& filename, const cipher_key_t& k, const vector<volume_info>& volumes)
+{
+	slice_t s(volumes.size() * sizeof(volume_record));
+	volume_record* recs = (volume_record*) s.buf();
+	for (size_t i = 0; i < volumes.size(); i++) {
+		strncpy(recs[i].name, volumes[i].name.c_str(), sizeof(recs[i].name));
+		recs[i].blocks = htonl(volumes[i].blocks);
+	}
+	cipher_ctx_t ctx(k);
+	slice_t r = ctx.encrypt_and_sign(s_volumes_iv, s);
+	return make_file(filename, r);
+}
+
+static bool read_volumes_file(const string& filename, const cipher_key_t& k, vector<volume_info>& volumes)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0 || st.st_size < 16 || 
+		(st.st_size - 16) % sizeof(volume_record) != 0) {
+		fprintf(stderr, "Invalid volume table: %s\n", filename.c_str());
+		return false;
+	}
+	slice_t s(st.st_size);
+	if (!read_file(filename, s)) {
+		return false;
+	}
+	cipher_ctx_t ctx(k);
+	slice_t r;
+	if (!ctx.decrypt_and_verify(s_volumes_iv, r, s)) {
+		fprintf(stderr, "Unable to decrypt volume table: %s\n", filename.c_str());
+		return false;
+	}
+	const volume_record* recs = (const volume_record*) r.buf();
+	uint32_t base = 0;
+	for (size_t i = 0; i < r.size() / sizeof(volume_record); i++) {
+		volume_info vi;
+		vi.name = string(recs[i].name, strnlen(recs[i].name, sizeof(recs[i].name)));
+		vi.base = base;
+		vi.blocks = ntohl(recs[i].blocks);
+		base += vi.blocks;
+		volumes.push_back(vi);
+	}
+	return true;
+}
+
+static bool make_kdf_file(const string& filename, const kdf_params& kp)
+{
+	string text = "scrypt " + std::to_string(kp.N) + " " + std::to_string(kp.r) + " " + std::to_string(kp.p) + "\n";
+	return make_file(filename, slice_t(text.data(), text.size()));
+}
+
+static bool read_kdf_file(const string& filename, kdf_params& kp)
+{
+	FILE* f = fopen(filename.c_str(), "r");
+	if (f == NULL) {
+		return errno == ENOENT;  // Made before costs were kept
+	}
+	uintmax_t n;
+	unsigned int r, p;
+	bool ok = fscanf(f, "scrypt %ju %u %u", &n, &r, &p) == 3;
+	fclose(f);
+	// Anything scrypt would choke on, or more than calibrate_kdf would ever pick,
+	// a corrupt file mustn't run the unlock out of memory
+	if (!ok || n < 2 || (n & (n - 1)) != 0 || r == 0 || p == 0 || p > s_max_kdf_p ||
+		n > s_max_kdf_memory / (128 * uint64_t(r))) {
+		fprintf(stderr, "Invalid key derivation costs: %s\n", filename.c_str());
+		return false;
+	}
+	kp.N = n;
+	kp.r = r;
+	kp.p = p;
+	return true;
+}
+
+static bool derive_key(const string& pass, const rslice_t& salt, const kdf_params& kp, cipher_key_t& key_out)
+{
+	slice_t kbuf(32);
+	int r = libscrypt_scrypt(
+		(const unsigned char*) pass.c_str(), pass.size(), 
+		salt.ubuf(), salt.size(), 
+		kp.N, kp.r, kp.p, 
+		kbuf.ubuf(), kbuf.size());
+	if (r != 0) {
+		fprintf(stderr, "Unable to derive key\n");
+		return false;
+	}
+	key_out = kbuf;
+	return true;
+}
+
+static double now_secs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Costs that take about ms to derive a key on this machine, within memory
+// bytes.  Memory costs an attacker more than passes do, so N goes as high as
+// both allow, then p makes up the time.  Time is close to linear in N * p, so
+// one small timed run is enough to go on.
+static kdf_params calibrate_kdf(uint64_t ms, uint64_t memory)
+{
+	kdf_params kp;
+	kp.r = 8;
+	uint64_t max_n = 1024;
+	while (max_n < (1u << 30) && 2 * max_n * 128 * kp.r <= memory) {
+		max_n *= 2;
+	}
+	uint64_t test_n = std::min(max_n, uint64_t(1) << 14);
+	slice_t salt(32);
+	memset(salt.buf(), 0, salt.size());
+	cipher_key_t key;
+	double start = now_secs();
+	kdf_params test = kp;
+	test.N = test_n;
+	test.p = 1;
+	derive_key("calibrate", salt, test, key);
+	double units = (ms / 1000.0) / std::max((now_secs() - start) / test_n, 1e-12);
+	kp.N = 1024;
+	while (2 * kp.N <= max_n && 2 * kp.N <= units) {
+		kp.N *= 2;
+	}
+	kp.p = uint32_t(std::min(std::max(units / kp.N, 1.0), double(s_max_kdf_p)));
+	return kp;
+}
+
+static bool valid_volumes(const vector<volume_info>& volumes)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < volumes.size(); i++) {
+		const string& name = volumes[i].name;
+		if (name.empty() || name.size() >= sizeof(volume_record::name) || 
+			name.find_first_of("/@") != string::npos) {
+			fprintf(stderr, "Invalid volume name: '%s'\n", name.c_str());
+			return false;
+		}
+		for (size_t j = 0; j < i; j++) {
+			if (volumes[j].name == name) {
+				fprintf(stderr, "Duplicate volume name: '%s'\n", name.c_str());
+				return false;
+			}
+		}
+		if (volumes[i].blocks == 0) {
+			fprintf(stderr, "Volume '%s' is empty\n", name.c_str());
+			return false;
+		}
+		total += volumes[i].blocks;
+	}
+	if (total == 0 || total >= s_max_blocks) {
+		fprintf(stderr, "Invalid total container size\n");
+		return false;
+	}
+	return true;
+}
+
+bool container_options::parse(const string& text)
+{
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t end = text.find(',', pos);
+		if (end == string::npos) {
+			end = text.size();
+		}
+		string item = text.substr(pos, end - pos);
+		pos = end + 1;
+		size_t eq = item.find('=');
+		if (eq == string::npos) {
+			fprintf(stderr, "Option needs a value: %s\n", item.c_str());
+			return false;
+		}
+		string key = item.substr(0, eq);
+		string value = item.substr(eq + 1);
+		if (key == "map_budget" || key == "readahead") {
+			uint64_t size;
+			if (!parse_size(value, size)) {
+				fprintf(stderr, "Invalid size for %s: %s\n", key.c_str(), value.c_str());
+				return false;
+			}
+			(key == "map_budget" ? map_budget : readahead) = size;
+		} else if (key == "trace") {
+			trace = value;
+		} else if (key == "slow_ms" || key == "latency_secs") {
+			char* end;
+			uint64_t n = strtoull(value.c_str(), &end, 10);
+			if (value.empty() || *end != 0) {
+				fprintf(stderr, "Invalid number for %s: %s\n", key.c_str(), value.c_str());
+				return false;
+			}
+			(key == "slow_ms" ? slow_ms : latency_secs) = n;
+		} else if (key == "open_chunks") {
+			char* end;
+			open_chunks = strtoull(value.c_str(), &end, 10);
+			if (value.empty() || *end != 0 || open_chunks == 0) {
+				fprintf(stderr, "Invalid number for %s: %s\n", key.c_str(), value.c_str());
+				return false;
+			}
+		} else if (key == "kdf_ms") {
+			char* end;
+			kdf_ms = strtoull(value.c_str(), &end, 10);
+			if (value.empty() || *end != 0) {
+				fprintf(stderr, "Invalid number for %s: %s\n", key.c_str(), value.c_str());
+				return false;
+			}
+		} else if (key == "kdf_memory") {
+			if (!parse_size(value, kdf_memory) || kdf_memory > s_max_kdf_memory) {
+				fprintf(stderr, "Invalid size for %s: %s\n", key.c_str(), value.c_str());
+				return false;
+			}
+		} else if (key == "mirror") {
+			// Colon separated, commas already separate the options
+			for (size_t start = 0; start <= value.size(); ) {
+				size_t colon = std::min(value.find(':', start), value.size());
+				if (colon == start) {
+					fprintf(stderr, "Empty directory in mirror: %s\n", value.c_str());
+					return false;
+				}
+				mirrors.push_back(value.substr(start, colon - start));
+				start = colon + 1;
+			}
+		} else if (key == "durability") {
+			if (value == "none") {
+				durability = durability_none;
+			} else if (value == "flush") {
+				durability = durability_flush;
+			} else if (value == "sync") {
+				durability = durability_sync;
+			} else {
+				fprintf(stderr, "Durability must be none, flush or sync: %s\n", value.c_str());
+				return false;
+			}
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", key.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+container::container(const cipher_key_t& key, const vector<volume_info>& volumes, const container_options& options)
+	: m_durability(options.durability)
+	, m_volumes(volumes)
+{
+	uint32_t base = 0;
+	for (auto& vi : m_volumes) {
+		vi.base = base;
+		base += vi.blocks;
+	}
+	m_map = make_unique<block_map>(key, base, options.map_budget, options.open_chunks);
+	m_map->set_readahead(options.readahead);
+	m_map->set_mirrors(options.mirrors);
+}
+
+unique_ptr<container> container::create(const string& dir, const vector<volume_info>& volumes, const string& pass,
+	const container_options& options)
+{
+	if (!valid_volumes(volumes)) {
+		return nullptr;
+	}
+	int r = mkdir(dir.c_str(), 0777);
+	if (r < 0) {
+		fprintf(stderr, "Unable to make directory %s: %s\n", dir.c_str(), strerror(errno));
+		return nullptr;
+	}
+	slice_t salt(32);
+	RAND_pseudo_bytes(salt.ubuf(), salt.size());
+	if (!make_file(dir + "/salt", salt)) {
+		return nullptr;
+	}
+	kdf_params kp;
+	if (options.kdf_ms) {
+		kp = calibrate_kdf(options.kdf_ms, options.kdf_memory);
+		if (!make_kdf_file(dir + "/kdf", kp)) {
+			unlink((dir + "/salt").c_str());
+			rmdir(dir.c_str());
+			return nullptr;
+		}
+	}
+	cipher_key_t k;
+	if (!derive_key(pass, salt, kp, k)) {
+		unlink((dir + "/kdf").c_str());
+		unlink((dir + "/salt").c_str());
+		rmdir(dir.c_str());
+		return nullptr;
+	}
+
+	unique_ptr<container> c(new container(k, volumes, options));
+
+	// Containers with just the default volume keep the old layout
+	bool legacy = volumes.size() == 1 && volumes[0].name == s_default_volume;
+	if (!legacy && !make_volumes_file(dir + "/volumes", k, volumes)) {
+		unlink((dir + "/kdf").c_str());
+		unlink((dir + "/salt").c_str());
+		rmdir(dir.c_str());
+		return nullptr;
+	}
+
+	meta_data md;
+	md.blocks = htonl(c->map().block_count());
+	if (!make_meta_file(dir + "/meta", k, md)) {
+		unlink((dir + "/volumes").c_str());
+		unlink((dir + "/kdf").c_str());
+		unlink((dir + "/salt").c_str());
+		rmdir(dir.c_str());
+		return nullptr;
+	}
+
+	if (!c->start(dir, options)) {
+		return nullptr;
+	}
+	return c;
+}
+
+bool container::unlock(const string& dir, const string& pass, cipher_key_t& key_out)
+{
+	slice_t salt(32);
+	if (!read_file(dir + "/salt", salt)) {
+		return false;
+	}
+	kdf_params kp;
+	if (!read_kdf_file(dir + "/kdf", kp)) {
+		return false;
+	}
+	if (!derive_key(pass, salt, kp, key_out)) {
+		return false;
+	}
+	meta_data md;
+	if (!read_meta_file(dir + "/meta", key_out, md)) {
+		rmdir(dir.c_str());
+		return false;
+	}
+	return true;
+}
+
+unique_ptr<container> container::open(const string& dir, const string& pass, const container_options& options)
+{
+	cipher_key_t k;
+	if (!unlock(dir, pass, k)) {
+		return nullptr;
+	}
+	return open(dir, k, options);
+}
+
+unique_ptr<container> container::open(const string& dir, const cipher_key_t& k, const container_options& options)
+{
+	meta_data md;
+	if (!read_meta_file(dir + "/meta", k, md)) {
+		return nullptr;
+	}
+	uint32_t blocks = ntohl(md.blocks);
+
+	vector<volume_info> volumes;
+	if (access((dir + "/volumes").c_str(), F_OK) == 0) {
+		if (!read_volumes_file(dir + "/volumes", k, volumes)) {
+			return nullptr;
+		}
+	} else {
+		volumes.push_back(volume_info{ s_default_volume, 0, blocks });
+	}
+
+	unique_ptr<container> c(new container(k, volumes, options));
+	if (c->map().block_count() != blocks) {
+		fprintf(stderr, "Volume table doesn't match meta-data: %s\n", dir.c_str());
+		return nullptr;
+	}
+	if (!c->start(dir, options)) {
+		return nullptr;
+	}
+	return c;
+}
+
+bool container::start(const string& dir, const container_options& options)
+{
+	if (!m_map->open(dir)) {
+		return false;
+	}
+	lat_configure(options.slow_ms, options.latency_secs);
+	if (!options.trace.empty()) {
+		m_trace = make_unique<trace_writer>();
+		if (!m_trace->open(options.trace)) {
+			fprintf(stderr, "Unable to start trace: %s\n", options.trace.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool container::flush()
+{
+	if (m_durability == durability_none) {
+		return true;
+	}
+	return m_map->flush();
+}
+
+bool container::write_done(bool fua)
+{
+	if (m_durability == durability_sync || (fua && m_durability == durability_flush)) {
+		return m_map->flush();
+	}
+	return true;
+}
+
+const volume_info* container::find_volume(const string& name)
+{
+	for (const auto& vi : m_volumes) {
+		if (vi.name == name) {
+			return &vi;
+		}
+	}
+	return nullptr;
+}
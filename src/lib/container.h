@@ -0,0 +1,108 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "block_map.h"
+#include "trace.h"
+
+// A logical volume, a contiguous range of the container's logical blocks
+struct volume_info
+{
+	string   name;
+	uint32_t base;
+	uint32_t blocks;
+};
+
+// The name used by containers made before volumes existed
+static const char* const s_default_volume = "data";
+
+// When writes reach the disk
+enum durability_mode
+{
+	durability_none,   // Only when the kernel gets around to it, flush requests are ignored
+	durability_flush,  // When a user asks with a flush, fsync or FUA
+	durability_sync,   // Before every write request returns
+};
+
+static const uint64_t s_default_kdf_ms = 1000;                // Aim for key derivation to take this long
+static const uint64_t s_default_kdf_memory = 128 * 1024 * 1024;  // and use at most this much memory
+static const uint64_t s_max_kdf_memory = 1024 * 1024 * 1024;  // Costs past these are refused, even from
+static const uint32_t s_max_kdf_p = 1024;                       // an existing container's kdf file
+
+// Runtime settings, these don't change anything on disk, apart from the
+// kdf ones, which set the cost of the password when creating
+struct container_options
+{
+	size_t map_budget = 0;  // Bytes of logical map to keep cached, 0 keeps it all resident
+	string trace;           // File to record a request trace into, if any
+	uint64_t slow_ms = 0;       // Log the stage breakdown of requests slower than this
+	uint64_t latency_secs = 0;  // Log latency percentiles this often
+	durability_mode durability = durability_flush;
+	size_t open_chunks = s_default_open_chunks;  // Chunk files kept open for reads
+	size_t readahead = s_default_readahead;      // Largest readahead window in bytes, 0 for none
+	vector<string> mirrors;  // Directories to keep copies of the container in
+	uint64_t kdf_ms = s_default_kdf_ms;          // 0 for the library's fixed scrypt costs
+	uint64_t kdf_memory = s_default_kdf_memory;
+
+	// Parse 'key=value[,key=value...]', sizes may end in K, M or G
+	bool parse(const string& text);
+};
+
+// A container directory: salt, key derivation costs, meta-data, volume table
+// and one shared block log
+class container
+{
+public:
+	// Make a new container directory holding the given volumes (base is ignored),
+	// with scrypt costs measured to suit the kdf options on this machine
+	static unique_ptr<container> create(const string& dir, const vector<volume_info>& volumes, const string& pass,
+		const container_options& options = container_options());
+	// Unlock and open an existing container directory
+	static unique_ptr<container> open(const string& dir, const string& pass,
+		const container_options& options = container_options());
+	// Check the password of a container directory and get its key, the log isn't touched
+	static bool unlock(const string& dir, const string& pass, cipher_key_t& key_out);
+	// Open with a key from unlock, tools that open a container over and over
+	// only need to derive it once
+	static unique_ptr<container> open(const string& dir, const cipher_key_t& key,
+		const container_options& options = container_options());
+
+	// The one block_map shared by all volumes
+	block_map& map() { return *m_map; }
+	// Volumes in logical order
+	const vector<volume_info>& volumes() { return m_volumes; }
+	// Find a volume by name, or null
+	const volume_info* find_volume(const string& name);
+	// A user flush request, durable unless the durability mode is none
+	bool flush();
+	// Called once a whole write request is done, fua asks for it to be durable
+	bool write_done(bool fua);
+	// Record a request in the trace, if tracing, offset is in container bytes
+	void trace(uint8_t op, uint64_t offset, uint32_t length) { if (m_trace) m_trace->record(op, offset, length); }
+
+private:
+	container(const cipher_key_t& key, const vector<volume_info>& volumes, const container_options& options);
+	bool start(const string& dir, const container_options& options);
+
+private:
+	durability_mode       m_durability;
+	vector<volume_info>   m_volumes;
+	unique_ptr<block_map> m_map;
+	unique_ptr<trace_writer> m_trace;
+};
@@ -29,3 +29,30 @@ digest_t compute_digest(const rslice_t& data)
 	return out;
 }
 
+
+struct digest_ctx_t::state
+{
+	SHA256_CTX ctx;
+};
+
+digest_ctx_t::digest_ctx_t()
+	: m_state(new state)
+{
+	SHA256_Init(&m_state->ctx);
+}
+
+digest_ctx_t::~digest_ctx_t()
+{
+}
+
+void digest_ctx_t::update(const char* buf, size_t size)
+{
+	SHA256_Update(&m_state->ctx, buf, size);
+}
+
+digest_t digest_ctx_t::finish()
+{
+	slice_t out(SHA256_DIGEST_LENGTH);
+	SHA256_Final(out.ubuf(), &m_state->ctx);
+	return out;
+}
@@ -28,3 +28,18 @@ class digest_t : public frslice_t<digest_t, 32> {
 
 digest_t compute_digest(const rslice_t& data);
 
+// The same for data that comes in pieces, such as a file read a bit at a time
+class digest_ctx_t
+{
+public:
+	digest_ctx_t();
+	~digest_ctx_t();
+	void update(const char* buf, size_t size);
+	// The digest of everything so far, the context is done after this
+	digest_t finish();
+
+private:
+	struct state;
+	unique_ptr<state> m_state;
+};
+
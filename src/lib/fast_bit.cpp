@@ -16,27 +16,62 @@
  */
 
 #include "fast_bit.h"
-#include <memory.h>
+
+static const size_t s_word_bits = 64;
+
+static inline uint64_t bit_mask(size_t elem)
+{
+	return uint64_t(1) << (elem % s_word_bits);
+}
+
+// Bits at or above (elem % 64) within its word
+static inline uint64_t from_mask(size_t elem)
+{
+	return ~uint64_t(0) << (elem % s_word_bits);
+}
+
+static inline size_t first_bit(uint64_t word)
+{
+	return __builtin_ctzll(word);
+}
 
 fast_bit::fast_bit(size_t size)
 	: m_size(size)
-	, m_bits((2 * size + 7) / 8)
 {
+	size_t words = 0;
+	size_t count = max(size, size_t(1));
+	do {
+		count = (count + s_word_bits - 1) / s_word_bits;
+		m_levels.push_back(words);
+		words += count;
+	} while (count > 1);
+	m_words.resize(words);
 }
 
 void fast_bit::set(size_t i, bool value) 
 {
-	i += m_size;
-	set_bit(i, value);
-	while (i) {
-		i /= 2;
-		set_bit(i, get_bit(i*2) | get_bit(i*2 + 1));
+	// Walk up while the word we changed flips between empty and non-empty
+	for (size_t level = 0; level < m_levels.size(); level++) {
+		uint64_t& word = m_words[m_levels[level] + i / s_word_bits];
+		uint64_t old = word;
+		if (value) {
+			word |= bit_mask(i);
+			if (old != 0) {
+				return;
+			}
+		} else {
+			word &= ~bit_mask(i);
+			if (old != bit_mask(i)) {
+				return;
+			}
+		}
+		i /= s_word_bits;
 	}
 }
 
 bool fast_bit::get(size_t i)
 {
-	return get_bit(i + m_size);
+	return (m_words[i / s_word_bits] & bit_mask(i)) != 0;
 }
 
 // Find the first set bit >= start, wrapping if needed
@@ -44,41 +79,128 @@ bool fast_bit::get(size_t i)
 // Always doable in log(n) time
 size_t fast_bit::find_set(size_t start)
 {
-	if (get_bit(1) == 0) {  // If top bit isn't set, no bits are set
+	if (m_words.back() == 0) {  // If top word is empty, no bits are set
 		return m_size;  // Failure case
 	}
-	// Otherwise, start at start (corrected for rest of tree)
-	size_t i = start + m_size;
-	// While we haven't found a set bits
-	while (!get_bit(i)) {
-		if ((i & (i + 1)) == 0) {  // This is true on 'right edge' of tree
-			i = 1;  // This means I hit the end, 'wrap', by going to 1
-		} else if (i & 1) { // i is odd
-			i++; // Go forward on same level
-		} else {  // I is even
-			i /= 2;  // Go up one level & forward
+	if (start >= m_size) {
+		start = 0;
+	}
+	size_t r = find_from(start);
+	if (r == m_size) {
+		// Nothing at or after start, 'wrap' to the beginning
+		r = find_from(0);
+	}
+	return r;
+}
+
+void fast_bit::assign(const vector<uint64_t>& bits)
+{
+	assert(bits.size() == level_words(0));
+	std::copy(bits.begin(), bits.end(), m_words.begin());
+	refresh(0, bits.size() - 1);
+}
+
+void fast_bit::set_range(size_t begin, size_t end, bool value)
+{
+	if (begin >= end) {
+		return;
+	}
+	size_t first = begin / s_word_bits;
+	size_t last = (end - 1) / s_word_bits;
+	for (size_t w = first; w <= last; w++) {
+		uint64_t mask = ~uint64_t(0);
+		if (w == first) {
+			mask &= from_mask(begin);
 		}
+		if (w == last) {
+			mask &= ~from_mask(end - 1) | bit_mask(end - 1);
+		}
+		if (value) {
+			m_words[w] |= mask;
+		} else {
+			m_words[w] &= ~mask;
+		}
+	}
+	refresh(first, last);
+}
+
+size_t fast_bit::count(size_t begin, size_t end)
+{
+	size_t r = 0;
+	if (begin >= end) {
+		return r;
+	}
+	size_t first = begin / s_word_bits;
+	size_t last = (end - 1) / s_word_bits;
+	for (size_t w = first; w <= last; w++) {
+		uint64_t word = m_words[w];
+		if (w == first) {
+			word &= from_mask(begin);
+		}
+		if (w == last) {
+			word &= ~from_mask(end - 1) | bit_mask(end - 1);
+		}
+		r += __builtin_popcountll(word);
+	}
+	return r;
+}
+
+// Recompute the summary bits above level 0 words [first_word, last_word]
+void fast_bit::refresh(size_t first_word, size_t last_word)
+{
+	for (size_t level = 0; level + 1 < m_levels.size(); level++) {
+		const uint64_t* below = &m_words[m_levels[level]];
+		uint64_t* above = &m_words[m_levels[level + 1]];
+		// Rebuild whole parent words, so bits outside the range are recomputed too
+		size_t first = first_word / s_word_bits;
+		size_t last = last_word / s_word_bits;
+		size_t count = level_words(level);
+		for (size_t w = first; w <= last; w++) {
+			uint64_t word = 0;
+			size_t end = min((w + 1) * s_word_bits, count);
+			for (size_t i = w * s_word_bits; i < end; i++) {
+				if (below[i]) {
+					word |= bit_mask(i);
+				}
+			}
+			above[w] = word;
+		}
+		first_word = first;
+		last_word = last;
 	}
-	// Loop must have terminated (maybe on 1), thus we need to go down until valid
-	while (i < m_size) {
-		i *= 2;  // Go down and left
-		if (!get_bit(i)) {
-			i++;  // If it's not a 1, neighbor must be
+}
+
+// Find the first set bit >= start without wrapping, or m_size
+size_t fast_bit::find_from(size_t start)
+{
+	size_t i = start;
+	// Go up until some word has a set bit at or after our position
+	for (size_t level = 0; level < m_levels.size(); level++) {
+		size_t w = i / s_word_bits;
+		if (w >= level_words(level)) {
+			return m_size;  // Ran off the end
+		}
+		uint64_t word = m_words[m_levels[level] + w] & from_mask(i);
+		if (word) {
+			return descend(level, w * s_word_bits + first_bit(word));
 		}
+		// Nothing left in this word, look at the following words one level up
+		i = w + 1;
 	}
-	// Convert result back
-	return i - m_size;
+	return m_size;
 }
 
-void fast_bit::set_bit(size_t elem, bool value) {
-	uint8_t mask = 1 << (elem % 8);
-	m_bits[elem / 8] &= ~mask;
-	if (value) {
-		m_bits[elem / 8] |= mask;
+// Go down from a set summary bit to the first set bit below it
+size_t fast_bit::descend(size_t level, size_t i)
+{
+	while (level--) {
+		i = i * s_word_bits + first_bit(m_words[m_levels[level] + i]);
 	}
+	return i;
 }
 
-bool fast_bit::get_bit(size_t elem) {
-	uint8_t mask = 1 << (elem % 8);
-	return ((m_bits[elem / 8] & mask) != 0);
+size_t fast_bit::level_words(size_t level)
+{
+	size_t end = level + 1 < m_levels.size() ? m_levels[level + 1] : m_words.size();
+	return end - m_levels[level];
 }
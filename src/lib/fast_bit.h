@@ -19,6 +19,9 @@
 
 #include "types.h"
 
+// A bit vector with a summary hierarchy for fast searches
+// Each level holds one bit per word of the level below (64-ary tree),
+// so updates and searches touch about log64(n) words
 class fast_bit 
 {
 public:
@@ -27,15 +30,38 @@ public:
 	void set(size_t elem, bool value);
 	bool get(size_t elem);
 	size_t find_set(size_t start);
+
+	// Replace all bits from a dense bitmap of (size + 63) / 64 words, bit i of
+	// word w is element w * 64 + i, summaries are rebuilt in one pass
+	void assign(const vector<uint64_t>& bits);
+	// The reverse, a copy of the bits in the same dense format
+	vector<uint64_t> dense() { return vector<uint64_t>(m_words.begin(), m_words.begin() + level_words(0)); }
+	// Set or clear every element in [begin, end)
+	void set_range(size_t begin, size_t end, bool value);
+	// Number of set elements in [begin, end)
+	size_t count(size_t begin, size_t end);
+	// First set element >= start without wrapping, or size if there is none
+	size_t next_set(size_t start) { return start < m_size ? find_from(start) : m_size; }
+	// Call func(elem) for each set element in [begin, end), in order
+	template<class Functor>
+	void for_each_set(size_t begin, size_t end, Functor func)
+	{
+		for (size_t i = next_set(begin); i < end; i = next_set(i + 1)) {
+			func(i);
+		}
+	}
 	
 private:
-	void set_bit(size_t elem, bool value);
-	bool get_bit(size_t elem);
+	size_t find_from(size_t start);
+	size_t descend(size_t level, size_t i);
+	size_t level_words(size_t level);
+	void refresh(size_t first_word, size_t last_word);
 
 private:
 	// Size of actual bits
 	size_t m_size;
-
-	// Includes main bits + rollup bits
-	std::vector<uint8_t> m_bits;
+	// Start of each level in m_words, level 0 is the actual bits
+	std::vector<size_t> m_levels;
+	// All levels, bottom up, top level is a single word
+	std::vector<uint64_t> m_words;
 };
@@ -0,0 +1,284 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+
+static const char* const s_names[lat_count] = {
+	"read",
+	"write",
+	"clean",
+	"crypt",
+	"io",
+	"index",
+	"rollover",
+	"remove",
+	"sync",
+};
+
+void lat_histogram::merge(const lat_histogram& other)
+{
+	for (uint32_t i = 0; i < s_buckets; i++) {
+		m_counts[i] += other.m_counts[i];
+	}
+}
+
+void lat_histogram::subtract(const lat_histogram& other)
+{
+	for (uint32_t i = 0; i < s_buckets; i++) {
+		m_counts[i] -= other.m_counts[i];
+	}
+}
+
+uint64_t lat_histogram::count() const
+{
+	uint64_t r = 0;
+	for (uint32_t i = 0; i < s_buckets; i++) {
+		r += m_counts[i];
+	}
+	return r;
+}
+
+uint64_t lat_histogram::percentile(double p) const
+{
+	uint64_t want = std::max(uint64_t(p * count() + 0.5), uint64_t(1));
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < s_buckets; i++) {
+		seen += m_counts[i];
+		if (seen >= want) {
+			return bucket_top(i);
+		}
+	}
+	return 0;
+}
+
+uint64_t lat_histogram::max() const
+{
+	for (uint32_t i = s_buckets; i > 0; i--) {
+		if (m_counts[i - 1]) {
+			return bucket_top(i - 1);
+		}
+	}
+	return 0;
+}
+
+// Values below 16 get a bucket each, above that the top 5 bits pick it
+uint32_t lat_histogram::bucket(uint64_t nsecs)
+{
+	const uint64_t sub = uint64_t(1) << s_sub_bits;
+	if (nsecs < sub) {
+		return uint32_t(nsecs);
+	}
+	uint32_t shift = 63 - __builtin_clzll(nsecs) - s_sub_bits;
+	return ((shift + 1) << s_sub_bits) + uint32_t((nsecs >> shift) & (sub - 1));
+}
+
+uint64_t lat_histogram::bucket_top(uint32_t which)
+{
+	const uint64_t sub = uint64_t(1) << s_sub_bits;
+	if (which < sub) {
+		return which;
+	}
+	uint32_t shift = (which >> s_sub_bits) - 1;
+	uint64_t low = (sub + (which & (sub - 1))) << shift;
+	return low + ((uint64_t(1) << shift) - 1);
+}
+
+struct local_latency;
+
+static std::mutex s_lat_lock;
+static std::set<local_latency*> s_threads;
+static lat_totals_t s_retired;  // Left behind by threads that exited
+
+static std::atomic<uint64_t> s_slow_nsecs(0);
+static std::atomic<uint64_t> s_summary_nsecs(0);
+static std::atomic<uint64_t> s_next_summary(0);
+static std::mutex s_summary_lock;
+static lat_totals_t s_last_summary;
+
+// Buckets are only written by the owning thread, like local_stats
+struct local_latency
+{
+	std::atomic<uint64_t> counts[lat_count][lat_histogram::s_buckets];
+	// Stages of the request in progress, for the slow-op log
+	uint32_t depth = 0;
+	uint64_t request_nsecs[lat_count];
+	uint32_t request_count[lat_count];
+
+	local_latency()
+	{
+		for (auto& h : counts) {
+			for (auto& c : h) {
+				c.store(0, std::memory_order_relaxed);
+			}
+		}
+		std::lock_guard<std::mutex> lock(s_lat_lock);
+		s_threads.insert(this);
+	}
+
+	~local_latency()
+	{
+		std::lock_guard<std::mutex> lock(s_lat_lock);
+		add_to(s_retired);
+		s_threads.erase(this);
+	}
+
+	void add_to(lat_totals_t& totals)
+	{
+		for (uint32_t s = 0; s < lat_count; s++) {
+			for (uint32_t i = 0; i < lat_histogram::s_buckets; i++) {
+				totals[s].m_counts[i] += counts[s][i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+static thread_local local_latency t_latency;
+
+uint64_t lat_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+void lat_record(lat_stage which, uint64_t nsecs)
+{
+	local_latency& ll = t_latency;
+	std::atomic<uint64_t>& c = ll.counts[which][lat_histogram::bucket(nsecs)];
+	c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (ll.depth) {
+		ll.request_nsecs[which] += nsecs;
+		ll.request_count[which]++;
+	}
+}
+
+void lat_configure(uint64_t slow_ms, uint64_t summary_secs)
+{
+	s_slow_nsecs = slow_ms * 1000000;
+	s_summary_nsecs = summary_secs * 1000000000;
+	s_next_summary = lat_now() + s_summary_nsecs;
+}
+
+lat_totals_t lat_totals()
+{
+	std::lock_guard<std::mutex> lock(s_lat_lock);
+	lat_totals_t r = s_retired;
+	for (local_latency* ll : s_threads) {
+		ll->add_to(r);
+	}
+	return r;
+}
+
+string lat_summary(const lat_totals_t& totals)
+{
+	string r;
+	char line[160];
+	for (uint32_t s = 0; s < lat_count; s++) {
+		const lat_histogram& h = totals[s];
+		uint64_t n = h.count();
+		if (n == 0) {
+			continue;
+		}
+		snprintf(line, sizeof(line), "%s n=%ju p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+			s_names[s], uintmax_t(n), h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3,
+			h.percentile(0.999) / 1e3, h.max() / 1e3);
+		r += line;
+	}
+	return r;
+}
+
+const char* lat_name(lat_stage which)
+{
+	return s_names[which];
+}
+
+// Logs what happened since the last summary, one line per stage
+static void log_summary()
+{
+	lat_totals_t totals = lat_totals();
+	lat_totals_t since = totals;
+	{
+		std::lock_guard<std::mutex> lock(s_summary_lock);
+		for (uint32_t s = 0; s < lat_count; s++) {
+			since[s].subtract(s_last_summary[s]);
+		}
+		s_last_summary = totals;
+	}
+	string text = lat_summary(since);
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		syslog(LOG_INFO, "latency %s", text.substr(pos, end - pos).c_str());
+		pos = end + 1;
+	}
+}
+
+// Checks the slow threshold and the summary timer at the end of a request
+static void request_done(lat_stage which, uint64_t nsecs)
+{
+	uint64_t slow = s_slow_nsecs.load(std::memory_order_relaxed);
+	if (slow && nsecs >= slow) {
+		local_latency& ll = t_latency;
+		string stages;
+		char part[64];
+		for (uint32_t s = 0; s < lat_count; s++) {
+			if (s != which && ll.request_count[s]) {
+				snprintf(part, sizeof(part), " %s=%ux/%.3fms",
+					s_names[s], ll.request_count[s], ll.request_nsecs[s] / 1e6);
+				stages += part;
+			}
+		}
+		syslog(LOG_WARNING, "Slow %s took %.3fms:%s", s_names[which], nsecs / 1e6, stages.c_str());
+	}
+	uint64_t every = s_summary_nsecs.load(std::memory_order_relaxed);
+	if (every) {
+		// One thread wins each period and does the logging
+		uint64_t now = lat_now();
+		uint64_t next = s_next_summary.load(std::memory_order_relaxed);
+		if (now >= next && s_next_summary.compare_exchange_strong(next, now + every)) {
+			log_summary();
+		}
+	}
+}
+
+lat_request::lat_request(lat_stage which)
+	: m_which(which)
+{
+	local_latency& ll = t_latency;
+	m_outer = ll.depth++ == 0;
+	if (m_outer) {
+		memset(ll.request_nsecs, 0, sizeof(ll.request_nsecs));
+		memset(ll.request_count, 0, sizeof(ll.request_count));
+	}
+	m_start = lat_now();
+}
+
+lat_request::~lat_request()
+{
+	uint64_t nsecs = lat_now() - m_start;
+	t_latency.depth--;
+	lat_record(m_which, nsecs);
+	if (m_outer) {
+		request_done(m_which, nsecs);
+	}
+}
@@ -0,0 +1,99 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include <atomic>
+
+// Latency histograms for each stage of the block paths, kept per thread like
+// the counters in stats.h.  Buckets are log-linear, HDR style: 16 per power of
+// two, so any percentile is within about 6% of the truth, from nanoseconds up.
+enum lat_stage
+{
+	lat_read,      // Whole user read
+	lat_write,     // Whole user write, cleaning included
+	lat_clean,     // Moving a batch of blocks forward in clean
+	lat_crypt,     // GCM over one block
+	lat_io,        // Seeking and reading or writing one block and its footers
+	lat_index,     // Reading an index page that wasn't cached
+	lat_rollover,  // Sealing a chunk and starting the next
+	lat_remove,    // Syncing and unlinking chunks that fell off the ring
+	lat_sync,      // One group commit
+	lat_count
+};
+
+class lat_histogram
+{
+public:
+	static const uint32_t s_sub_bits = 4;
+	static const uint32_t s_buckets = (64 - s_sub_bits + 1) << s_sub_bits;
+
+	void add(uint64_t nsecs) { m_counts[bucket(nsecs)]++; }
+	void merge(const lat_histogram& other);
+	// Remove what other counted, other must be an earlier copy of this one
+	void subtract(const lat_histogram& other);
+	uint64_t count() const;
+	// Smallest value with at least fraction p of the samples at or below it
+	uint64_t percentile(double p) const;
+	uint64_t max() const;
+
+	static uint32_t bucket(uint64_t nsecs);
+	// Largest value that lands in a bucket
+	static uint64_t bucket_top(uint32_t which);
+
+	uint64_t m_counts[s_buckets] = {};
+};
+
+typedef array<lat_histogram, lat_count> lat_totals_t;
+
+// Settings shared by all threads, 0 turns either one off
+// Requests over slow_ms get their per-stage breakdown logged, and every
+// summary_secs a user request logs percentiles for what happened since the last
+void lat_configure(uint64_t slow_ms, uint64_t summary_secs);
+// Merged histograms of all threads so far
+lat_totals_t lat_totals();
+// One line per stage that saw any samples, times in microseconds
+string lat_summary(const lat_totals_t& totals);
+const char* lat_name(lat_stage which);
+
+uint64_t lat_now();
+void lat_record(lat_stage which, uint64_t nsecs);
+
+// Times the enclosing scope as one stage
+class lat_timer
+{
+public:
+	lat_timer(lat_stage which) : m_which(which), m_start(lat_now()) {}
+	~lat_timer() { lat_record(m_which, lat_now() - m_start); }
+private:
+	lat_stage m_which;
+	uint64_t  m_start;
+};
+
+// Times the enclosing scope as a whole user request, only the outermost one
+// on a thread counts, and its stages are collected for the slow-op log
+class lat_request
+{
+public:
+	lat_request(lat_stage which);
+	~lat_request();
+private:
+	lat_stage m_which;
+	uint64_t  m_start;
+	bool      m_outer;
+};
@@ -0,0 +1,360 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "page_map.h"
+#include "digest.h"
+#include "latency.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <openssl/rand.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+// Index file layout, all records are the same size:
+//   record 0: plaintext magic and salt, a new salt on every reset
+//   record 1: header
+//   records 2..n: in-use bitmap saved on clean close
+//   then one record per page of entries
+// Every other record is an 8 byte IV, then a GCM tag, then the encrypted
+// payload.  An IV of 0 marks a record that was never written.
+static const uint64_t s_entries_per_page = 256;
+static const uint64_t s_payload_size = s_entries_per_page * sizeof(uint32_t);
+static const uint64_t s_tag_size = 16;
+static const uint64_t s_iv_size = sizeof(uint64_t);
+static const uint64_t s_record_size = s_iv_size + s_tag_size + s_payload_size;
+static const uint64_t s_bits_per_record = s_payload_size * 8;
+static const uint64_t s_words_per_record = s_payload_size / sizeof(uint64_t);
+static const uint64_t s_ivs_per_epoch = uint64_t(1) << 32;
+static const uint64_t s_salt_size = 32;
+static const char s_magic[8] = { 'S', 'D', 'I', 'N', 'D', 'E', 'X', '1' };
+
+struct index_header
+{
+	uint32_t clean;
+	uint32_t entries;
+	uint32_t physical_size;
+	uint32_t top_hi;
+	uint32_t top_lo;
+	uint32_t epoch_hi;
+	uint32_t epoch_lo;
+};
+
+static void put_u64(char* buf, uint64_t x)
+{
+	for (int i = 7; i >= 0; i--) {
+		buf[i] = char(x & 0xff);
+		x >>= 8;
+	}
+}
+
+static uint64_t get_u64(const char* buf)
+{
+	uint64_t x = 0;
+	for (int i = 0; i < 8; i++) {
+		x = (x << 8) | byte(buf[i]);
+	}
+	return x;
+}
+
+// Each incarnation of the index gets its own key, so its IVs can't collide
+// with the block log's, or with those of an index that was thrown away
+static cipher_key_t index_key(const cipher_key_t& key, const rslice_t& salt)
+{
+	slice_t data(key.cast());
+	data.append("index", 5);
+	data.append(salt);
+	return compute_digest(data).cast();
+}
+
+page_map::page_map(const cipher_key_t& key, uint32_t entries, size_t budget)
+	: m_key(key)
+	, m_entries(entries)
+	, m_physical_size(0)
+	, m_max_pages(max(budget / (s_payload_size + 64), size_t(1)))
+	, m_fd(-1)
+	, m_epoch(0)
+	, m_next_iv(0)
+{}
+
+page_map::~page_map()
+{
+	if (m_fd >= 0) {
+		::close(m_fd);
+	}
+}
+
+bool page_map::open(const string& dir, uint32_t physical_size, uint64_t top, bool& current_out, vector<uint64_t>& in_use_out)
+{
+	m_physical_size = physical_size;
+	current_out = false;
+	string name = dir + "/index";
+	m_fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0777);
+	if (m_fd < 0) {
+		syslog(LOG_ERR, "page_map::open> Unable to open index: %s, %s", name.c_str(), strerror(errno));
+		return false;
+	}
+	// Pick up the salt, then check the header
+	slice_t plain(s_record_size);
+	if (!pread_fully(m_fd, plain.buf(), plain.size(), 0) || memcmp(plain.buf(), s_magic, sizeof(s_magic)) != 0) {
+		return reset();
+	}
+	m_cipher_ctx.set_key(index_key(m_key, plain.slice(sizeof(s_magic), s_salt_size)));
+	slice_t data(s_payload_size);
+	bool missing;
+	if (!read_record(s_record_size, data, missing) || missing) {
+		return reset();
+	}
+	const index_header* hdr = (const index_header*) data.buf();
+	uint64_t saved_top = (uint64_t(ntohl(hdr->top_hi)) << 32) | ntohl(hdr->top_lo);
+	if (ntohl(hdr->clean) != 1 ||
+	    ntohl(hdr->entries) != m_entries ||
+	    ntohl(hdr->physical_size) != m_physical_size ||
+	    saved_top != top) {
+		return reset();
+	}
+	// A clean header covers every IV used so far, move past them
+	m_epoch = ((uint64_t(ntohl(hdr->epoch_hi)) << 32) | ntohl(hdr->epoch_lo)) + 1;
+	m_next_iv = m_epoch * s_ivs_per_epoch + 1;
+	// Load the saved in-use bits
+	in_use_out.assign((uint64_t(m_physical_size) + 63) / 64, 0);
+	for (uint64_t i = 0; i * s_words_per_record < in_use_out.size(); i++) {
+		if (!read_record((2 + i) * s_record_size, data, missing) || missing) {
+			return reset();
+		}
+		for (uint64_t w = 0; w < s_words_per_record; w++) {
+			uint64_t word = i * s_words_per_record + w;
+			if (word < in_use_out.size()) {
+				in_use_out[word] = get_u64(data.buf() + w * sizeof(uint64_t));
+			}
+		}
+	}
+	// Anything written from now on makes the saved state stale, and the disk
+	// has to know before any page write can get there
+	if (!write_header(false, 0)) {
+		return false;
+	}
+	if (fdatasync(m_fd) != 0) {
+		syslog(LOG_ERR, "page_map::open> fdatasync failed: %s", strerror(errno));
+		return false;
+	}
+	current_out = true;
+	return true;
+}
+
+bool page_map::reset()
+{
+	m_pages.clear();
+	m_lru.clear();
+	if (ftruncate(m_fd, 0) != 0) {
+		syslog(LOG_ERR, "page_map::reset> Unable to truncate index: %s", strerror(errno));
+		return false;
+	}
+	// New salt, so starting the IVs over is safe
+	slice_t plain(s_record_size);
+	memset(plain.buf(), 0, plain.size());
+	memcpy(plain.buf(), s_magic, sizeof(s_magic));
+	RAND_bytes(plain.ubuf() + sizeof(s_magic), s_salt_size);
+	if (!pwrite_fully(m_fd, plain.buf(), plain.size(), 0)) {
+		syslog(LOG_ERR, "page_map::reset> Unable to write index: %s", strerror(errno));
+		return false;
+	}
+	m_cipher_ctx.set_key(index_key(m_key, plain.slice(sizeof(s_magic), s_salt_size)));
+	m_epoch = 0;
+	m_next_iv = 1;
+	return write_header(false, 0);
+}
+
+bool page_map::get(uint32_t which, uint32_t& value_out)
+{
+	page* p = load(which / s_entries_per_page);
+	if (p == nullptr) {
+		return false;
+	}
+	value_out = p->entries[which % s_entries_per_page];
+	return true;
+}
+
+bool page_map::set(uint32_t which, uint32_t value)
+{
+	page* p = load(which / s_entries_per_page);
+	if (p == nullptr) {
+		return false;
+	}
+	p->entries[which % s_entries_per_page] = value;
+	p->dirty = true;
+	return true;
+}
+
+bool page_map::close(uint64_t top, const vector<uint64_t>& in_use)
+{
+	// Write back every dirty page
+	for (auto& kvp : m_pages) {
+		if (!kvp.second.dirty) {
+			continue;
+		}
+		slice_t data(s_payload_size);
+		uint32_t* out = (uint32_t*) data.buf();
+		for (uint64_t i = 0; i < s_entries_per_page; i++) {
+			out[i] = htonl(kvp.second.entries[i]);
+		}
+		if (!write_record(page_offset(kvp.first), data)) {
+			return false;
+		}
+		kvp.second.dirty = false;
+	}
+	// Save the in-use bits so the next open doesn't need the whole map
+	for (uint64_t i = 0; i * s_words_per_record < in_use.size(); i++) {
+		slice_t data(s_payload_size);
+		for (uint64_t w = 0; w < s_words_per_record; w++) {
+			uint64_t word = i * s_words_per_record + w;
+			put_u64(data.buf() + w * sizeof(uint64_t), word < in_use.size() ? in_use[word] : 0);
+		}
+		if (!write_record((2 + i) * s_record_size, data)) {
+			return false;
+		}
+	}
+	// Everything has to be on disk before the header says so
+	if (fdatasync(m_fd) != 0) {
+		syslog(LOG_ERR, "page_map::close> fdatasync failed: %s", strerror(errno));
+		return false;
+	}
+	if (!write_header(true, top)) {
+		return false;
+	}
+	return fdatasync(m_fd) == 0;
+}
+
+page_map::page* page_map::load(uint32_t page_id)
+{
+	auto it = m_pages.find(page_id);
+	if (it != m_pages.end()) {
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+		stat_add(stat_cache_hits);
+		return &it->second;
+	}
+	stat_add(stat_cache_misses);
+	lat_timer timer(lat_index);
+	if (m_pages.size() >= m_max_pages && !evict()) {
+		return nullptr;
+	}
+	slice_t data(s_payload_size);
+	bool missing;
+	if (!read_record(page_offset(page_id), data, missing)) {
+		syslog(LOG_ERR, "page_map::load> Unable to read index page %u", page_id);
+		return nullptr;
+	}
+	page& p = m_pages[page_id];
+	p.entries.assign(s_entries_per_page, uint32_t(s_invalid));
+	p.dirty = false;
+	if (!missing) {
+		const uint32_t* in = (const uint32_t*) data.buf();
+		for (uint64_t i = 0; i < s_entries_per_page; i++) {
+			p.entries[i] = ntohl(in[i]);
+		}
+	}
+	m_lru.push_front(page_id);
+	p.lru = m_lru.begin();
+	return &p;
+}
+
+bool page_map::evict()
+{
+	uint32_t page_id = m_lru.back();
+	page& p = m_pages[page_id];
+	if (p.dirty) {
+		slice_t data(s_payload_size);
+		uint32_t* out = (uint32_t*) data.buf();
+		for (uint64_t i = 0; i < s_entries_per_page; i++) {
+			out[i] = htonl(p.entries[i]);
+		}
+		if (!write_record(page_offset(page_id), data)) {
+			return false;
+		}
+	}
+	m_lru.pop_back();
+	m_pages.erase(page_id);
+	return true;
+}
+
+bool page_map::write_header(bool clean, uint64_t top)
+{
+	slice_t data(s_payload_size);
+	memset(data.buf(), 0, data.size());
+	index_header* hdr = (index_header*) data.buf();
+	hdr->clean = htonl(clean ? 1 : 0);
+	hdr->entries = htonl(m_entries);
+	hdr->physical_size = htonl(m_physical_size);
+	hdr->top_hi = htonl(top >> 32);
+	hdr->top_lo = htonl(top & 0xffffffff);
+	hdr->epoch_hi = htonl(m_epoch >> 32);
+	hdr->epoch_lo = htonl(m_epoch & 0xffffffff);
+	return write_record(s_record_size, data);
+}
+
+bool page_map::write_record(off_t offset, const rslice_t& data)
+{
+	if (m_next_iv % s_ivs_per_epoch == 0) {
+		// Used up this epoch's IVs, move to the next one and record that first
+		m_epoch++;
+		m_next_iv = m_epoch * s_ivs_per_epoch + 1;
+		if (!write_header(false, 0)) {
+			return false;
+		}
+	}
+	uint64_t iv = m_next_iv++;
+	slice_t rec(s_iv_size);
+	put_u64(rec.buf(), iv);
+	rec.append(m_cipher_ctx.encrypt_and_sign(iv, data));
+	if (!pwrite_fully(m_fd, rec.buf(), rec.size(), offset)) {
+		syslog(LOG_ERR, "page_map> Unable to write index record: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool page_map::read_record(off_t offset, slice_t& data, bool& missing)
+{
+	missing = false;
+	struct stat st;
+	if (fstat(m_fd, &st) != 0) {
+		return false;
+	}
+	if (offset + off_t(s_record_size) > st.st_size) {
+		missing = true;
+		return true;
+	}
+	slice_t rec(s_record_size);
+	if (!pread_fully(m_fd, rec.buf(), rec.size(), offset)) {
+		return false;
+	}
+	uint64_t iv = get_u64(rec.buf());
+	if (iv == 0) {
+		missing = true;
+		return true;
+	}
+	return m_cipher_ctx.decrypt_and_verify(iv, data, rec.hrest(s_iv_size));
+}
+
+off_t page_map::page_offset(uint32_t page_id)
+{
+	uint64_t bit_records = (uint64_t(m_physical_size) + s_bits_per_record - 1) / s_bits_per_record;
+	return (2 + bit_records + page_id) * s_record_size;
+}
@@ -0,0 +1,73 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "cipher.h"
+#include <unordered_map>
+
+// A vector of uint32_t entries kept in an encrypted, paged index file
+// Only recently used pages stay in memory, dirty pages are written back on
+// eviction, and a clean close records which log position the index matches
+class page_map
+{
+public:
+	// Entries are all s_invalid until set, budget is in bytes of cached pages
+	page_map(const cipher_key_t& key, uint32_t entries, size_t budget);
+	~page_map();
+
+	// Open (or create) the index in dir.  It is current if it was closed cleanly
+	// at log position top, then in_use_out gets the saved in-use bits.
+	// Otherwise the index is reset, all entries are invalid again.
+	bool open(const string& dir, uint32_t physical_size, uint64_t top, bool& current_out, vector<uint64_t>& in_use_out);
+	// Read and write entries, false on I/O or crypto errors
+	bool get(uint32_t which, uint32_t& value_out);
+	bool set(uint32_t which, uint32_t value);
+	// Write back all pages and mark the index clean as of log position top
+	bool close(uint64_t top, const vector<uint64_t>& in_use);
+
+	static const uint32_t s_invalid = -1;
+
+private:
+	struct page
+	{
+		vector<uint32_t>         entries;
+		bool                     dirty;
+		list<uint32_t>::iterator lru;
+	};
+
+	bool reset();
+	page* load(uint32_t page_id);
+	bool evict();
+	bool write_header(bool clean, uint64_t top);
+	bool write_record(off_t offset, const rslice_t& data);
+	bool read_record(off_t offset, slice_t& data, bool& missing);
+	off_t page_offset(uint32_t page_id);
+
+private:
+	cipher_key_t m_key;
+	cipher_ctx_t m_cipher_ctx;
+	uint32_t     m_entries;
+	uint32_t     m_physical_size;
+	size_t       m_max_pages;
+	int          m_fd;
+	uint64_t     m_epoch;
+	uint64_t     m_next_iv;
+	std::unordered_map<uint32_t, page> m_pages;
+	list<uint32_t> m_lru;  // Most recently used first
+};
@@ -0,0 +1,117 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "read_cache.h"
+
+const uint32_t read_cache::s_min_window;
+
+void read_cache::configure(uint32_t max_window)
+{
+	m_max_window = max_window;
+	m_max_blocks = size_t(max_window) * 4;
+	clear();
+}
+
+bool read_cache::take(uint32_t logical, rslice_t& data_out)
+{
+	auto it = m_blocks.find(logical);
+	if (it == m_blocks.end()) {
+		return false;
+	}
+	data_out = it->second.data;
+	m_lru.erase(it->second.lru);
+	m_blocks.erase(it);
+	return true;
+}
+
+void read_cache::put(uint32_t logical, const rslice_t& data)
+{
+	if (m_max_blocks == 0) {
+		return;
+	}
+	invalidate(logical);
+	while (m_blocks.size() >= m_max_blocks) {
+		m_blocks.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+	m_lru.push_front(logical);
+	entry& e = m_blocks[logical];
+	e.data = data;
+	e.lru = m_lru.begin();
+}
+
+void read_cache::invalidate(uint32_t logical)
+{
+	auto it = m_blocks.find(logical);
+	if (it != m_blocks.end()) {
+		m_lru.erase(it->second.lru);
+		m_blocks.erase(it);
+	}
+}
+
+void read_cache::clear()
+{
+	m_blocks.clear();
+	m_lru.clear();
+	for (stream& s : m_streams) {
+		s = stream();
+	}
+}
+
+bool read_cache::note_read(uint32_t logical, uint32_t limit, uint32_t& first_out, uint32_t& count_out)
+{
+	if (m_max_window == 0) {
+		return false;
+	}
+	m_clock++;
+	// Find the stream this read continues, or take over the stalest one
+	stream* s = NULL;
+	stream* oldest = &m_streams[0];
+	for (stream& candidate : m_streams) {
+		if (candidate.run && logical + s_slop >= candidate.next && logical <= candidate.next + s_slop) {
+			s = &candidate;
+			break;
+		}
+		if (candidate.used < oldest->used) {
+			oldest = &candidate;
+		}
+	}
+	if (s == NULL) {
+		s = oldest;
+		*s = stream();
+		s->next = logical;
+		s->ahead = logical;
+		s->window = std::min(s_min_window, m_max_window);
+	}
+	s->used = m_clock;
+	s->run++;
+	s->next = std::max(s->next, logical + 1);
+	s->ahead = std::max(s->ahead, s->next);
+	if (s->run < s_min_run || s->ahead - s->next > s->window / 2) {
+		return false;
+	}
+	// Running low, top it up to a full window, a longer one each time
+	s->window = std::min(s->window * 2, m_max_window);
+	uint32_t end = uint32_t(std::min(uint64_t(s->next) + s->window, uint64_t(limit)));
+	if (end <= s->ahead) {
+		return false;
+	}
+	first_out = s->ahead;
+	count_out = end - s->ahead;
+	s->ahead = end;
+	return true;
+}
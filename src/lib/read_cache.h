@@ -0,0 +1,75 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "slice.h"
+#include <unordered_map>
+
+// Blocks read ahead of sequential readers, kept until they are read or pushed
+// out by newer ones.  It also spots the sequential streams and decides what to
+// read next.  Not thread safe, block_map keeps it under its lock.
+class read_cache
+{
+public:
+	// Windows grow up to max_window blocks, 0 turns readahead off.  The cache
+	// holds a few windows worth, for a few streams at once.
+	void configure(uint32_t max_window);
+	bool enabled() const { return m_max_window != 0; }
+
+	// Takes a block out of the cache, each one is read once
+	bool take(uint32_t logical, rslice_t& data_out);
+	bool contains(uint32_t logical) const { return m_blocks.count(logical) != 0; }
+	void put(uint32_t logical, const rslice_t& data);
+	// The block was written, forget any old copy
+	void invalidate(uint32_t logical);
+	void clear();
+
+	// Notes a user read of logical.  Returns true with the range to read ahead
+	// when a sequential stream gets within half a window of what was read for
+	// it so far.  Nothing past limit is asked for.
+	bool note_read(uint32_t logical, uint32_t limit, uint32_t& first_out, uint32_t& count_out);
+
+private:
+	struct entry
+	{
+		rslice_t                 data;
+		list<uint32_t>::iterator lru;
+	};
+
+	struct stream
+	{
+		uint32_t next = 0;    // Where the stream is expected to read next
+		uint32_t ahead = 0;   // First block not asked for yet
+		uint32_t window = 0;  // Blocks to keep asked for ahead of next
+		uint32_t run = 0;     // Sequential reads so far
+		uint64_t used = 0;    // For replacing the least recently used stream
+	};
+
+	static const uint32_t s_streams = 8;
+	static const uint32_t s_min_window = 32;
+	static const uint32_t s_min_run = 4;    // Reads in a row before reading ahead
+	static const uint32_t s_slop = 64;      // Concurrent requests arrive a bit out of order
+
+	uint32_t       m_max_window = 0;
+	size_t         m_max_blocks = 0;
+	std::unordered_map<uint32_t, entry> m_blocks;
+	list<uint32_t> m_lru;  // Most recently added first
+	stream         m_streams[s_streams];
+	uint64_t       m_clock = 0;
+};
@@ -16,32 +16,75 @@
  */
 
 #include "slice.h"
+#include "buffer_pool.h"
 #include <assert.h>
+#include <atomic>
+#include <new>
 
+// The header sits right in front of the data, in one pool allocation
 struct slice_t::buffer
 {
-	uint32_t ref_count;
+	std::atomic<uint32_t> ref_count;
 	uint32_t capacity; 
 	char*    buf;
+	bool     external;  // A view of someone else's memory, only the header is ours
+	bool     confined;  // Never shared between threads, so counting can skip atomics
 };
 
+// Keeps the data 16 byte aligned
+const uint32_t slice_t::s_header_size = (sizeof(slice_t::buffer) + 15) & ~15;
+
+slice_t::buffer* slice_t::new_buffer(uint32_t capacity, bool confined)
+{
+	uint32_t alloc_size;
+	char* mem = pool_alloc(s_header_size + capacity, alloc_size);
+	buffer* base = new (mem) buffer;
+	base->ref_count.store(1, std::memory_order_relaxed);
+	base->capacity = alloc_size - s_header_size;
+	base->buf = mem + s_header_size;
+	base->external = false;
+	base->confined = confined;
+	return base;
+}
+
+void slice_t::ref(buffer* base)
+{
+	if (base->confined) {
+		base->ref_count.store(base->ref_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	} else {
+		base->ref_count.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void slice_t::unref(buffer* base)
+{
+	uint32_t left;
+	if (base->confined) {
+		left = base->ref_count.load(std::memory_order_relaxed) - 1;
+		base->ref_count.store(left, std::memory_order_relaxed);
+	} else if (base->ref_count.load(std::memory_order_acquire) == 1) {
+		left = 0;  // The only reference is ours, so nobody else can change the count
+	} else {
+		left = base->ref_count.fetch_sub(1, std::memory_order_acq_rel) - 1;
+	}
+	if (left == 0) {
+		uint32_t alloc_size = base->external ? sizeof(buffer) : s_header_size + base->capacity;
+		base->~buffer();
+		pool_free((char*) base, alloc_size);
+	}
+}
+
 slice_t::slice_t(const char* buf)
-	: m_base(new buffer)
+	: m_base(new_buffer(strlen(buf)))
 	, m_size(strlen(buf))
 {
-	m_base->ref_count = 1;
-	m_base->capacity = m_size;
-	m_base->buf = new char[m_base->capacity];
 	memcpy(m_base->buf, buf, m_size);
 }
 
 slice_t::slice_t(const char* buf, uint32_t size)
-	: m_base(new buffer)
+	: m_base(new_buffer(size))
 	, m_size(size)
 {
-	m_base->ref_count = 1;
-	m_base->capacity = m_size;
-	m_base->buf = new char[m_base->capacity];
 	memcpy(m_base->buf, buf, m_size);
 }
 
@@ -50,22 +93,42 @@ slice_t::slice_t(const rslice_t& rhs)
 {}
 
 slice_t::slice_t(uint32_t size, uint32_t tail)
-	: m_base(new buffer)
+	: m_base(new_buffer(size + tail))
 	, m_size(size)
 {
-	m_base->ref_count = 1;
-	m_base->capacity = size + tail;
-	m_base->buf = new char[m_base->capacity];		
 	memset(m_base->buf, 0, m_size);
 }
 
+slice_t slice_t::local(uint32_t size)
+{
+	slice_t r;
+	r.m_base = new_buffer(size, true);
+	r.m_size = size;
+	memset(r.m_base->buf, 0, size);
+	return r;
+}
+
+slice_t slice_t::wrap(char* buf, uint32_t size)
+{
+	uint32_t alloc_size;
+	slice_t r;
+	r.m_base = new (pool_alloc(sizeof(buffer), alloc_size)) buffer;
+	r.m_base->ref_count.store(1, std::memory_order_relaxed);
+	r.m_base->capacity = size;  // So add_tail always moves to an owned buffer
+	r.m_base->buf = buf;
+	r.m_base->external = true;
+	r.m_base->confined = false;
+	r.m_size = size;
+	return r;
+}
+
 slice_t::slice_t(const slice_t& rhs)
 	: m_base(rhs.m_base)
 	, m_offset(rhs.m_offset)
 	, m_size(rhs.m_size)
 {
 	if (m_base) {
-		m_base->ref_count++;
+		slice_t::ref(m_base);
 	}
 }
 
@@ -89,13 +152,8 @@ slice_t& slice_t::operator=(slice_t rhs)
 
 slice_t::~slice_t()
 {
-	if (!m_base) {
-		return;
-	}
-	m_base->ref_count--;
-	if (m_base->ref_count == 0) {
-		delete[] m_base->buf;
-		delete m_base;
+	if (m_base) {
+		unref(m_base);
 	}
 }
 
@@ -115,7 +173,7 @@ static uint32_t nearest_power_of_two(uint32_t size)
 
 void slice_t::add_tail(uint32_t size)
 {
-	if (m_base && m_base->ref_count == 1 && 
+	if (m_base && m_base->ref_count.load(std::memory_order_acquire) == 1 && 
 		m_base->capacity - (m_offset + m_size) >= size) {
 		m_size += size;
 	} else {	
@@ -207,17 +265,23 @@ rslice_t::rslice_t(const slice_t& rhs)
 	, m_size(rhs.m_size)
 {
 	if (m_base) {
-		m_base->ref_count++;
+		slice_t::ref(m_base);
 	}
 }
 
+rslice_t rslice_t::wrap(const char* buf, uint32_t size)
+{
+	// Nothing writes through an rslice, so dropping const is fine
+	return slice_t::wrap(const_cast<char*>(buf), size);
+}
+
 rslice_t::rslice_t(const rslice_t& rhs)
 	: m_base(rhs.m_base)
 	, m_offset(rhs.m_offset)
 	, m_size(rhs.m_size)
 {
 	if (m_base) {
-		m_base->ref_count++;
+		slice_t::ref(m_base);
 	}
 }
 
@@ -241,13 +305,8 @@ rslice_t& rslice_t::operator=(rslice_t rhs)
 
 rslice_t::~rslice_t()
 {
-	if (!m_base) {
-		return;
-	}
-	m_base->ref_count--;
-	if (m_base->ref_count == 0) {
-		delete[] m_base->buf;
-		delete m_base;
+	if (m_base) {
+		slice_t::unref(m_base);
 	}
 }
 
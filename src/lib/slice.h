@@ -36,6 +36,11 @@ public:
 
 	// Make a slice of 'size' bytes, with possible additional capacity
 	slice_t(uint32_t size, uint32_t tail = 0);
+	// Make a zeroed slice that will never be shared with another thread, which
+	// makes copies cheaper.  Only for scratch buffers that never escape.
+	static slice_t local(uint32_t size);
+	// Make a view of someone else's buffer, no copy, buf must outlive every copy
+	static slice_t wrap(char* buf, uint32_t size);
 
 	// Standard c++ memory management goo
 	slice_t(const slice_t& rhs);
@@ -70,6 +75,12 @@ public:
 
 private:
 	struct buffer;
+	static const uint32_t s_header_size;
+	// Headers and data share one allocation from the buffer pool
+	static buffer* new_buffer(uint32_t capacity, bool confined = false);
+	static void ref(buffer* base);
+	static void unref(buffer* base);
+
 	buffer*  m_base = nullptr;
 	uint32_t m_offset = 0;
 	uint32_t m_size = 0;
@@ -82,6 +93,8 @@ public:
 	rslice_t() = default;
 	// Make a read only view of a slice
 	rslice_t(const slice_t& rhs);
+	// Make a read only view of someone else's buffer, as slice_t::wrap
+	static rslice_t wrap(const char* buf, uint32_t size);
 
 	// Standard c++ memory management goo
 	rslice_t(const rslice_t& rhs);
@@ -0,0 +1,96 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+
+static const char* const s_names[stat_count] = {
+	"user_writes",
+	"user_reads",
+	"relocations",
+	"blocks_appended",
+	"bytes_appended",
+	"chunks_created",
+	"chunks_removed",
+	"chunk_opens",
+	"cache_hits",
+	"cache_misses",
+	"flushes",
+	"syncs",
+	"readahead_blocks",
+	"readahead_hits",
+	"mirror_bytes",
+};
+
+struct local_stats;
+
+static std::mutex s_stats_lock;
+static std::set<local_stats*> s_threads;
+static stat_totals_t s_retired;  // Left behind by threads that exited
+
+// Only the owning thread writes, so relaxed load and store is enough to
+// keep readers from seeing torn values, and costs the same as a plain add
+struct local_stats
+{
+	std::atomic<uint64_t> counts[stat_count];
+
+	local_stats()
+	{
+		for (auto& c : counts) {
+			c.store(0, std::memory_order_relaxed);
+		}
+		std::lock_guard<std::mutex> lock(s_stats_lock);
+		s_threads.insert(this);
+	}
+
+	~local_stats()
+	{
+		std::lock_guard<std::mutex> lock(s_stats_lock);
+		for (size_t i = 0; i < stat_count; i++) {
+			s_retired[i] += counts[i].load(std::memory_order_relaxed);
+		}
+		s_threads.erase(this);
+	}
+};
+
+static thread_local local_stats t_stats;
+
+void stat_add(stat_counter which, uint64_t n)
+{
+	std::atomic<uint64_t>& c = t_stats.counts[which];
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+stat_totals_t stat_totals()
+{
+	std::lock_guard<std::mutex> lock(s_stats_lock);
+	stat_totals_t r = s_retired;
+	for (local_stats* ls : s_threads) {
+		for (size_t i = 0; i < stat_count; i++) {
+			r[i] += ls->counts[i].load(std::memory_order_relaxed);
+		}
+	}
+	return r;
+}
+
+const char* stat_name(stat_counter which)
+{
+	return s_names[which];
+}
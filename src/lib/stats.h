@@ -0,0 +1,52 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "types.h"
+
+// Event counters for the block layers, for sizing disks and tuning the cleaner
+// Each thread bumps its own copy without any locked instruction, and readers
+// sum over all threads, including those that have already exited
+enum stat_counter
+{
+	stat_user_writes,      // Blocks written by users
+	stat_user_reads,       // Blocks read by users, snapshots included
+	stat_relocations,      // Blocks moved to the top of the log by the cleaner
+	stat_blocks_appended,  // Blocks written to the log, user writes plus relocations
+	stat_bytes_appended,   // Bytes written to the log, encryption and footers included
+	stat_chunks_created,   // Chunk files started
+	stat_chunks_removed,   // Chunk files dropped off the back of the ring
+	stat_chunk_opens,      // Sealed chunk files opened for reads, misses in the fd cache
+	stat_cache_hits,       // Index page lookups served from memory
+	stat_cache_misses,     // Index page lookups that had to read the index file
+	stat_flushes,          // Flush requests, from users or write-through
+	stat_syncs,            // Group commits that actually synced, one can serve many flushes
+	stat_readahead_blocks, // Blocks read and decrypted ahead of sequential readers
+	stat_readahead_hits,   // User reads served from blocks read ahead
+	stat_mirror_bytes,     // Bytes copied to mirror targets, reflinks included
+	stat_count
+};
+
+typedef array<uint64_t, stat_count> stat_totals_t;
+
+// Count n events on the calling thread
+void stat_add(stat_counter which, uint64_t n = 1);
+// Totals over all threads so far
+stat_totals_t stat_totals();
+// Short name of a counter, for rendering
+const char* stat_name(stat_counter which);
@@ -0,0 +1,122 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <syslog.h>
+
+static const char s_magic[8] = { 'S', 'D', 'T', 'R', 'A', 'C', 'E', '1' };
+static const size_t s_record_size = 24;
+
+static void put_be(byte* buf, uint64_t x, int size)
+{
+	for (int i = size - 1; i >= 0; i--) {
+		buf[i] = byte(x);
+		x >>= 8;
+	}
+}
+
+static uint64_t get_be(const byte* buf, int size)
+{
+	uint64_t x = 0;
+	for (int i = 0; i < size; i++) {
+		x = (x << 8) | buf[i];
+	}
+	return x;
+}
+
+bool trace_writer::open(const string& path)
+{
+	close();
+	m_file = fopen(path.c_str(), "w");
+	if (m_file == nullptr) {
+		syslog(LOG_ERR, "trace_writer::open> Unable to open %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	if (fwrite(s_magic, sizeof(s_magic), 1, m_file) != 1) {
+		syslog(LOG_ERR, "trace_writer::open> Unable to write %s", path.c_str());
+		close();
+		return false;
+	}
+	m_start = now_nsecs();
+	return true;
+}
+
+void trace_writer::record(uint8_t op, uint64_t offset, uint32_t length)
+{
+	byte buf[s_record_size] = { 0 };
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_file == nullptr) {
+		return;
+	}
+	put_be(buf, now_nsecs() - m_start, 8);
+	put_be(buf + 8, offset, 8);
+	put_be(buf + 16, length, 4);
+	buf[20] = op;
+	if (fwrite(buf, sizeof(buf), 1, m_file) != 1) {
+		// Tracing is best effort, don't fail the I/O over it
+		syslog(LOG_ERR, "trace_writer::record> Write failed, tracing stopped");
+		fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+void trace_writer::close()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_file) {
+		fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+trace_reader::~trace_reader()
+{
+	if (m_file) {
+		fclose(m_file);
+	}
+}
+
+bool trace_reader::open(const string& path)
+{
+	m_file = fopen(path.c_str(), "r");
+	if (m_file == nullptr) {
+		fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	char magic[sizeof(s_magic)];
+	if (fread(magic, sizeof(magic), 1, m_file) != 1 || memcmp(magic, s_magic, sizeof(magic)) != 0) {
+		fprintf(stderr, "Not a trace file: %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool trace_reader::next(trace_record& out)
+{
+	byte buf[s_record_size];
+	if (fread(buf, sizeof(buf), 1, m_file) != 1) {
+		return false;
+	}
+	out.nsecs = get_be(buf, 8);
+	out.offset = get_be(buf + 8, 8);
+	out.length = uint32_t(get_be(buf + 16, 4));
+	out.op = buf[20];
+	return true;
+}
@@ -0,0 +1,68 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "types.h"
+#include <stdio.h>
+#include <mutex>
+
+// A compact binary record of block requests, for replaying real workloads
+// The file is an 8 byte magic followed by fixed size big endian records
+
+enum trace_op
+{
+	trace_read = 0,
+	trace_write = 1,
+};
+
+// One request, offset and length in bytes
+struct trace_record
+{
+	uint64_t nsecs;  // Since the trace started
+	uint64_t offset;
+	uint32_t length;
+	uint8_t  op;
+};
+
+class trace_writer
+{
+public:
+	~trace_writer() { close(); }
+
+	bool open(const string& path);
+	// Safe to call from many threads
+	void record(uint8_t op, uint64_t offset, uint32_t length);
+	void close();
+
+private:
+	std::mutex m_lock;
+	FILE*      m_file = nullptr;
+	uint64_t   m_start = 0;
+};
+
+class trace_reader
+{
+public:
+	~trace_reader();
+
+	bool open(const string& path);
+	// False at the end of the trace
+	bool next(trace_record& out);
+
+private:
+	FILE* m_file = nullptr;
+};
@@ -19,6 +19,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+#include <algorithm>
 
 bool write_fully(int fd, const char* buf, int size)
 {
@@ -52,4 +57,106 @@ bool read_fully(int fd, char* buf, int size)
 	return true;
 }
 
+bool pwrite_fully(int fd, const char* buf, int size, off_t offset)
+{
+	while (size) {
+		int r = pwrite(fd, buf, size, offset);
+		if (r < 0 && errno == EAGAIN) {
+			continue;
+		}
+		if (r <= 0) {
+			return false;
+		}
+		size -= r;
+		buf += r;
+		offset += r;
+	}	
+	return true;
+}
 
+bool pread_fully(int fd, char* buf, int size, off_t offset)
+{
+	while (size) {
+		int r = pread(fd, buf, size, offset);
+		if (r < 0 && errno == EAGAIN) {
+			continue;
+		}
+		if (r <= 0) {
+			return false;
+		}
+		size -= r;
+		buf += r;
+		offset += r;
+	}	
+	return true;
+}
+
+bool parse_size(const string& text, uint64_t& size_out)
+{
+	char* suffix;
+	uint64_t size = strtoull(text.c_str(), &suffix, 10);
+	switch (*suffix) {
+	case 'G': size *= 1024;  // Fall through
+	case 'M': size *= 1024;  // Fall through
+	case 'K': size *= 1024; suffix++; break;
+	}
+	if (text.empty() || *suffix != 0) {
+		return false;
+	}
+	size_out = size;
+	return true;
+}
+
+uint64_t now_nsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+bool read_password(string& pass, bool confirm)
+{
+	if (isatty(0)) {
+		char* p = getpass("Password: ");
+		if (p == NULL) {
+			return false;
+		}
+		pass = p;
+		if (!confirm) {
+			return true;
+		}
+		p = getpass("Again: ");
+		if (p == NULL || pass != p) {
+			fprintf(stderr, "Passwords don't match\n");
+			return false;
+		}
+		return true;
+	}
+	char line[1024];
+	if (fgets(line, sizeof(line), stdin) == NULL) {
+		return false;
+	}
+	pass = line;
+	while (!pass.empty() && (pass.back() == '\n' || pass.back() == '\r')) {
+		pass.pop_back();
+	}
+	return true;
+}
+
+bool list_chunks(const string& dir, vector<uint64_t>& out)
+{
+	out.clear();
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL) {
+		return false;
+	}
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (memcmp(de->d_name, "file_", 5) == 0) {
+			out.push_back(strtoull(de->d_name + 5, NULL, 10));
+		}
+	}
+	closedir(d);
+	std::sort(out.begin(), out.end());
+	return true;
+}
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "types.h"
+#include <sys/types.h>
 
 // Does a write until all data is written or error
 bool write_fully(int fd, const char* buf, int size);
@@ -25,3 +26,19 @@ bool write_fully(int fd, const char* buf, int size);
 // Does a read until all data is read or error
 bool read_fully(int fd, char* buf, int size);
 
+// Positioned versions of the above, leave the file offset alone
+bool pwrite_fully(int fd, const char* buf, int size, off_t offset);
+bool pread_fully(int fd, char* buf, int size, off_t offset);
+
+// Parses a byte count, which may end in K, M or G
+bool parse_size(const string& text, uint64_t& size_out);
+
+// Monotonic clock, in nanoseconds
+uint64_t now_nsecs();
+
+// Reads a password from the terminal, or a line of stdin when that isn't one,
+// a new one is asked for twice on a terminal
+bool read_password(string& pass, bool confirm = false);
+
+// Chunk numbers of the file_N entries in a block directory, oldest first
+bool list_chunks(const string& dir, vector<uint64_t>& out);
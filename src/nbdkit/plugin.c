@@ -27,17 +27,34 @@
 
 static const uint64_t block_size = 1024;
 
-extern void* open_block_map(const char* dir, uint32_t blocks, const char* key);
+extern void* create_volumes_block_map(
+	const char* dir, uint32_t count, const char* const* names, const uint32_t* blocks, const char* key,
+	const char* options);
+extern void* open_options_block_map(const char* dir, const char* key, const char* options);
 extern void close_block_map(void* bm);
-extern int64_t size_block_map(void* bm);
 extern int read_block_map(void* bm, uint32_t block, char* buf);
 extern int write_block_map(void* bm, uint32_t block, const char* buf);
+extern int write_done_block_map(void* bm, int fua);
+extern int flush_block_map(void* bm);
+extern int list_volume_block_map(void* bm, uint32_t which, char* name_out, size_t size);
+extern int find_volume_block_map(void* bm, const char* name, uint32_t* base, uint32_t* blocks);
+extern void trace_block_map(void* bm, int op, uint64_t offset, uint32_t length);
+extern size_t stats_block_map(void* bm, char* buf, size_t size);
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
 
 uint32_t size = 0;
 static const char* dir = NULL;
 static const char* key= NULL;
+static void* bm = NULL;
+static char options[1024] = "";  // Other keys, passed on as container options
+
+// Each connection serves one volume, picked by export name
+struct handle
+{
+	uint32_t base;
+	uint32_t blocks;
+};
 
 static int safedisk_config(const char *k, const char *v)
 {
@@ -52,8 +69,16 @@ static int safedisk_config(const char *k, const char *v)
 			return -1;
 		}
 	} else {
-		nbdkit_error("Unknown config key");
-		return -1;
+		if (strlen(options) + strlen(k) + strlen(v) + 2 >= sizeof(options)) {
+			nbdkit_error("Too many options");
+			return -1;
+		}
+		if (*options) {
+			strcat(options, ",");
+		}
+		strcat(options, k);
+		strcat(options, "=");
+		strcat(options, v);
 	}
 	return 0;
 }
@@ -68,35 +93,74 @@ static int safedisk_config_complete(void)
 		nbdkit_error("'key' parameter required");
 		return -1;
 	}
-	if (size == 0) {
-		nbdkit_error("'size' parameter required");
-		return -1;
-	}
 
 	dir = nbdkit_absolute_path(dir);
 	if (dir == NULL) {
 		return -1;
 	}
-	mkdir(dir, 0700);
+	// All connections share one container, make it on first use
+	struct stat st;
+	if (stat(dir, &st) == 0) {
+		bm = open_options_block_map(dir, key, options);
+	} else if (size) {
+		const char* name = "data";
+		uint32_t blocks = size * 1024;
+		bm = create_volumes_block_map(dir, 1, &name, &blocks, key, options);
+	} else {
+		nbdkit_error("'size' parameter required to create a new container");
+		return -1;
+	}
+	if (bm == NULL) {
+		nbdkit_error("Unable to open container");
+		return -1;
+	}
 	return 0;
 }
 
+static void safedisk_unload(void)
+{
+	if (bm) {
+		// Runtime counters for the whole run, see with nbdkit -v
+		char text[4096];
+		stats_block_map(bm, text, sizeof(text));
+		nbdkit_debug("%s", text);
+		close_block_map(bm);
+	}
+}
+
 static void* safedisk_open(int readonly)
 {
 	nbdkit_debug("In open\n");
-	return open_block_map(dir, size * 1024, key);
+	struct handle* h = malloc(sizeof(struct handle));
+	if (h == NULL) {
+		return NULL;
+	}
+	// The default export is the first volume
+	char first[64];
+	const char* name = nbdkit_export_name();
+	if (name == NULL || *name == 0) {
+		list_volume_block_map(bm, 0, first, sizeof(first));
+		name = first;
+	}
+	if (!find_volume_block_map(bm, name, &h->base, &h->blocks)) {
+		nbdkit_error("No such volume: %s", name);
+		free(h);
+		return NULL;
+	}
+	return h;
 }
 
 static void safedisk_close(void *handle)
 {
 	nbdkit_debug("In close\n");
-	close_block_map(handle);	
+	free(handle);
 }
 
 static int64_t safedisk_get_size(void *handle)
 {
 	nbdkit_debug("In get_size\n");
-	return size_block_map(handle);	
+	struct handle* h = handle;
+	return h->blocks * block_size;
 }
 
 static int safedisk_pread(void *handle, void *buf, uint32_t count, uint64_t offset)
@@ -105,11 +169,13 @@ static int safedisk_pread(void *handle, void *buf, uint32_t count, uint64_t offs
 	nbdkit_debug("count = %d, offset = %d\n", count, (int) offset);
 	assert(count % block_size == 0);
 	assert(offset % block_size == 0);
+	struct handle* h = handle;
+	trace_block_map(bm, 0, h->base * block_size + offset, count);
 	count /= block_size;
 	offset /= block_size;
 	uint32_t block;
 	for(block = 0; block < count; block++) {
-		if (!read_block_map(handle, offset + block, ((char*) buf) + block * block_size)) {
+		if (!read_block_map(bm, h->base + offset + block, ((char*) buf) + block * block_size)) {
 			return -1;
 		}
 	}
@@ -123,32 +189,51 @@ static int safedisk_pwrite(void *handle, const void *buf, uint32_t count, uint64
 	nbdkit_debug("count = %d, offset = %d\n", count, (int) offset);
 	assert(count % block_size == 0);
 	assert(offset % block_size == 0);
+	struct handle* h = handle;
+	trace_block_map(bm, 1, h->base * block_size + offset, count);
 	count /= block_size;
 	offset /= block_size;
 	uint32_t block;
 	for(block = 0; block < count; block++) {
-		if (!write_block_map(handle, offset + block, ((const char*) buf) + block * block_size)) {
+		if (!write_block_map(bm, h->base + offset + block, ((const char*) buf) + block * block_size)) {
 			return -1;
 		}
 	}
+	if (!write_done_block_map(bm, 0)) {
+		return -1;
+	}
 	nbdkit_debug("Done\n");
 	return 0;
 }
 
+static int safedisk_can_flush(void *handle)
+{
+	return 1;
+}
+
+// Also serves FUA, which nbdkit turns into a flush after the write
+static int safedisk_flush(void *handle)
+{
+	nbdkit_debug("In flush\n");
+	return flush_block_map(bm) ? 0 : -1;
+}
+
 static struct nbdkit_plugin plugin = {
    .name              = "safedisk",
    .version           = "0.0.1",
    .longname          = "safedisk",
    .description       = "Full disk encryption with backup",
-   .config_help       = "dir=<directory for files> size=<size in MBs> key=<cipher key>",
+   .config_help       = "dir=<directory for files> size=<size in MBs, to create> key=<cipher key> [map_budget=<bytes>] [trace=<file>] [slow_ms=<ms>] [latency_secs=<secs>] [durability=none|flush|sync] [open_chunks=<n>] [readahead=<bytes>] [mirror=<dir>[:<dir>...]] [kdf_ms=<ms>] [kdf_memory=<bytes>], export name picks the volume",
    .config            = safedisk_config,
    .config_complete   = safedisk_config_complete,
+   .unload            = safedisk_unload,
    .open              = safedisk_open,
    .close             = safedisk_close,
    .get_size          = safedisk_get_size,
    .pread             = safedisk_pread,
    .pwrite            = safedisk_pwrite,
+   .can_flush         = safedisk_can_flush,
+   .flush             = safedisk_flush,
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
-
@@ -16,17 +16,27 @@
  */
 
 #include "block_map.h"
+#include "stats.h"
+#include "digest.h"
 #include <assert.h>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <set>
 
 class check_block_map 
 {
 public:
-	check_block_map(uint32_t size, const string& dir)
+	check_block_map(uint32_t size, const string& dir, size_t map_budget = 0, size_t open_chunks = s_default_open_chunks)
 		: m_size(size)
 		, m_dir(dir)
+		, m_map_budget(map_budget)
+		, m_open_chunks(open_chunks)
 		, m_key(slice_t("HelloWorldHelloWorldHelloWorld12"))
 	{
-		m_block_map = make_unique<block_map>(m_key, size);
+		m_block_map = make_unique<block_map>(m_key, size, map_budget, open_chunks);
 		assert(m_block_map->open(dir));
 	}
 
@@ -42,6 +52,25 @@ public:
 		m_check[logical] = data;
 	}
 
+	// Bulk load blocks that were never written, as safedisk-import does
+	void append(uint32_t first, uint32_t count)
+	{
+		vector<uint32_t> logical;
+		slice_t blocks(count * s_bytes_per_block);
+		for (uint32_t i = 0; i < count; i++) {
+			slice_t data(s_bytes_per_block);
+			for (size_t j = 0; j < s_bytes_per_block; j++) {
+				data[j] = random();
+			}
+			memcpy(blocks.buf() + i * s_bytes_per_block, data.buf(), s_bytes_per_block);
+			logical.push_back(first + i);
+			m_check[first + i] = data;
+		}
+		uint64_t physical = m_block_map->top();
+		slice_t records = m_block_map->encrypt_run(physical, logical, blocks);
+		assert(m_block_map->append_run(physical, logical, records));
+	}
+
 	void read(uint32_t logical) 
 	{
 		//printf("Reading from %d\n", (int) logical);
@@ -58,22 +87,486 @@ public:
 		rslice_t proper;
 		assert(m_block_map->read(logical, proper));
 		assert(proper == check);
+		// And straight into an outside buffer
+		char buf[s_bytes_per_block];
+		memset(buf, 0xff, sizeof(buf));
+		assert(m_block_map->read_into(logical, slice_t::wrap(buf, sizeof(buf))));
+		assert(rslice_t::wrap(buf, sizeof(buf)) == check);
+	}
+
+	void read_range(uint32_t first, uint32_t count)
+	{
+		slice_t buf(count * s_bytes_per_block);
+		assert(m_block_map->read_range(first, count, buf));
+		for (uint32_t i = 0; i < count; i++) {
+			auto it = m_check.find(first + i);
+			rslice_t got = buf.slice(i * s_bytes_per_block, s_bytes_per_block);
+			if (it == m_check.end()) {
+				slice_t empty(s_bytes_per_block);
+				memset(empty.buf(), 0, s_bytes_per_block);
+				assert(got == empty);
+			} else {
+				assert(got == it->second);
+			}
+		}
+	}
+
+	void snapshot(const string& name)
+	{
+		assert(m_block_map->snapshot(name));
+		m_snaps[name] = m_check;
+	}
+
+	void read_snapshot(const string& name, uint32_t logical)
+	{
+		auto& snap = m_snaps[name];
+		auto it = snap.find(logical);
+		rslice_t check;
+		if (it == snap.end()) {
+			slice_t empty(s_bytes_per_block);
+			memset(empty.buf(), 0, s_bytes_per_block);
+			check = empty;
+		} 
+		else {
+			check = it->second;
+		}
+		rslice_t proper;
+		assert(m_block_map->read_snapshot(name, logical, proper));
+		assert(proper == check);
+	}
+
+	void release_snapshot(const string& name)
+	{
+		assert(m_block_map->release_snapshot(name));
+		m_snaps.erase(name);
+	}
+
+	// Lose the saved index, as if the last close never happened
+	void bounce_without_index() {
+		m_block_map.reset();
+		int retcode = system(("rm " + m_dir + "/index").c_str());
+		assert(!retcode);
+		m_block_map = make_unique<block_map>(m_key, m_size, m_map_budget, m_open_chunks);
+		assert(m_block_map->open(m_dir));
+	}
+
+	void check_ring()
+	{
+		assert(m_block_map->check_ring());
 	}
 
 	void bounce() {
+		// Snapshots only live as long as the open block_map
+		m_snaps.clear();
 		m_block_map.reset();
-		m_block_map = make_unique<block_map>(m_key, m_size);
+		m_block_map = make_unique<block_map>(m_key, m_size, m_map_budget, m_open_chunks);
 		assert(m_block_map->open(m_dir));
 	}
 
 private:
 	size_t m_size;
 	string m_dir;
+	size_t m_map_budget;
+	size_t m_open_chunks;
 	cipher_key_t m_key;
 	std::map<uint32_t, rslice_t> m_check;
+	std::map<string, std::map<uint32_t, rslice_t>> m_snaps;
 	unique_ptr<block_map> m_block_map;
 };
 
+// Threads write their own blocks and flush after each one, flushes that
+// arrive while a sync is running get served by one shared sync
+static void flush_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_flush && mkdir /tmp/test_block_map_flush");
+	assert(!retcode);
+	static const uint32_t s_threads = 4;
+	static const uint32_t s_writes = 200;
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	block_map bm(key, s_threads * s_writes);
+	assert(bm.open("/tmp/test_block_map_flush"));
+	stat_totals_t before = stat_totals();
+	vector<std::thread> threads;
+	for (uint32_t t = 0; t < s_threads; t++) {
+		threads.emplace_back([&bm, t]() {
+			slice_t data(s_bytes_per_block);
+			for (uint32_t i = 0; i < s_writes; i++) {
+				memset(data.buf(), int(t * s_writes + i), data.size());
+				assert(bm.write(t * s_writes + i, data));
+				assert(bm.flush());
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	stat_totals_t after = stat_totals();
+	uint64_t flushes = after[stat_flushes] - before[stat_flushes];
+	uint64_t syncs = after[stat_syncs] - before[stat_syncs];
+	assert(flushes == s_threads * s_writes);
+	assert(syncs > 0 && syncs <= flushes);
+	rslice_t data;
+	for (uint32_t b = 0; b < s_threads * s_writes; b++) {
+		assert(bm.read(b, data));
+		assert(data[0] == char(b) && data[data.size() - 1] == char(b));
+	}
+}
+
+// Scatter most of a sequentially written disk, then keep writing only the
+// rest, the cleaner should gather the cold part back into logical order
+static void fragmentation_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_frag && mkdir /tmp/test_block_map_frag");
+	assert(!retcode);
+	static const uint32_t s_size = 2000;
+	static const uint32_t s_cold = s_size - s_size / 10;
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	block_map bm(key, s_size);
+	assert(bm.open("/tmp/test_block_map_frag"));
+	slice_t data(s_bytes_per_block);
+	memset(data.buf(), 7, data.size());
+	for (uint32_t b = 0; b < s_size; b++) {
+		assert(bm.write(b, data));
+	}
+	assert(bm.fragmentation() == 0);
+	for (uint32_t i = 0; i < 2 * s_size; i++) {
+		assert(bm.write(random() % s_cold, data));
+	}
+	double scattered = bm.fragmentation();
+	for (uint32_t i = 0; i < 10 * s_size; i++) {
+		assert(bm.write(s_cold + random() % (s_size - s_cold), data));
+	}
+	assert(bm.fragmentation() < scattered / 2);
+	// Compaction puts the whole disk back in order
+	memset(data.buf(), 9, data.size());
+	assert(bm.write(s_size / 2, data));
+	assert(bm.compact());
+	assert(bm.fragmentation() == 0);
+	rslice_t check;
+	for (uint32_t b = 0; b < s_size; b++) {
+		assert(bm.read(b, check));
+		assert(check[0] == (b == s_size / 2 ? 9 : 7));
+	}
+}
+
+// The offline checks pass a closed log, and catch a flipped bit
+static void verify_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_verify && mkdir /tmp/test_block_map_verify");
+	assert(!retcode);
+	static const uint32_t s_size = 500;
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	uint64_t top;
+	{
+		block_map bm(key, s_size);
+		assert(bm.open("/tmp/test_block_map_verify"));
+		slice_t data(s_bytes_per_block);
+		for (uint32_t i = 0; i < 3 * s_size; i++) {
+			memset(data.buf(), int(i), data.size());
+			assert(bm.write(random() % s_size, data));
+		}
+		top = bm.top();
+	}
+	cipher_ctx_t ctx(key);
+	uint64_t final_chunk = (top - 1) / (s_blocks_per_region * s_regions_per_chunk);
+	auto check = [&](uint64_t chunk) {
+		string name = "/tmp/test_block_map_verify/file_" + std::to_string(chunk);
+		int fd = open(name.c_str(), O_RDONLY);
+		assert(fd >= 0);
+		block_file::verify_result r;
+		block_file::verify_chunk_footer(ctx, fd, chunk, chunk == final_chunk, r);
+		bool final = chunk == final_chunk && !r.footer;
+		for (uint64_t region = 0; region < s_regions_per_chunk; region++) {
+			block_file::verify_region(ctx, fd, chunk, region, final, r);
+		}
+		close(fd);
+		return r;
+	};
+	uint64_t blocks = 0;
+	uint64_t first_chunk = (top - 2 * s_size) / (s_blocks_per_region * s_regions_per_chunk);
+	for (uint64_t chunk = first_chunk; chunk <= final_chunk; chunk++) {
+		block_file::verify_result r = check(chunk);
+		assert(r.problems.empty());
+		blocks += r.blocks;
+	}
+	assert(blocks == top - first_chunk * s_blocks_per_region * s_regions_per_chunk);
+	// Flip a bit in the first block of the oldest chunk
+	string name = "/tmp/test_block_map_verify/file_" + std::to_string(first_chunk);
+	int fd = open(name.c_str(), O_RDWR);
+	assert(fd >= 0);
+	char c;
+	assert(pread(fd, &c, 1, 40) == 1);
+	c ^= 1;
+	assert(pwrite(fd, &c, 1, 40) == 1);
+	close(fd);
+	assert(!check(first_chunk).problems.empty());
+}
+
+// Snapshots pin old copies, so the cleaner works with the ring nearly full,
+// the moves must never land on blocks still in use
+static void snapshot_pressure_test()
+{
+	for (uint32_t seed = 1; seed <= 4; seed++) {
+		srandom(seed);
+		int retcode = system("rm -rf /tmp/test_block_map_pressure && mkdir /tmp/test_block_map_pressure");
+		assert(!retcode);
+		static const uint32_t s_size = 100;
+		check_block_map cbm(s_size, "/tmp/test_block_map_pressure");
+		bool taken = false;
+		for (uint32_t i = 0; i < 5000; i++) {
+			cbm.write(random() % s_size);
+			cbm.check_ring();
+			if (taken) {
+				cbm.read_snapshot("s", random() % s_size);
+			}
+			if (i % 150 == 0) {
+				if (taken) {
+					cbm.release_snapshot("s");
+				} else {
+					cbm.snapshot("s");
+				}
+				taken = !taken;
+			}
+		}
+		for (uint32_t logical = 0; logical < s_size; logical++) {
+			cbm.read(logical);
+			if (taken) {
+				cbm.read_snapshot("s", logical);
+			}
+		}
+	}
+}
+
+// Chunk files in a directory
+static std::set<string> chunk_files(const string& dir)
+{
+	std::set<string> names;
+	DIR* d = opendir(dir.c_str());
+	assert(d != NULL);
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (memcmp(de->d_name, "file_", 5) == 0) {
+			names.insert(de->d_name);
+		}
+	}
+	closedir(d);
+	return names;
+}
+
+// A bad footer under data stops the open with every chunk left in place,
+// only an empty chunk after an unsealed one is set aside, until the log is
+// past it
+static void recovery_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_recovery && mkdir /tmp/test_block_map_recovery");
+	assert(!retcode);
+	static const uint32_t s_size = 100;
+	const string dir = "/tmp/test_block_map_recovery";
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	uint64_t top;
+	{
+		block_map bm(key, s_size);
+		assert(bm.open(dir));
+		slice_t data(s_bytes_per_block);
+		for (uint32_t i = 0; i < 3 * s_size || bm.top() % (s_blocks_per_region * s_regions_per_chunk) == 0; i++) {
+			memset(data.buf(), int(i), data.size());
+			assert(bm.write(random() % s_size, data));
+		}
+		top = bm.top();
+	}
+	uint64_t final_chunk = top / (s_blocks_per_region * s_regions_per_chunk);
+	assert(final_chunk > 0);
+	string sealed = dir + "/file_" + std::to_string(final_chunk - 1);
+	string final = dir + "/file_" + std::to_string(final_chunk);
+	std::set<string> before = chunk_files(dir);
+	// The footer is at the very end of a sealed chunk
+	struct stat st;
+	assert(stat(sealed.c_str(), &st) == 0);
+	int fd = open(sealed.c_str(), O_RDWR);
+	assert(fd >= 0);
+	char c;
+	assert(pread(fd, &c, 1, st.st_size - 1) == 1);
+	c ^= 1;
+	assert(pwrite(fd, &c, 1, st.st_size - 1) == 1);
+	close(fd);
+	{
+		block_map bm(key, s_size);
+		assert(!bm.open(dir));
+	}
+	assert(chunk_files(dir) == before);
+	assert(access((dir + "/torn_" + std::to_string(final_chunk)).c_str(), F_OK) != 0);
+	// With nothing written after it, it looks like a crash during rollover
+	assert(truncate(final.c_str(), 0) == 0);
+	{
+		block_map bm(key, s_size);
+		assert(bm.open(dir));
+		assert(bm.top() < top);
+	}
+	assert(access((dir + "/torn_" + std::to_string(final_chunk)).c_str(), F_OK) == 0);
+	assert(chunk_files(dir).count("file_" + std::to_string(final_chunk - 1)));
+	// It goes once the log has moved past it, an open drops any left behind
+	{
+		block_map bm(key, s_size);
+		assert(bm.open(dir));
+		slice_t data(s_bytes_per_block);
+		for (uint32_t i = 0; i < 20 * s_size; i++) {
+			memset(data.buf(), int(i), data.size());
+			assert(bm.write(random() % s_size, data));
+		}
+	}
+	assert(!chunk_files(dir).count("file_" + std::to_string(final_chunk)));
+	assert(access((dir + "/torn_" + std::to_string(final_chunk)).c_str(), F_OK) != 0);
+	fd = open((dir + "/torn_0").c_str(), O_WRONLY | O_CREAT, 0666);
+	assert(fd >= 0);
+	close(fd);
+	{
+		block_map bm(key, s_size);
+		assert(bm.open(dir));
+	}
+	assert(access((dir + "/torn_0").c_str(), F_OK) != 0);
+}
+
+// A mirror added to a used log catches up, follows writes, rollovers and
+// removals, and then opens as the same disk
+static void mirror_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_mirror /tmp/test_block_map_mirror_copy && "
+		"mkdir /tmp/test_block_map_mirror");
+	assert(!retcode);
+	static const uint32_t s_size = 500;
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	std::map<uint32_t, char> check;
+	stat_totals_t before = stat_totals();
+	slice_t data(s_bytes_per_block);
+	for (int round = 0; round < 3; round++) {
+		block_map bm(key, s_size);
+		if (round > 0) {
+			bm.set_mirrors({ "/tmp/test_block_map_mirror_copy" });
+		}
+		assert(bm.open("/tmp/test_block_map_mirror"));
+		for (uint32_t i = 0; i < 2 * s_size; i++) {
+			uint32_t b = random() % s_size;
+			memset(data.buf(), int(i), data.size());
+			assert(bm.write(b, data));
+			check[b] = char(i);
+			if (i % 100 == 0) {
+				assert(bm.flush());
+			}
+		}
+	}
+	stat_totals_t after = stat_totals();
+	assert(after[stat_mirror_bytes] > before[stat_mirror_bytes]);
+	assert(chunk_files("/tmp/test_block_map_mirror") == chunk_files("/tmp/test_block_map_mirror_copy"));
+	block_map copy(key, s_size);
+	assert(copy.open("/tmp/test_block_map_mirror_copy"));
+	rslice_t got;
+	for (auto& kvp : check) {
+		assert(copy.read(kvp.first, got));
+		assert(got[0] == kvp.second && got[got.size() - 1] == kvp.second);
+	}
+	// A directory that isn't a copy of this log is never touched
+	retcode = system("rm -rf /tmp/test_block_map_mirror_other && mkdir /tmp/test_block_map_mirror_other && "
+		"echo keep > /tmp/test_block_map_mirror_other/file_0 && "
+		"echo keep > /tmp/test_block_map_mirror_other/notes");
+	assert(!retcode);
+	{
+		block_map bm(key, s_size);
+		bm.set_mirrors({ "/tmp/test_block_map_mirror_other" });
+		assert(bm.open("/tmp/test_block_map_mirror"));
+		assert(bm.write(0, data));
+		assert(bm.flush());
+	}
+	assert(chunk_files("/tmp/test_block_map_mirror_other") == std::set<string>({ "file_0" }));
+	assert(access("/tmp/test_block_map_mirror_other/mirror_of", F_OK) != 0);
+	retcode = system("grep -qx keep /tmp/test_block_map_mirror_other/file_0 && "
+		"grep -qx keep /tmp/test_block_map_mirror_other/notes");
+	assert(!retcode);
+}
+
+// The manifest's line for the final chunk
+static string manifest_live(const string& dir)
+{
+	FILE* f = fopen((dir + "/manifest").c_str(), "r");
+	assert(f != NULL);
+	char line[256];
+	string live;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strstr(line, " live ") != NULL) {
+			live = line;
+		}
+	}
+	fclose(f);
+	return live;
+}
+
+// The manifest lists the chunk files with the digests of the sealed ones,
+// and its generation keeps going up across opens
+static void manifest_test()
+{
+	int retcode = system("rm -rf /tmp/test_block_map_manifest && mkdir /tmp/test_block_map_manifest");
+	assert(!retcode);
+	static const uint32_t s_size = 500;
+	cipher_key_t key(slice_t("HelloWorldHelloWorldHelloWorld12"));
+	slice_t data(s_bytes_per_block);
+	uint64_t last_generation = 0;
+	string live;
+	for (int round = 0; round < 2; round++) {
+		{
+			block_map bm(key, s_size);
+			assert(bm.open("/tmp/test_block_map_manifest"));
+			for (uint32_t i = 0; i < 2 * s_size; i++) {
+				memset(data.buf(), int(i), data.size());
+				assert(bm.write(random() % s_size, data));
+			}
+			// A sync moves the live size without waiting for close
+			string before = manifest_live("/tmp/test_block_map_manifest");
+			assert(bm.flush());
+			string after = before;
+			for (int i = 0; i < 500 && after == before; i++) {
+				usleep(10000);
+				after = manifest_live("/tmp/test_block_map_manifest");
+			}
+			live = after;
+		}
+		assert(manifest_live("/tmp/test_block_map_manifest") == live);
+		FILE* f = fopen("/tmp/test_block_map_manifest/manifest", "r");
+		assert(f != NULL);
+		uintmax_t generation = 0;
+		assert(fscanf(f, "generation %ju\n", &generation) == 1);
+		assert(generation > last_generation);
+		last_generation = generation;
+		std::set<string> listed;
+		char name[64], state[16], hex[80];
+		intmax_t size;
+		while (fscanf(f, "%63s %15s %jd", name, state, &size) == 3) {
+			listed.insert(name);
+			string path = string("/tmp/test_block_map_manifest/") + name;
+			if (strcmp(state, "live") == 0) {
+				continue;
+			}
+			assert(strcmp(state, "sealed") == 0 && fscanf(f, "%79s", hex) == 1);
+			// Whatever the worker had time to digest matches the file
+			if (strcmp(hex, "-") != 0) {
+				slice_t whole(size);
+				int fd = open(path.c_str(), O_RDONLY);
+				assert(fd >= 0 && pread(fd, whole.buf(), size, 0) == size);
+				close(fd);
+				char want[80] = "";
+				rslice_t d = compute_digest(whole).cast();
+				for (size_t i = 0; i < d.size(); i++) {
+					sprintf(want + 2 * i, "%02x", (unsigned char) d[i]);
+				}
+				assert(strcmp(hex, want) == 0);
+				digest_t piecewise;
+				assert(chunk_manifest::digest_file(path, piecewise));
+				assert(piecewise == compute_digest(whole));
+			}
+		}
+		fclose(f);
+		assert(listed == chunk_files("/tmp/test_block_map_manifest"));
+	}
+}
+
 void test_block_map()
 {
 	int retcode = system("rm -rf /tmp/test_block_map");
@@ -82,6 +575,7 @@ void test_block_map()
 	assert(!retcode);
 	size_t size = 333;
 	check_block_map cbm(size, "/tmp/test_block_map");
+	stat_totals_t before = stat_totals();
 	for (size_t i = 0; i < 100000; i++) {
 		cbm.write(random() % size);
 		cbm.read(random() % size);
@@ -89,4 +583,114 @@ void test_block_map()
 			cbm.bounce();
 		}	
 	}
+	// Every log block is either a user write or a relocation, reads go both ways
+	stat_totals_t after = stat_totals();
+	assert(after[stat_user_writes] - before[stat_user_writes] == 100000);
+	assert(after[stat_user_reads] - before[stat_user_reads] == 200000);
+	assert(after[stat_blocks_appended] - before[stat_blocks_appended] == 
+		100000 + after[stat_relocations] - before[stat_relocations]);
+	assert(after[stat_relocations] > before[stat_relocations]);
+	// Now with short lived snapshots pinning old versions
+	// The ring only has room for about 'size' blocks of divergence
+	const char* names[] = { "a", "b" };
+	bool taken[] = { false, false };
+	for (size_t i = 0; i < 100000; i++) {
+		cbm.write(random() % size);
+		cbm.read(random() % size);
+		size_t which = random() % 2;
+		if (taken[which]) {
+			cbm.read_snapshot(names[which], random() % size);
+		}
+		if (i % 50 == 0) {
+			which = (i / 50) % 2;
+			if (taken[which]) {
+				cbm.release_snapshot(names[which]);
+			} else {
+				cbm.snapshot(names[which]);
+			}
+			taken[which] = !taken[which];
+		}
+		if (random() % 5000 == 0) {
+			cbm.bounce();
+			taken[0] = taken[1] = false;
+		}	
+	}
+
+	// And with the map paged through a one page cache, in a directory of its
+	// own since the first map is still open and keeps its spare chunk around
+	retcode = system("rm -rf /tmp/test_block_map_paged && mkdir /tmp/test_block_map_paged");
+	assert(!retcode);
+	check_block_map paged(size, "/tmp/test_block_map_paged", 1);
+	for (size_t i = 0; i < 100000; i++) {
+		paged.write(random() % size);
+		paged.read(random() % size);
+		if (random() % 100 == 0) {
+			paged.bounce();
+		}
+		if (random() % 1000 == 0) {
+			paged.bounce_without_index();
+		}
+		if (random() % 1000 == 0) {
+			paged.read_range(random() % (size - 100), 100);
+		}
+	}
+
+	// Bulk loading a fresh map, the runs cross region and chunk ends
+	retcode = system("rm -rf /tmp/test_block_map_bulk && mkdir /tmp/test_block_map_bulk");
+	assert(!retcode);
+	check_block_map bulk(size, "/tmp/test_block_map_bulk");
+	for (uint32_t first = 0; first < size; first += 37) {
+		bulk.append(first, std::min(37u, uint32_t(size) - first));
+	}
+	for (int round = 0; round < 2; round++) {
+		for (uint32_t logical = 0; logical < size; logical++) {
+			bulk.read(logical);
+		}
+		bulk.bounce();
+	}
+	for (size_t i = 0; i < 10000; i++) {
+		bulk.write(random() % size);
+		bulk.read(random() % size);
+	}
+
+	// And with only two chunk files open at a time, reads keep reopening them
+	retcode = system("rm -rf /tmp/test_block_map_fds && mkdir /tmp/test_block_map_fds");
+	assert(!retcode);
+	check_block_map few_fds(size, "/tmp/test_block_map_fds", 0, 2);
+	before = stat_totals();
+	for (size_t i = 0; i < 50000; i++) {
+		few_fds.write(random() % size);
+		few_fds.read(random() % size);
+		if (random() % 1000 == 0) {
+			few_fds.bounce();
+		}
+	}
+	after = stat_totals();
+	assert(after[stat_chunk_opens] > before[stat_chunk_opens]);
+
+	// Sequential passes get read ahead, writes in between must still win
+	before = stat_totals();
+	for (size_t pass = 0; pass < 20; pass++) {
+		for (uint32_t logical = 0; logical < size; logical++) {
+			few_fds.read(logical);
+			if (random() % 10 == 0) {
+				few_fds.write((logical + random() % 100) % size);
+			}
+		}
+		if (pass % 5 == 4) {
+			few_fds.bounce();
+		}
+	}
+	after = stat_totals();
+	assert(after[stat_readahead_hits] > before[stat_readahead_hits]);
+	assert(after[stat_readahead_hits] - before[stat_readahead_hits] <= 
+		after[stat_readahead_blocks] - before[stat_readahead_blocks]);
+
+	snapshot_pressure_test();
+	flush_test();
+	fragmentation_test();
+	verify_test();
+	recovery_test();
+	mirror_test();
+	manifest_test();
 }
@@ -73,11 +73,59 @@ void random_test(size_t size, size_t count)
 	assert(fb.find_set(size / 2) == size);
 }
 
+void range_test(size_t size, size_t count) 
+{
+	slow_bit sb(size);
+	vector<uint64_t> dense((size + 63) / 64);
+	for (size_t i = 0; i < count; i++) {
+		size_t x = random() % size;
+		sb.set(x, true);
+		dense[x / 64] |= uint64_t(1) << (x % 64);
+	}
+	fast_bit fb(size);
+	fb.assign(dense);
+	for (size_t i = 0; i < count; i++) {
+		size_t begin = random() % size;
+		size_t end = begin + random() % (size - begin + 1);
+		if (random() % 4 == 0) {
+			bool value = random() % 2;
+			fb.set_range(begin, end, value);
+			for (size_t x = begin; x < end; x++) {
+				sb.set(x, value);
+			}
+		}
+		size_t n = 0;
+		size_t last = begin;
+		fb.for_each_set(begin, end, [&](size_t x) {
+			assert(x >= last && x < end && sb.get(x));
+			last = x + 1;
+			n++;
+		});
+		size_t check = 0;
+		for (size_t x = begin; x < end; x++) {
+			check += sb.get(x);
+		}
+		assert(n == check);
+		assert(fb.count(begin, end) == check);
+		size_t start = random() % size;
+		assert(fb.find_set(start) == sb.find_set(start));
+	}
+}
+
 void test_fast_bit()
 {
 	printf("Doing test of fast_bit\n");
 	for (size_t c = 0; c < 100; c++) {
 		random_test(1001, 703);
 	}
+	// Hit word and level boundaries of the summary tree
+	size_t sizes[] = { 1, 63, 64, 65, 4095, 4096, 4097, 262145 };
+	for (size_t size : sizes) {
+		for (size_t c = 0; c < 10; c++) {
+			random_test(size, min(size / 2 + 1, size_t(2000)));
+			random_test(size, 3);
+			range_test(size, min(size / 2 + 1, size_t(200)));
+		}
+	}
 	printf("fast_bit worked!\n");
 }
@@ -0,0 +1,76 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+#include <stdio.h>
+#include <thread>
+
+// Every value lands in a bucket whose top is at or above it, and within 1/16
+static void bucket_test()
+{
+	uint32_t last = 0;
+	for (uint64_t v = 0; v < 100000; v++) {
+		uint32_t b = lat_histogram::bucket(v);
+		assert(b >= last && b < lat_histogram::s_buckets);
+		assert(lat_histogram::bucket_top(b) >= v);
+		assert(lat_histogram::bucket_top(b) - v <= v / 16);
+		last = b;
+	}
+	uint64_t big = ~uint64_t(0);
+	assert(lat_histogram::bucket(big) == lat_histogram::s_buckets - 1);
+	assert(lat_histogram::bucket_top(lat_histogram::s_buckets - 1) == big);
+}
+
+static void percentile_test()
+{
+	lat_histogram h;
+	for (uint64_t v = 1; v <= 1000; v++) {
+		h.add(v * 1000);
+	}
+	assert(h.count() == 1000);
+	uint64_t p50 = h.percentile(0.5);
+	assert(p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+	uint64_t p99 = h.percentile(0.99);
+	assert(p99 >= 990000 && p99 <= 990000 + 990000 / 16);
+	assert(h.max() >= 1000000 && h.max() <= 1000000 + 1000000 / 16);
+	lat_histogram early = h;
+	h.add(5);
+	h.subtract(early);
+	assert(h.count() == 1 && h.max() == 5);
+}
+
+// Samples from exited threads still count
+static void thread_test()
+{
+	uint64_t before = lat_totals()[lat_remove].count();
+	std::thread t([]() {
+		for (int i = 0; i < 10; i++) {
+			lat_timer timer(lat_remove);
+		}
+	});
+	t.join();
+	assert(lat_totals()[lat_remove].count() == before + 10);
+}
+
+void test_latency()
+{
+	printf("Doing test of latency\n");
+	bucket_test();
+	percentile_test();
+	thread_test();
+	printf("latency worked!\n");
+}
@@ -0,0 +1,73 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "slice.h"
+#include <thread>
+
+// Threads copy and drop references to the same buffers, the last one out
+// frees them into whichever thread's pool it happens to be on
+static void shared_test()
+{
+	static const size_t s_threads = 4;
+	static const size_t s_rounds = 1000;
+	for (size_t round = 0; round < s_rounds; round++) {
+		slice_t data(1024);
+		data[0] = char(round);
+		vector<std::thread> threads;
+		for (size_t t = 0; t < s_threads; t++) {
+			rslice_t mine = data;
+			threads.emplace_back([mine]() {
+				for (size_t i = 0; i < 100; i++) {
+					rslice_t copy = mine;
+					rslice_t part = copy.slice(1, 100);
+					assert(part.size() == 100);
+				}
+				assert(mine.size() == 1024);
+			});
+		}
+		data = slice_t();
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+}
+
+static void view_test()
+{
+	char buf[64];
+	memset(buf, 'x', sizeof(buf));
+	slice_t view = slice_t::wrap(buf, sizeof(buf));
+	view[0] = 'y';
+	assert(buf[0] == 'y');
+	// Growing a view moves it to a buffer of its own
+	view.push_back('z');
+	view[1] = 'y';
+	assert(buf[1] == 'x');
+	assert(view.size() == 65 && view[64] == 'z');
+
+	slice_t local = slice_t::local(16);
+	slice_t copy = local;
+	assert(copy.size() == 16 && copy[15] == 0);
+}
+
+void test_slice()
+{
+	printf("Doing test of slice\n");
+	view_test();
+	shared_test();
+	printf("slice worked!\n");
+}
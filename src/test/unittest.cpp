@@ -19,6 +19,8 @@
 #include <syslog.h>
 
 void test_fast_bit();
+void test_slice();
+void test_latency();
 void test_block_map();
 
 int main()
@@ -26,9 +28,12 @@ int main()
 	openlog("safedisk", LOG_PERROR, LOG_DAEMON);
 	printf("Hello world\n");
 	test_fast_bit();
-	// Before running test_block_map, it's probably a good idea to change
-	// File size params in block_file.h to hit the edge cases, and prevent the tests
-	// from taking forever
-	//test_block_map();
+	test_slice();
+	test_latency();
+	// test_block_map needs the small file size params in block_file.h to hit
+	// the edge cases without taking forever, './build test' builds with them
+#ifdef SAFEDISK_SMALL_GEOMETRY
+	test_block_map();
+#endif
 	return 0;
 }
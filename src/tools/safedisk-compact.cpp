@@ -0,0 +1,101 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Rewrites a container's live blocks in logical order and drops the rest of
+// the log.  Blocks are encrypted under IVs that come from their place in the
+// log, so a fresh log from position 0 would reuse IVs under the same key.  The
+// compacted copy goes on the top of the current log instead, like any other
+// write, and a crash at any point leaves a container that opens normally.
+
+#include "container.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char* s_usage =
+	"usage: safedisk-compact [--map_budget=bytes] [--open_chunks=N] <block_dir>\n"
+	"The password is read from the terminal, or from stdin when that isn't one\n";
+
+// Chunk files and the space they take, preallocation included
+static void log_usage(const string& dir, uint64_t& files_out, uint64_t& bytes_out)
+{
+	files_out = 0;
+	bytes_out = 0;
+	vector<uint64_t> ids;
+	list_chunks(dir, ids);
+	for (uint64_t chunk : ids) {
+		struct stat st;
+		if (stat((dir + "/file_" + std::to_string(chunk)).c_str(), &st) == 0) {
+			files_out++;
+			bytes_out += uint64_t(st.st_blocks) * 512;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-compact", LOG_PERROR, LOG_USER);
+	// Options go to the container as they would from safediskd
+	string options = "readahead=0";
+	string dir;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg.compare(0, 2, "--") == 0 && arg.find('=') != string::npos) {
+			options += "," + arg.substr(2);
+		} else if (arg[0] != '-' && dir.empty()) {
+			dir = arg;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	container_options opts;
+	if (dir.empty() || !opts.parse(options)) {
+		fprintf(stderr, "%s", s_usage);
+		return 1;
+	}
+	string pass;
+	if (!read_password(pass)) {
+		fprintf(stderr, "Unable to read password\n");
+		return 1;
+	}
+	unique_ptr<container> c = container::open(dir, pass, opts);
+	if (!c) {
+		fprintf(stderr, "Unable to open container %s\n", dir.c_str());
+		return 1;
+	}
+	block_map& bm = c->map();
+	uint64_t files;
+	uint64_t bytes;
+	log_usage(dir, files, bytes);
+	printf("before: chunks=%ju bytes=%ju fragmentation=%.3f\n", 
+		uintmax_t(files), uintmax_t(bytes), bm.fragmentation());
+	uint64_t start = now_nsecs();
+	if (!bm.compact()) {
+		fprintf(stderr, "Compaction failed, the container is still usable\n");
+		return 1;
+	}
+	c.reset();
+	double secs = (now_nsecs() - start) / 1e9;
+	log_usage(dir, files, bytes);
+	printf("after:  chunks=%ju bytes=%ju\n", uintmax_t(files), uintmax_t(bytes));
+	printf("%.3f s\n", secs);
+	return 0;
+}
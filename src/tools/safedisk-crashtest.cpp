@@ -0,0 +1,267 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes a workload, then recovers from simulated crashes at many points
+// Each crash keeps the sealed chunks and zeroes the final chunk from some byte
+// offset on, as if the tail never left the page cache and the preallocated
+// space reads back empty.  The recovered map must hold, for every block, the
+// last write that landed below the recovered top.
+
+#include "block_map.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static const char* s_usage =
+	"usage: safedisk-crashtest [--blocks=N] [--writes=N] [--points=N] [--seed=N] [--dir=path]\n";
+
+struct user_write
+{
+	uint32_t logical;
+	uint64_t phys;
+};
+
+static uint64_t xorshift(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+// Contents of write number 'which', so the model doesn't have to keep them
+static void fill(slice_t& data, uint64_t which)
+{
+	uint64_t state = which * 2654435761u + 1;
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = char(xorshift(state));
+	}
+}
+
+static string chunk_name(const string& dir, uint64_t chunk)
+{
+	return dir + "/file_" + std::to_string(chunk);
+}
+
+// Offset just past the last non-zero byte, encrypted data is never long zero
+static off_t data_end(int fd, off_t size)
+{
+	char buf[65536];
+	while (size > 0) {
+		off_t start = size > off_t(sizeof(buf)) ? size - sizeof(buf) : 0;
+		if (!pread_fully(fd, buf, size - start, start)) {
+			return size;
+		}
+		for (off_t i = size - start; i > 0; i--) {
+			if (buf[i - 1]) {
+				return start + i;
+			}
+		}
+		size = start;
+	}
+	return 0;
+}
+
+// Recovery may have started a new chunk, it has to go before the next cut
+static void remove_new_chunks(const string& dir, uint64_t final_chunk)
+{
+	vector<uint64_t> ids;
+	list_chunks(dir, ids);
+	for (uint64_t chunk : ids) {
+		if (chunk > final_chunk) {
+			unlink(chunk_name(dir, chunk).c_str());
+		}
+	}
+}
+
+static bool copy_file(const string& from, const string& to)
+{
+	int in = open(from.c_str(), O_RDONLY);
+	int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	bool ok = in >= 0 && out >= 0;
+	char buf[65536];
+	ssize_t n = 0;
+	while (ok && (n = read(in, buf, sizeof(buf))) > 0) {
+		ok = write_fully(out, buf, n);
+	}
+	ok = ok && n == 0;
+	if (in >= 0) {
+		close(in);
+	}
+	if (out >= 0) {
+		close(out);
+	}
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-crashtest", LOG_PERROR, LOG_USER);
+	uint64_t blocks = 4096;
+	uint64_t writes = 300000;
+	uint64_t points = 100;
+	uint64_t seed = 1;
+	string dir = "/tmp/safedisk_crashtest";
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		string value = eq == string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--blocks" && (blocks = strtoull(value.c_str(), NULL, 10)) != 0 && blocks < 0x80000000) {
+		} else if (key == "--writes" && (writes = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (key == "--points" && (points = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (key == "--seed" && (seed = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (key == "--dir" && !value.empty()) {
+			dir = value;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	string run_dir = dir + "/run";
+	string crash_dir = dir + "/crash";
+	if (system(("rm -rf " + dir + " && mkdir -p " + run_dir + " " + crash_dir).c_str()) != 0) {
+		fprintf(stderr, "Unable to make directory: %s\n", dir.c_str());
+		return 1;
+	}
+	cipher_key_t key(slice_t("CrashCrashCrashCrashCrashCrash12"));
+
+	// Run the workload, remembering where each write's own block landed
+	vector<user_write> model;
+	model.reserve(writes);
+	{
+		block_map bm(key, blocks);
+		if (!bm.open(run_dir)) {
+			fprintf(stderr, "Unable to open block_map in %s\n", run_dir.c_str());
+			return 1;
+		}
+		slice_t data(s_bytes_per_block);
+		uint64_t state = seed;
+		for (uint64_t i = 0; i < writes; i++) {
+			uint32_t logical = xorshift(state) % blocks;
+			fill(data, i);
+			if (!bm.write(logical, data)) {
+				fprintf(stderr, "Workload write %ju failed\n", uintmax_t(i));
+				return 1;
+			}
+			model.push_back(user_write{ logical, bm.top() - 1 });
+		}
+	}
+
+	// Sealed chunks never change, link them, the final one gets cut down
+	vector<uint64_t> run_chunks;
+	if (!list_chunks(run_dir, run_chunks) || run_chunks.empty()) {
+		fprintf(stderr, "Unable to list chunks in %s\n", run_dir.c_str());
+		return 1;
+	}
+	uint64_t final_chunk = run_chunks.back();
+	for (uint64_t chunk : run_chunks) {
+		bool ok = chunk == final_chunk ? 
+			copy_file(chunk_name(run_dir, chunk), chunk_name(crash_dir, chunk)) :
+			link(chunk_name(run_dir, chunk).c_str(), chunk_name(crash_dir, chunk).c_str()) == 0;
+		if (!ok) {
+			fprintf(stderr, "Unable to set up chunk %ju: %s\n", uintmax_t(chunk), strerror(errno));
+			return 1;
+		}
+	}
+	string final_name = chunk_name(crash_dir, final_chunk);
+	int fd = open(final_name.c_str(), O_RDWR);
+	off_t file_size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+	if (file_size < 0) {
+		fprintf(stderr, "Unable to size %s\n", final_name.c_str());
+		return 1;
+	}
+	// Chunks are preallocated, the data ends where the zeros start
+	off_t final_size = data_end(fd, file_size);
+
+	// Cutting only ever zeroes more, so go from the end towards the start.
+	// Recovery drops partial blocks, which a smaller cut would drop anyway.
+	vector<off_t> cuts = { final_size, 0 };
+	uint64_t state = seed;
+	for (uint64_t i = 0; i < points; i++) {
+		cuts.push_back(xorshift(state) % (final_size + 1));
+	}
+	std::sort(cuts.rbegin(), cuts.rend());
+	cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+	// Old chunks are only removed once the final chunk is synced, so no crash
+	// can bring the top back below where the last removal happened.  The map
+	// keeps twice the logical size, so that's where the oldest chunk left is
+	// just about to go.
+	uint64_t floor = run_chunks.front() == 0 ? 0 :
+		run_chunks.front() * s_blocks_per_region * s_regions_per_chunk + 2 * blocks;
+
+	printf("chunks=%zu final_size=%jd writes=%ju\n", run_chunks.size(), intmax_t(final_size), uintmax_t(writes));
+	printf("%12s %12s %10s %s\n", "cut", "top", "open_ms", "result");
+	uint64_t failures = 0;
+	uint64_t unreachable = 0;
+	double total_ms = 0;
+	double max_ms = 0;
+	slice_t expect(s_bytes_per_block);
+	char buf[s_bytes_per_block];
+	for (off_t cut : cuts) {
+		if (ftruncate(fd, cut) != 0 || ftruncate(fd, file_size) != 0) {
+			fprintf(stderr, "Unable to truncate %s: %s\n", final_name.c_str(), strerror(errno));
+			return 1;
+		}
+		uint64_t start = now_nsecs();
+		block_map bm(key, blocks);
+		bool ok = bm.open(crash_dir);
+		double ms = (now_nsecs() - start) / 1e6;
+		total_ms += ms;
+		max_ms = std::max(max_ms, ms);
+		uint64_t top = bm.top();
+		if (ok && top < floor) {
+			printf("%12jd %12ju %10.3f unreachable\n", intmax_t(cut), uintmax_t(top), ms);
+			unreachable++;
+			remove_new_chunks(crash_dir, final_chunk);
+			continue;
+		}
+		// The newest write below the recovered top wins for each block
+		vector<int64_t> newest(blocks, -1);
+		for (uint64_t i = 0; i < model.size(); i++) {
+			if (model[i].phys < top) {
+				newest[model[i].logical] = i;
+			}
+		}
+		uint32_t bad = 0;
+		for (uint32_t logical = 0; ok && logical < blocks; logical++) {
+			if (newest[logical] < 0) {
+				memset(expect.buf(), 0, expect.size());
+			} else {
+				fill(expect, newest[logical]);
+			}
+			if (!bm.read_into(logical, slice_t::wrap(buf, sizeof(buf))) || memcmp(buf, expect.buf(), sizeof(buf)) != 0) {
+				bad++;
+			}
+		}
+		ok = ok && bad == 0;
+		failures += ok ? 0 : 1;
+		printf("%12jd %12ju %10.3f %s", intmax_t(cut), uintmax_t(top), ms, ok ? "ok\n" : "FAILED");
+		if (!ok) {
+			printf(", %u bad blocks\n", bad);
+		}
+		remove_new_chunks(crash_dir, final_chunk);
+	}
+	close(fd);
+	printf("points=%zu unreachable=%ju failures=%ju open_ms avg=%.3f max=%.3f\n", 
+		cuts.size(), uintmax_t(unreachable), uintmax_t(failures), total_ms / cuts.size(), max_ms);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,234 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes a volume, or a byte range of it, out as a plain image.  Threads read
+// and decrypt batches with block_map::read_range while this one writes them
+// out in order.  A regular output file is sized up front and zero blocks are
+// never written, so it comes out sparse, anything else gets every byte.
+
+#include "container.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+
+static const char* s_usage =
+	"usage: safedisk-export [--volume=name] [--offset=bytes] [--length=bytes] [--threads=N]\n"
+	"                       [--map_budget=bytes] [--open_chunks=N] <block_dir> <file|->\n"
+	"The password is read from the terminal, or from stdin when that isn't one\n";
+
+static const uint32_t s_batch_blocks = 1024;  // Blocks each thread reads at once
+
+// A batch being read, or read and waiting its turn to be written
+struct batch_slot
+{
+	bool    ready = false;
+	bool    ok = false;
+	slice_t data;
+};
+
+static bool all_zero(const char* buf, size_t size)
+{
+	return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+// Writes buf at offset, skipping block sized runs of zeros, the file already
+// reads as zeros there
+static bool write_sparse(int fd, const char* buf, size_t size, off_t offset, uint64_t& written_out)
+{
+	size_t pos = 0;
+	while (pos < size) {
+		size_t len = std::min(size - pos, size_t(s_bytes_per_block));
+		if (all_zero(buf + pos, len)) {
+			pos += len;
+			continue;
+		}
+		// Gather the data up to the next zero block
+		size_t start = pos;
+		while (pos < size && !all_zero(buf + pos, (len = std::min(size - pos, size_t(s_bytes_per_block))))) {
+			pos += len;
+		}
+		if (!pwrite_fully(fd, buf + start, pos - start, offset + start)) {
+			return false;
+		}
+		written_out += pos - start;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-export", LOG_PERROR, LOG_USER);
+	// Other options go to the container as they would from safediskd
+	string options = "readahead=0";
+	string volume;
+	uint64_t offset = 0;
+	uint64_t length = uint64_t(-1);
+	uint64_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+	string dir;
+	string out_name;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		string value = eq == string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--volume" && !value.empty()) {
+			volume = value;
+		} else if (key == "--offset" && parse_size(value, offset)) {
+		} else if (key == "--length" && parse_size(value, length)) {
+		} else if (key == "--threads" && (threads = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (arg.compare(0, 2, "--") == 0 && eq != string::npos) {
+			options += "," + arg.substr(2);
+		} else if ((arg[0] != '-' || arg == "-") && (dir.empty() || out_name.empty())) {
+			(dir.empty() ? dir : out_name) = arg;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	container_options opts;
+	if (out_name.empty() || !opts.parse(options)) {
+		fprintf(stderr, "%s", s_usage);
+		return 1;
+	}
+	string pass;
+	if (!read_password(pass)) {
+		fprintf(stderr, "Unable to read password\n");
+		return 1;
+	}
+	unique_ptr<container> c = container::open(dir, pass, opts);
+	if (!c) {
+		fprintf(stderr, "Unable to open container %s\n", dir.c_str());
+		return 1;
+	}
+	const volume_info* vi = volume.empty() ? &c->volumes()[0] : c->find_volume(volume);
+	if (vi == NULL) {
+		fprintf(stderr, "No volume named %s\n", volume.c_str());
+		return 1;
+	}
+	uint64_t volume_bytes = uint64_t(vi->blocks) * s_bytes_per_block;
+	if (offset > volume_bytes) {
+		fprintf(stderr, "Offset is past the end of %s\n", vi->name.c_str());
+		return 1;
+	}
+	length = std::min(length, volume_bytes - offset);
+	if (length == 0) {
+		return 0;
+	}
+
+	int fd = out_name == "-" ? 1 : open(out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", out_name.c_str(), strerror(errno));
+		return 1;
+	}
+	bool sparse = S_ISREG(st.st_mode) && out_name != "-";
+	if (sparse && ftruncate(fd, length) != 0) {
+		fprintf(stderr, "Unable to size %s: %s\n", out_name.c_str(), strerror(errno));
+		return 1;
+	}
+
+	// Batches cover whole blocks, the ends get trimmed when written
+	uint64_t first_block = offset / s_bytes_per_block;
+	uint64_t end_block = (offset + length + s_bytes_per_block - 1) / s_bytes_per_block;
+	uint64_t batches = (end_block - first_block + s_batch_blocks - 1) / s_batch_blocks;
+	vector<batch_slot> slots(2 * threads);
+	std::mutex lock;
+	std::condition_variable cv;  // A batch read or a slot freed
+	uint64_t written = 0;        // Batches written out so far
+	bool stop = false;
+	std::atomic<uint64_t> next(0);
+	block_map& bm = c->map();
+	uint64_t start = now_nsecs();
+	vector<std::thread> workers;
+	for (uint64_t t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			uint64_t b;
+			while ((b = next++) < batches) {
+				batch_slot& slot = slots[b % slots.size()];
+				{
+					// The slot is free once the batch a lap ahead is written
+					std::unique_lock<std::mutex> l(lock);
+					cv.wait(l, [&] { return stop || b < written + slots.size(); });
+					if (stop) {
+						return;
+					}
+				}
+				uint64_t block = first_block + b * s_batch_blocks;
+				uint32_t count = std::min(uint64_t(s_batch_blocks), end_block - block);
+				if (slot.data.size() != count * s_bytes_per_block) {
+					slot.data = slice_t(count * s_bytes_per_block);
+				}
+				bool ok = bm.read_range(vi->base + block, count, slot.data);
+				std::lock_guard<std::mutex> l(lock);
+				slot.ok = ok;
+				slot.ready = true;
+				cv.notify_all();
+			}
+		});
+	}
+
+	uint64_t bytes_written = 0;
+	bool ok = true;
+	for (uint64_t b = 0; b < batches && ok; b++) {
+		batch_slot& slot = slots[b % slots.size()];
+		{
+			std::unique_lock<std::mutex> l(lock);
+			cv.wait(l, [&] { return slot.ready; });
+		}
+		uint64_t pos = (first_block + b * s_batch_blocks) * s_bytes_per_block;
+		uint64_t from = std::max(pos, offset);
+		uint64_t to = std::min(pos + slot.data.size(), offset + length);
+		const char* buf = slot.data.buf() + (from - pos);
+		if (!slot.ok) {
+			fprintf(stderr, "Unable to read blocks at byte %ju\n", uintmax_t(from));
+			ok = false;
+		} else if (sparse) {
+			ok = write_sparse(fd, buf, to - from, from - offset, bytes_written);
+		} else {
+			ok = write_fully(fd, buf, to - from);
+			bytes_written += to - from;
+		}
+		if (!ok && slot.ok) {
+			fprintf(stderr, "Unable to write %s: %s\n", out_name.c_str(), strerror(errno));
+		}
+		std::lock_guard<std::mutex> l(lock);
+		slot.ready = false;
+		written++;
+		stop = !ok;
+		cv.notify_all();
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
+	double secs = (now_nsecs() - start) / 1e9;
+	if (fd != 1 && close(fd) != 0) {
+		fprintf(stderr, "Unable to close %s: %s\n", out_name.c_str(), strerror(errno));
+		ok = false;
+	}
+	if (!ok) {
+		return 1;
+	}
+	fprintf(stderr, "%.1f MB exported, %.1f MB of it data, in %.3f s, %.1f MB/s on %ju threads\n",
+		length / 1e6, bytes_written / 1e6, secs, length / 1e6 / std::max(secs, 1e-9), uintmax_t(threads));
+	return 0;
+}
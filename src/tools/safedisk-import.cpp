@@ -0,0 +1,278 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Makes a new container holding a raw image.  This thread reads the image in
+// batches and drops the zero blocks, holes in a sparse file aren't even read.
+// Each batch gets its place in the log as it's read, so threads can encrypt
+// batches in any order, and one more appends them whole, footers and all.
+// Every block is written once to a fresh log, so nothing ever needs cleaning.
+
+#include "container.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+
+static const char* s_usage =
+	"usage: safedisk-import [--volume=name] [--size=bytes] [--threads=N]\n"
+	"                       [--map_budget=bytes] [--open_chunks=N] [--kdf_ms=N] [--kdf_memory=bytes]\n"
+	"                       <block_dir> <image|->\n"
+	"The volume is as big as the image, --size is needed when it isn't a file\n"
+	"The password is read from the terminal, or from stdin when that isn't one\n";
+
+static const uint32_t s_batch_blocks = 1024;  // Blocks read and encrypted at once
+
+// A batch on its way from the image to the log
+struct batch_slot
+{
+	enum { free, read, encrypted } state = free;
+	uint64_t physical = 0;    // Where in the log it goes
+	vector<uint32_t> logical;
+	slice_t  blocks;          // Only the blocks that aren't all zero
+	slice_t  records;
+};
+
+static bool all_zero(const char* buf, size_t size)
+{
+	return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+// Reads up to size bytes, less only at the end of the image
+static ssize_t read_some(int fd, char* buf, size_t size, off_t offset, bool seekable)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t r = seekable ? pread(fd, buf + done, size - done, offset + done) : read(fd, buf + done, size - done);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-import", LOG_PERROR, LOG_USER);
+	// Other options go to the container as they would from safediskd
+	string options = "readahead=0";
+	string volume = s_default_volume;
+	uint64_t size = 0;
+	uint64_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+	string dir;
+	string in_name;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		string value = eq == string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--volume" && !value.empty()) {
+			volume = value;
+		} else if (key == "--size" && parse_size(value, size) && size != 0) {
+		} else if (key == "--threads" && (threads = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (arg.compare(0, 2, "--") == 0 && eq != string::npos) {
+			options += "," + arg.substr(2);
+		} else if ((arg[0] != '-' || arg == "-") && (dir.empty() || in_name.empty())) {
+			(dir.empty() ? dir : in_name) = arg;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	container_options opts;
+	if (in_name.empty() || !opts.parse(options)) {
+		fprintf(stderr, "%s", s_usage);
+		return 1;
+	}
+	int fd = in_name == "-" ? 0 : open(in_name.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", in_name.c_str(), strerror(errno));
+		return 1;
+	}
+	bool seekable = S_ISREG(st.st_mode) && in_name != "-";
+	if (size == 0 && seekable) {
+		size = st.st_size;
+	}
+	uint64_t blocks = (size + s_bytes_per_block - 1) / s_bytes_per_block;
+	if (blocks == 0 || blocks >= 0x80000000) {
+		fprintf(stderr, "%s", size ? "Image is too big\n" : s_usage);
+		return 1;
+	}
+	if (in_name == "-" && !isatty(0)) {
+		fprintf(stderr, "The password can't come from stdin along with the image\n");
+		return 1;
+	}
+	string pass;
+	if (!read_password(pass, true)) {
+		fprintf(stderr, "Unable to read password\n");
+		return 1;
+	}
+	vector<volume_info> volumes = { volume_info{ volume, 0, uint32_t(blocks) } };
+	unique_ptr<container> c = container::create(dir, volumes, pass, opts);
+	if (!c) {
+		fprintf(stderr, "Unable to create container %s\n", dir.c_str());
+		return 1;
+	}
+	block_map& bm = c->map();
+	uint32_t base = c->volumes()[0].base;
+
+	vector<batch_slot> slots(2 * threads + 2);
+	std::mutex lock;
+	std::condition_variable cv;  // Any slot changed state, or stopping
+	deque<uint64_t> to_encrypt;  // Batch numbers
+	uint64_t batches = 0;        // Read so far
+	bool done_reading = false;
+	bool failed = false;
+	uint64_t start = now_nsecs();
+
+	vector<std::thread> workers;
+	for (uint64_t t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			std::unique_lock<std::mutex> l(lock);
+			while (true) {
+				cv.wait(l, [&] { return failed || done_reading || !to_encrypt.empty(); });
+				if (failed || to_encrypt.empty()) {
+					return;
+				}
+				batch_slot& slot = slots[to_encrypt.front() % slots.size()];
+				to_encrypt.pop_front();
+				l.unlock();
+				slot.records = bm.encrypt_run(slot.physical, slot.logical, slot.blocks);
+				l.lock();
+				slot.state = batch_slot::encrypted;
+				cv.notify_all();
+			}
+		});
+	}
+	uint64_t data_blocks = 0;
+	std::thread writer([&] {
+		for (uint64_t b = 0; ; b++) {
+			batch_slot& slot = slots[b % slots.size()];
+			{
+				std::unique_lock<std::mutex> l(lock);
+				cv.wait(l, [&] { return failed || slot.state == batch_slot::encrypted || (done_reading && b == batches); });
+				if (failed || slot.state != batch_slot::encrypted) {
+					return;
+				}
+			}
+			bool ok = bm.append_run(slot.physical, slot.logical, slot.records);
+			data_blocks += slot.logical.size();
+			std::lock_guard<std::mutex> l(lock);
+			slot.state = batch_slot::free;
+			failed = failed || !ok;
+			cv.notify_all();
+		}
+	});
+
+	// Read batches in order, each one goes in the log right after the last
+	uint64_t physical = bm.top();
+	uint64_t bytes_read = 0;
+	slice_t buf(s_batch_blocks * s_bytes_per_block);
+	bool ok = true;
+	for (uint64_t block = 0; block < blocks && ok; ) {
+		if (seekable) {
+			// Jump over holes, or stop when there's no more data
+			off_t data = lseek(fd, block * s_bytes_per_block, SEEK_DATA);
+			if (data < 0 && errno == ENXIO) {
+				break;
+			}
+			if (data > 0) {
+				block = std::max(block, uint64_t(data) / s_bytes_per_block);
+			}
+			if (block >= blocks) {
+				break;
+			}
+		}
+		uint32_t count = std::min(uint64_t(s_batch_blocks), blocks - block);
+		size_t want = std::min(uint64_t(count) * s_bytes_per_block, size - block * s_bytes_per_block);
+		ssize_t got = read_some(fd, buf.buf(), want, block * s_bytes_per_block, seekable);
+		if (got < 0) {
+			fprintf(stderr, "Unable to read %s: %s\n", in_name.c_str(), strerror(errno));
+			ok = false;
+			break;
+		}
+		bytes_read += got;
+		memset(buf.buf() + got, 0, count * s_bytes_per_block - got);
+		vector<uint32_t> logical;
+		for (uint32_t i = 0; i < count; i++) {
+			if (!all_zero(buf.buf() + i * s_bytes_per_block, s_bytes_per_block)) {
+				logical.push_back(base + block + i);
+			}
+		}
+		block += count;
+		if (size_t(got) < want) {
+			blocks = block;  // The image ended early, the rest reads as zeros
+		}
+		if (logical.empty()) {
+			continue;
+		}
+		std::unique_lock<std::mutex> l(lock);
+		batch_slot& slot = slots[batches % slots.size()];
+		cv.wait(l, [&] { return failed || slot.state == batch_slot::free; });
+		if (failed) {
+			break;
+		}
+		l.unlock();
+		slot.physical = physical;
+		slot.blocks = slice_t(logical.size() * s_bytes_per_block);
+		for (size_t i = 0; i < logical.size(); i++) {
+			memcpy(slot.blocks.buf() + i * s_bytes_per_block,
+				buf.buf() + (logical[i] - base - (block - count)) * s_bytes_per_block, s_bytes_per_block);
+		}
+		physical += logical.size();
+		slot.logical.swap(logical);
+		l.lock();
+		slot.state = batch_slot::read;
+		to_encrypt.push_back(batches++);
+		cv.notify_all();
+	}
+	{
+		std::lock_guard<std::mutex> l(lock);
+		done_reading = true;
+		failed = failed || !ok;
+		cv.notify_all();
+	}
+	writer.join();
+	for (auto& w : workers) {
+		w.join();
+	}
+	if (failed) {
+		fprintf(stderr, "Import failed, %s is incomplete\n", dir.c_str());
+		return 1;
+	}
+	if (!c->flush()) {
+		fprintf(stderr, "Unable to flush %s\n", dir.c_str());
+		return 1;
+	}
+	c.reset();
+	double secs = (now_nsecs() - start) / 1e9;
+	fprintf(stderr, "%.1f MB read, %.1f MB of it data, in %.3f s, %.1f MB/s on %ju threads\n",
+		bytes_read / 1e6, data_blocks * s_bytes_per_block / 1e6, secs,
+		bytes_read / 1e6 / std::max(secs, 1e-9), uintmax_t(threads));
+	return 0;
+}
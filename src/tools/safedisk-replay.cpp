@@ -0,0 +1,193 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a recorded trace, or blkparse output, against a fresh block_map
+
+#include "block_map.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+static const char* s_usage =
+	"usage: safedisk-replay [--blkparse] [--timing=fast|original] [--blocks=N] "
+	"[--map_budget=bytes] [--dir=path] <trace>\n";
+
+// Takes queued requests ('Q') from the default blkparse output format:
+//   8,0  3  1  0.000000000  697  Q  WS 3802848 + 8 [jbd2/sda1-8]
+static bool load_blkparse(const string& path, vector<trace_record>& out)
+{
+	FILE* f = fopen(path.c_str(), "r");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char dev[32], action[8], rwbs[8];
+		unsigned cpu, seq, pid;
+		double secs;
+		unsigned long long sector, count;
+		int n = sscanf(line, "%31s %u %u %lf %u %7s %7s %llu + %llu", 
+			dev, &cpu, &seq, &secs, &pid, action, rwbs, &sector, &count);
+		if (n != 9 || strcmp(action, "Q") != 0) {
+			continue;
+		}
+		trace_record r;
+		if (strchr(rwbs, 'W')) {
+			r.op = trace_write;
+		} else if (strchr(rwbs, 'R')) {
+			r.op = trace_read;
+		} else {
+			continue;  // Flushes, discards and such
+		}
+		r.nsecs = uint64_t(secs * 1e9);
+		r.offset = sector * 512;
+		r.length = uint32_t(count * 512);
+		out.push_back(r);
+	}
+	fclose(f);
+	return true;
+}
+
+static bool load_trace(const string& path, vector<trace_record>& out)
+{
+	trace_reader reader;
+	if (!reader.open(path)) {
+		return false;
+	}
+	trace_record r;
+	while (reader.next(r)) {
+		out.push_back(r);
+	}
+	return true;
+}
+
+static double percentile_us(const vector<uint64_t>& sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(size_t(p * sorted.size()), sorted.size() - 1)] / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-replay", LOG_PERROR, LOG_USER);
+	bool blkparse = false;
+	bool original = false;
+	uint64_t blocks = 0;
+	size_t map_budget = 0;
+	string dir = "/tmp/safedisk_replay";
+	string path;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		string key = arg.substr(0, eq);
+		string value = eq == string::npos ? "" : arg.substr(eq + 1);
+		if (key == "--blkparse") {
+			blkparse = true;
+		} else if (key == "--timing" && (value == "fast" || value == "original")) {
+			original = value == "original";
+		} else if (key == "--blocks" && (blocks = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (key == "--map_budget" && (map_budget = strtoull(value.c_str(), NULL, 10)) != 0) {
+		} else if (key == "--dir" && !value.empty()) {
+			dir = value;
+		} else if (arg[0] != '-' && path.empty()) {
+			path = arg;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	if (path.empty()) {
+		fprintf(stderr, "%s", s_usage);
+		return 1;
+	}
+
+	vector<trace_record> records;
+	if (!(blkparse ? load_blkparse(path, records) : load_trace(path, records))) {
+		return 1;
+	}
+	// Size the map to cover the trace unless told otherwise
+	uint64_t end = 0;
+	for (const auto& r : records) {
+		end = std::max(end, r.offset + r.length);
+	}
+	if (blocks == 0) {
+		blocks = std::max((end + s_bytes_per_block - 1) / s_bytes_per_block, uint64_t(1));
+	}
+	if (blocks >= 0x80000000) {
+		fprintf(stderr, "Trace too large, %ju blocks\n", uintmax_t(blocks));
+		return 1;
+	}
+	if (system(("rm -rf " + dir + " && mkdir " + dir).c_str()) != 0) {
+		fprintf(stderr, "Unable to make directory: %s\n", dir.c_str());
+		return 1;
+	}
+	block_map bm(cipher_key_t(slice_t("ReplayReplayReplayReplayReplay12")), blocks, map_budget);
+	if (!bm.open(dir)) {
+		fprintf(stderr, "Unable to open block_map in %s\n", dir.c_str());
+		return 1;
+	}
+
+	slice_t data(s_bytes_per_block);
+	char buf[s_bytes_per_block];
+	vector<uint64_t> latency;
+	latency.reserve(records.size());
+	uint64_t bytes = 0;
+	uint64_t skipped = 0;
+	uint64_t start = now_nsecs();
+	for (const auto& r : records) {
+		if (original) {
+			// Hold each request until its time comes around again
+			uint64_t now = now_nsecs() - start;
+			if (r.nsecs > now) {
+				struct timespec ts = { time_t((r.nsecs - now) / 1000000000), long((r.nsecs - now) % 1000000000) };
+				nanosleep(&ts, NULL);
+			}
+		}
+		// Requests that aren't block aligned touch every block they overlap
+		uint64_t first = r.offset / s_bytes_per_block;
+		uint64_t last = (r.offset + r.length + s_bytes_per_block - 1) / s_bytes_per_block;
+		if (last > blocks) {
+			skipped++;
+			continue;
+		}
+		uint64_t op_start = now_nsecs();
+		for (uint64_t block = first; block < last; block++) {
+			bool ok = r.op == trace_write ? 
+				bm.write(block, data) : 
+				bm.read_into(block, slice_t::wrap(buf, sizeof(buf)));
+			if (!ok) {
+				fprintf(stderr, "Replay failed at block %ju\n", uintmax_t(block));
+				return 1;
+			}
+		}
+		latency.push_back(now_nsecs() - op_start);
+		bytes += (last - first) * s_bytes_per_block;
+	}
+	double secs = (now_nsecs() - start) / 1e9;
+	std::sort(latency.begin(), latency.end());
+	printf("requests=%zu skipped=%ju blocks=%ju\n", latency.size(), uintmax_t(skipped), uintmax_t(blocks));
+	printf("%.3f s  %.2f MB/s  %.0f IOPS  p50=%.1fus p99=%.1fus p999=%.1fus\n",
+		secs, bytes / secs / 1e6, latency.size() / secs,
+		percentile_us(latency, 0.5), percentile_us(latency, 0.99), percentile_us(latency, 0.999));
+	return 0;
+}
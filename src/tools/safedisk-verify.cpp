@@ -0,0 +1,192 @@
+/*  Safedisk
+ *  Copyright (C) 2014  Jeremy Bruestle
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks a container's log without opening it: every block tag, every region
+// and chunk footer, and that the footers list the same logical blocks as the
+// block headers.  Nothing is written, so it's safe on a container in use,
+// though the final chunk may then look like it ends early.  Regions are
+// spread over threads, each one a single read, with the next ones hinted to
+// the kernel so the disk stays busy while the threads decrypt.
+
+#include "container.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <thread>
+
+static const char* s_usage =
+	"usage: safedisk-verify [--threads=N] <block_dir>\n"
+	"The password is read from the terminal, or from stdin when that isn't one\n";
+
+// One piece of work, a region or the footers of a whole chunk
+struct unit
+{
+	uint64_t chunk;
+	uint64_t region;
+	bool     footers;
+	bool     final;
+	block_file::verify_result result;
+};
+
+static string chunk_name(const string& dir, uint64_t chunk)
+{
+	return dir + "/file_" + std::to_string(chunk);
+}
+
+int main(int argc, char** argv)
+{
+	openlog("safedisk-verify", LOG_PERROR, LOG_USER);
+	uint64_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+	string dir;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg.compare(0, 10, "--threads=") == 0 && (threads = strtoull(arg.c_str() + 10, NULL, 10)) != 0) {
+		} else if (arg[0] != '-' && dir.empty()) {
+			dir = arg;
+		} else {
+			fprintf(stderr, "%s", s_usage);
+			return 1;
+		}
+	}
+	if (dir.empty()) {
+		fprintf(stderr, "%s", s_usage);
+		return 1;
+	}
+	string pass;
+	if (!read_password(pass)) {
+		fprintf(stderr, "Unable to read password\n");
+		return 1;
+	}
+	cipher_key_t key;
+	if (!container::unlock(dir, pass, key)) {
+		fprintf(stderr, "Unable to unlock container %s\n", dir.c_str());
+		return 1;
+	}
+	vector<uint64_t> ids;
+	if (!list_chunks(dir, ids)) {
+		fprintf(stderr, "Unable to list %s: %s\n", dir.c_str(), strerror(errno));
+		return 1;
+	}
+	if (ids.empty()) {
+		printf("chunks=0 blocks=0, nothing written yet\n");
+		return 0;
+	}
+
+	// The final chunk is still being written unless it has its footer
+	vector<string> problems;
+	uint64_t final_chunk = ids.back();
+	bool final_sealed = false;
+	{
+		int fd = open(chunk_name(dir, final_chunk).c_str(), O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Unable to open chunk %ju: %s\n", uintmax_t(final_chunk), strerror(errno));
+			return 1;
+		}
+		cipher_ctx_t ctx(key);
+		block_file::verify_result r;
+		block_file::verify_chunk_footer(ctx, fd, final_chunk, true, r);
+		final_sealed = r.footer;
+		close(fd);
+	}
+	vector<unit> units;
+	for (uint64_t chunk = ids.front(); chunk <= final_chunk; chunk++) {
+		if (!std::binary_search(ids.begin(), ids.end(), chunk)) {
+			problems.push_back("chunk " + std::to_string(chunk) + ": missing");
+			continue;
+		}
+		bool final = chunk == final_chunk && !final_sealed;
+		if (!final) {
+			units.push_back(unit{ chunk, 0, true, false, {} });
+		}
+		for (uint64_t region = 0; region < s_regions_per_chunk; region++) {
+			units.push_back(unit{ chunk, region, false, final, {} });
+		}
+	}
+
+	// Threads take units in order, so the ones after this thread's are
+	// about to be read by the others
+	uint64_t start = now_nsecs();
+	std::atomic<size_t> next(0);
+	vector<std::thread> workers;
+	for (uint64_t t = 0; t < threads; t++) {
+		workers.emplace_back([&] {
+			cipher_ctx_t ctx(key);
+			uint64_t open_chunk = 0;
+			int fd = -1;
+			size_t i;
+			while ((i = next++) < units.size()) {
+				unit& u = units[i];
+				if (fd < 0 || open_chunk != u.chunk) {
+					if (fd >= 0) {
+						close(fd);
+					}
+					open_chunk = u.chunk;
+					fd = open(chunk_name(dir, u.chunk).c_str(), O_RDONLY);
+					if (fd < 0) {
+						u.result.problems.push_back("chunk " + std::to_string(u.chunk) +
+							": unable to open, " + strerror(errno));
+						continue;
+					}
+				}
+				for (size_t ahead = i + 1; ahead <= i + threads && ahead < units.size(); ahead++) {
+					if (units[ahead].chunk == u.chunk && !units[ahead].footers) {
+						block_file::prefetch_region(fd, units[ahead].region);
+					}
+				}
+				if (u.footers) {
+					block_file::verify_chunk_footer(ctx, fd, u.chunk, u.final, u.result);
+				} else {
+					block_file::verify_region(ctx, fd, u.chunk, u.region, u.final, u.result);
+				}
+			}
+			if (fd >= 0) {
+				close(fd);
+			}
+		});
+	}
+	for (auto& w : workers) {
+		w.join();
+	}
+	double secs = (now_nsecs() - start) / 1e9;
+
+	uint64_t blocks = 0;
+	uint64_t bytes = 0;
+	bool ended = false;  // Passed the end of the log in the final chunk
+	for (unit& u : units) {
+		problems.insert(problems.end(), u.result.problems.begin(), u.result.problems.end());
+		if (!u.footers) {
+			blocks += u.result.blocks;
+		}
+		bytes += u.result.bytes;
+		if (u.final && ended && u.result.blocks) {
+			problems.push_back("chunk " + std::to_string(u.chunk) + " region " + std::to_string(u.region) +
+				": good blocks past the end of the log");
+		}
+		ended = ended || (u.final && !u.result.footer);
+	}
+	for (const string& p : problems) {
+		printf("%s\n", p.c_str());
+	}
+	printf("chunks=%zu blocks=%ju problems=%zu\n", ids.size(), uintmax_t(blocks), problems.size());
+	printf("%.1f MB in %.3f s, %.1f MB/s on %ju threads\n",
+		bytes / 1e6, secs, bytes / 1e6 / std::max(secs, 1e-9), uintmax_t(threads));
+	return problems.empty() ? 0 : 1;
+}